@@ -0,0 +1,518 @@
+#include <stdlib.h>
+#include <string.h>
+#include "ansi.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+// The parser is a table: every byte falls into a class, and the state and class pick the
+// next state and what to do with the byte. Only SGR (`ESC [ ... m`) changes anything;
+// every other CSI, OSC and two-byte escape is recognised and dropped so it does not end up
+// in scrollback as garbage. In the ground state, text up to the next ESC, newline or tab is
+// found with a vector scan and copied in one piece. Tabs are expanded to spaces the way a
+// terminal would, so every byte of a line is one cell when it is wrapped on screen.
+
+enum
+{
+    S_GROUND, // Must be 0, the table's empty entries drop back here
+    S_ESCAPE,
+    S_ESCAPE_INTER, // ESC followed by intermediates, like the charset selection `ESC ( B`
+    S_CSI,
+    S_CSI_IGNORE, // A private or malformed CSI, skipped up to its final byte
+    S_OSC,        // Window titles and the like, up to BEL or ESC backslash
+    STATE_COUNT
+};
+
+enum
+{
+    C_TEXT,
+    C_ESC,
+    C_NEWLINE,
+    C_DIGIT,
+    C_SEPARATOR,
+    C_PRIVATE,
+    C_INTER,
+    C_CSI_OPEN,
+    C_OSC_OPEN,
+    C_FINAL,
+    C_BEL,
+    C_TAB,
+    C_CONTROL,
+    CLASS_COUNT
+};
+
+enum
+{
+    A_NONE,
+    A_PRINT,
+    A_NEWLINE,
+    A_TAB,
+    A_START,
+    A_DIGIT,
+    A_SEPARATOR,
+    A_DISPATCH
+};
+
+static const uint8_t byte_class[256] = {
+    [0x00 ... 0x06] = C_CONTROL,
+    [0x07] = C_BEL,
+    [0x08] = C_CONTROL,
+    [0x09] = C_TAB,
+    [0x0A] = C_NEWLINE,
+    [0x0B ... 0x1A] = C_CONTROL,
+    [0x1B] = C_ESC,
+    [0x1C ... 0x1F] = C_CONTROL,
+    [0x20 ... 0x2F] = C_INTER,
+    [0x30 ... 0x39] = C_DIGIT,
+    [0x3A ... 0x3B] = C_SEPARATOR, // `38:5:n` is the same as `38;5;n`
+    [0x3C ... 0x3F] = C_PRIVATE,
+    [0x40 ... 0x7E] = C_FINAL,
+    ['['] = C_CSI_OPEN,
+    [']'] = C_OSC_OPEN,
+    [0x7F] = C_CONTROL,
+    // 0x80 and up are text
+};
+
+#define T(state, action) ((state) | (action) << 4)
+
+static const uint8_t transitions[STATE_COUNT][CLASS_COUNT] = {
+    [S_GROUND] = {
+        [C_TEXT] = T(S_GROUND, A_PRINT),
+        [C_ESC] = T(S_ESCAPE, A_NONE),
+        [C_NEWLINE] = T(S_GROUND, A_NEWLINE),
+        [C_DIGIT] = T(S_GROUND, A_PRINT),
+        [C_SEPARATOR] = T(S_GROUND, A_PRINT),
+        [C_PRIVATE] = T(S_GROUND, A_PRINT),
+        [C_INTER] = T(S_GROUND, A_PRINT),
+        [C_CSI_OPEN] = T(S_GROUND, A_PRINT),
+        [C_OSC_OPEN] = T(S_GROUND, A_PRINT),
+        [C_FINAL] = T(S_GROUND, A_PRINT),
+        [C_BEL] = T(S_GROUND, A_PRINT),
+        [C_TAB] = T(S_GROUND, A_TAB),
+        [C_CONTROL] = T(S_GROUND, A_PRINT), // Carriage returns stay in the text
+    },
+    [S_ESCAPE] = {
+        [C_ESC] = T(S_ESCAPE, A_NONE),
+        [C_NEWLINE] = T(S_GROUND, A_NEWLINE),
+        [C_INTER] = T(S_ESCAPE_INTER, A_NONE),
+        [C_CSI_OPEN] = T(S_CSI, A_START),
+        [C_OSC_OPEN] = T(S_OSC, A_NONE),
+        [C_TAB] = T(S_ESCAPE, A_NONE),
+        [C_CONTROL] = T(S_ESCAPE, A_NONE),
+    },
+    [S_ESCAPE_INTER] = {
+        [C_ESC] = T(S_ESCAPE, A_NONE),
+        [C_NEWLINE] = T(S_GROUND, A_NEWLINE),
+        [C_INTER] = T(S_ESCAPE_INTER, A_NONE),
+        [C_TAB] = T(S_ESCAPE_INTER, A_NONE),
+        [C_CONTROL] = T(S_ESCAPE_INTER, A_NONE),
+    },
+    [S_CSI] = {
+        [C_ESC] = T(S_ESCAPE, A_NONE),
+        [C_NEWLINE] = T(S_GROUND, A_NEWLINE),
+        [C_DIGIT] = T(S_CSI, A_DIGIT),
+        [C_SEPARATOR] = T(S_CSI, A_SEPARATOR),
+        [C_PRIVATE] = T(S_CSI_IGNORE, A_NONE),
+        [C_INTER] = T(S_CSI_IGNORE, A_NONE),
+        [C_CSI_OPEN] = T(S_GROUND, A_DISPATCH),
+        [C_OSC_OPEN] = T(S_GROUND, A_DISPATCH),
+        [C_FINAL] = T(S_GROUND, A_DISPATCH),
+        [C_BEL] = T(S_CSI, A_NONE),
+        [C_TAB] = T(S_CSI, A_NONE),
+        [C_CONTROL] = T(S_CSI, A_NONE),
+    },
+    [S_CSI_IGNORE] = {
+        [C_ESC] = T(S_ESCAPE, A_NONE),
+        [C_NEWLINE] = T(S_GROUND, A_NEWLINE),
+        [C_DIGIT] = T(S_CSI_IGNORE, A_NONE),
+        [C_SEPARATOR] = T(S_CSI_IGNORE, A_NONE),
+        [C_PRIVATE] = T(S_CSI_IGNORE, A_NONE),
+        [C_INTER] = T(S_CSI_IGNORE, A_NONE),
+        [C_BEL] = T(S_CSI_IGNORE, A_NONE),
+        [C_TAB] = T(S_CSI_IGNORE, A_NONE),
+        [C_CONTROL] = T(S_CSI_IGNORE, A_NONE),
+    },
+    [S_OSC] = {
+        [C_TEXT] = T(S_OSC, A_NONE),
+        [C_ESC] = T(S_ESCAPE, A_NONE), // ESC backslash ends it through the escape state
+        [C_NEWLINE] = T(S_GROUND, A_NEWLINE), // An unterminated title must not eat the output
+        [C_DIGIT] = T(S_OSC, A_NONE),
+        [C_SEPARATOR] = T(S_OSC, A_NONE),
+        [C_PRIVATE] = T(S_OSC, A_NONE),
+        [C_INTER] = T(S_OSC, A_NONE),
+        [C_CSI_OPEN] = T(S_OSC, A_NONE),
+        [C_OSC_OPEN] = T(S_OSC, A_NONE),
+        [C_FINAL] = T(S_OSC, A_NONE),
+        [C_TAB] = T(S_OSC, A_NONE),
+        [C_CONTROL] = T(S_OSC, A_NONE),
+    },
+};
+
+// First ESC, newline or tab in [p, end), or `end`
+typedef const char *(*Scan_Fn)(const char *p, const char *end);
+
+static const char *find_special_scalar(const char *p, const char *end)
+{
+    for (; p < end; p++)
+        if (*p == '\n' || *p == '\033' || *p == '\t')
+            return p;
+    return end;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__((target("sse2"))) static const char *find_special_sse2(const char *p, const char *end)
+{
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i esc = _mm_set1_epi8('\033');
+    const __m128i tab = _mm_set1_epi8('\t');
+    for (; end - p >= 16; p += 16)
+    {
+        __m128i block = _mm_loadu_si128((const __m128i *)p);
+        __m128i hits = _mm_or_si128(_mm_cmpeq_epi8(block, newline), _mm_cmpeq_epi8(block, esc));
+        uint32_t mask = _mm_movemask_epi8(_mm_or_si128(hits, _mm_cmpeq_epi8(block, tab)));
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+    return find_special_scalar(p, end);
+}
+
+__attribute__((target("avx2"))) static const char *find_special_avx2(const char *p, const char *end)
+{
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const __m256i esc = _mm256_set1_epi8('\033');
+    const __m256i tab = _mm256_set1_epi8('\t');
+    for (; end - p >= 32; p += 32)
+    {
+        __m256i block = _mm256_loadu_si256((const __m256i *)p);
+        __m256i hits = _mm256_or_si256(_mm256_cmpeq_epi8(block, newline), _mm256_cmpeq_epi8(block, esc));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_or_si256(hits, _mm256_cmpeq_epi8(block, tab)));
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+    return find_special_sse2(p, end);
+}
+
+#endif
+
+static Scan_Fn scan_kernel;
+static const char *scan_kernel_name;
+
+// Pick the widest kernel this CPU can run, once
+static void choose_kernel(void)
+{
+    scan_kernel = find_special_scalar;
+    scan_kernel_name = "scalar";
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        scan_kernel = find_special_avx2;
+        scan_kernel_name = "avx2";
+    }
+    else if (__builtin_cpu_supports("sse2"))
+    {
+        scan_kernel = find_special_sse2;
+        scan_kernel_name = "sse2";
+    }
+#endif
+}
+
+const char *ansi_kernel_name(void)
+{
+    if (scan_kernel == NULL)
+        choose_kernel();
+    return scan_kernel_name;
+}
+
+void init_ansi_parser(Ansi_Parser *parser, Ansi_Line_Fn emit, void *arg)
+{
+    *parser = (Ansi_Parser){.emit = emit, .arg = arg};
+    if (scan_kernel == NULL)
+        choose_kernel();
+}
+
+void free_ansi_parser(Ansi_Parser *parser)
+{
+    free(parser->text);
+    free(parser->runs);
+    parser->text = NULL;
+    parser->runs = NULL;
+    parser->size = parser->length = 0;
+    parser->run_size = parser->run_count = 0;
+}
+
+static bool same_attrs(const Attr_Run *a, const Attr_Run *b)
+{
+    return a->fg == b->fg && a->bg == b->bg && a->flags == b->flags;
+}
+
+// Start a run at the end of the line if the attributes changed since the last one
+static void mark_run(Ansi_Parser *parser)
+{
+    static const Attr_Run plain = {0};
+    Attr_Run *last = parser->run_count ? &parser->runs[parser->run_count - 1] : NULL;
+    if (same_attrs(last ? last : &plain, &parser->current) || parser->length > UINT32_MAX)
+        return;
+    if (last == NULL || last->column != parser->length)
+    {
+        if (parser->run_count == parser->run_size)
+        {
+            size_t size = parser->run_size ? parser->run_size * 2 : 16;
+            Attr_Run *grown = realloc(parser->runs, size * sizeof(Attr_Run));
+            if (grown == NULL)
+                return; // Shown without colors rather than abort mid-stream
+            parser->runs = grown;
+            parser->run_size = size;
+        }
+        last = &parser->runs[parser->run_count++];
+    }
+    *last = parser->current;
+    last->column = parser->length;
+}
+
+static void append_text(Ansi_Parser *parser, const char *data, size_t n)
+{
+    if (parser->changed)
+    {
+        mark_run(parser);
+        parser->changed = false;
+    }
+    if (parser->length + n > parser->size)
+    {
+        size_t size = parser->size ? parser->size * 2 : ANSI_MIN_LINE;
+        while (size < parser->length + n)
+            size *= 2;
+        char *grown = realloc(parser->text, size);
+        if (grown == NULL)
+            return; // Drop the fragment rather than abort mid-stream
+        parser->text = grown;
+        parser->size = size;
+    }
+    memcpy(parser->text + parser->length, data, n);
+    parser->length += n;
+}
+
+static void emit_line(Ansi_Parser *parser)
+{
+    parser->emit(parser->text, parser->length, parser->runs, parser->run_count, parser->arg);
+    parser->length = 0;
+    parser->run_count = 0;
+    parser->changed = true; // Colors still on carry over to the next line
+}
+
+// Nearest of the 16 ANSI colors to an RGB value, as a run color (1 to 16)
+static uint8_t nearest_color(int r, int g, int b)
+{
+    int max = r > g ? (r > b ? r : b) : (g > b ? g : b);
+    int color = (r >= 128) | (g >= 128) << 1 | (b >= 128) << 2;
+    if (color == 0)
+        return max >= 64 ? 1 + 8 : 1; // Dark gray or black
+    return 1 + color + (max >= 192 ? 8 : 0);
+}
+
+static uint8_t color_256(int n)
+{
+    static const int levels[6] = {0, 95, 135, 175, 215, 255};
+    if (n < 16)
+        return 1 + n;
+    if (n < 232)
+    {
+        n -= 16;
+        return nearest_color(levels[n / 36], levels[n / 6 % 6], levels[n % 6]);
+    }
+    int gray = 8 + 10 * (n - 232);
+    return nearest_color(gray, gray, gray);
+}
+
+// `38;5;n` or `38;2;r;g;b` (and the same for 48) starting at params[i]. Returns how many
+// parameters were used after the 38.
+static int extended_color(const Ansi_Parser *parser, int i, uint8_t *color)
+{
+    const int *p = parser->params;
+    if (i + 2 < parser->param_count && p[i + 1] == 5)
+    {
+        *color = color_256(p[i + 2] & 0xFF);
+        return 2;
+    }
+    if (i + 4 < parser->param_count && p[i + 1] == 2)
+    {
+        *color = nearest_color(p[i + 2], p[i + 3], p[i + 4]);
+        return 4;
+    }
+    return parser->param_count - i - 1; // Malformed, skip the rest
+}
+
+// Apply `ESC [ ... m` to the current attributes
+static void apply_sgr(Ansi_Parser *parser)
+{
+    Attr_Run *a = &parser->current;
+    if (parser->param_count == 0)
+        parser->params[parser->param_count++] = 0; // `ESC [ m` resets
+    for (int i = 0; i < parser->param_count; i++)
+    {
+        int p = parser->params[i];
+        if (p == 0)
+            a->fg = a->bg = a->flags = 0;
+        else if (p == 1)
+            a->flags |= ATTR_BOLD;
+        else if (p == 2)
+            a->flags |= ATTR_DIM;
+        else if (p == 3)
+            a->flags |= ATTR_ITALIC;
+        else if (p == 4)
+            a->flags |= ATTR_UNDERLINE;
+        else if (p == 5 || p == 6)
+            a->flags |= ATTR_BLINK;
+        else if (p == 7)
+            a->flags |= ATTR_REVERSE;
+        else if (p == 21 || p == 22)
+            a->flags &= ~(ATTR_BOLD | ATTR_DIM);
+        else if (p == 23)
+            a->flags &= ~ATTR_ITALIC;
+        else if (p == 24)
+            a->flags &= ~ATTR_UNDERLINE;
+        else if (p == 25)
+            a->flags &= ~ATTR_BLINK;
+        else if (p == 27)
+            a->flags &= ~ATTR_REVERSE;
+        else if (p >= 30 && p <= 37)
+            a->fg = 1 + p - 30;
+        else if (p == 38)
+            i += extended_color(parser, i, &a->fg);
+        else if (p == 39)
+            a->fg = 0;
+        else if (p >= 40 && p <= 47)
+            a->bg = 1 + p - 40;
+        else if (p == 48)
+            i += extended_color(parser, i, &a->bg);
+        else if (p == 49)
+            a->bg = 0;
+        else if (p >= 90 && p <= 97)
+            a->fg = 1 + 8 + p - 90;
+        else if (p >= 100 && p <= 107)
+            a->bg = 1 + 8 + p - 100;
+    }
+    parser->changed = true;
+}
+
+// `[ params final` after an ESC when all of it is in [p, end) and it is a plain CSI, which
+// is almost every sequence `ls` and `grep` write. Parsed in one tight loop instead of a
+// table step per byte. Returns where the sequence ends, or NULL to leave it to the table.
+static const char *fast_csi(Ansi_Parser *parser, const char *p, const char *end)
+{
+    if (p == end || *p != '[')
+        return NULL;
+    int count = 0;
+    int value = 0;
+    bool any = false;
+    for (p++; p < end; p++)
+    {
+        unsigned char c = *p;
+        if (c >= '0' && c <= '9')
+        {
+            value = value * 10 + (c - '0');
+            if (value > ANSI_MAX_PARAM)
+                value = ANSI_MAX_PARAM;
+            any = true;
+        }
+        else if (c == ';' || c == ':')
+        {
+            if (count < ANSI_MAX_PARAMS)
+                parser->params[count++] = value;
+            value = 0;
+            any = true;
+        }
+        else if (c >= 0x40 && c <= 0x7E)
+        {
+            if (any && count < ANSI_MAX_PARAMS)
+                parser->params[count++] = value;
+            parser->param_count = count;
+            if (c == 'm')
+                apply_sgr(parser);
+            return p + 1;
+        }
+        else
+            return NULL;
+    }
+    return NULL;
+}
+
+// Parse `n` more bytes of output, calling the parser's emit function for every line they
+// complete. Returns the number of lines.
+size_t ansi_feed(Ansi_Parser *parser, const char *data, size_t n)
+{
+    size_t lines = 0;
+    const char *p = data;
+    const char *end = data + n;
+    unsigned state = parser->state; // Kept out of the struct while the loop runs
+    while (p < end)
+    {
+        if (state == S_GROUND)
+        {
+            const char *stop = scan_kernel(p, end);
+            if (stop > p)
+                append_text(parser, p, stop - p);
+            p = stop;
+            if (p == end)
+                break;
+            const char *after = *p == '\033' ? fast_csi(parser, p + 1, end) : NULL;
+            if (after != NULL)
+            {
+                p = after;
+                continue;
+            }
+        }
+
+        unsigned char c = *p++;
+        uint8_t t = transitions[state][byte_class[c]];
+        state = t & 0x0F;
+        switch (t >> 4)
+        {
+        case A_PRINT:
+            append_text(parser, (const char *)&c, 1);
+            break;
+        case A_NEWLINE:
+            emit_line(parser);
+            lines++;
+            break;
+        case A_TAB:
+            append_text(parser, "        ", ANSI_TAB_WIDTH - parser->length % ANSI_TAB_WIDTH);
+            break;
+        case A_START:
+            parser->param_count = 0;
+            break;
+        case A_DIGIT:
+            if (parser->param_count == 0)
+                parser->params[parser->param_count++] = 0;
+            int *param = &parser->params[parser->param_count - 1];
+            *param = *param * 10 + (c - '0');
+            if (*param > ANSI_MAX_PARAM)
+                *param = ANSI_MAX_PARAM;
+            break;
+        case A_SEPARATOR:
+            if (parser->param_count == 0)
+                parser->params[parser->param_count++] = 0; // `ESC [ ; 1 m` has an empty first one
+            if (parser->param_count < ANSI_MAX_PARAMS)
+                parser->params[parser->param_count++] = 0;
+            break;
+        case A_DISPATCH:
+            if (c == 'm')
+                apply_sgr(parser);
+            break;
+        }
+    }
+    parser->state = state;
+    return lines;
+}
+
+// Emit the text after the last newline as a line of its own. Returns true if there was any.
+bool ansi_finish(Ansi_Parser *parser)
+{
+    parser->state = S_GROUND;
+    if (parser->length == 0)
+        return false;
+    emit_line(parser);
+    return true;
+}
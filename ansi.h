@@ -0,0 +1,64 @@
+#ifndef ANSI_H
+#define ANSI_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define ANSI_MAX_PARAMS 16       // Parameters kept from one CSI sequence, the rest are dropped
+#define ANSI_MAX_PARAM 65535     // Parameter values are clamped here instead of overflowing
+#define ANSI_MIN_LINE 256        // Starting size of the line being assembled
+#define ANSI_TAB_WIDTH 8         // Tab stops, tabs are stored as the spaces up to the next one
+
+// Attribute flags of a run
+#define ATTR_BOLD 0x01
+#define ATTR_DIM 0x02
+#define ATTR_ITALIC 0x04
+#define ATTR_UNDERLINE 0x08
+#define ATTR_BLINK 0x10
+#define ATTR_REVERSE 0x20
+
+// How the text from `column` up to the next run's column is drawn. Colors are 0 for the
+// terminal's default and 1 to 16 for the 16 ANSI colors; 256-color and RGB colors are
+// mapped to the nearest of those. Packed so runs can sit right after a line's text.
+typedef struct __attribute__((packed))
+{
+    uint32_t column; // Byte offset in the line where the run starts
+    uint8_t fg;
+    uint8_t bg;
+    uint8_t flags;   // ATTR_* bits
+    uint8_t unused;
+} Attr_Run;
+
+// Called with every complete line, its escape sequences taken out and its colors as runs
+typedef void (*Ansi_Line_Fn)(const char *text, size_t len, const Attr_Run *runs, size_t run_count, void *arg);
+
+// Turns a stream of child output into lines. Sequences and lines may be split across any
+// number of feeds, and colors carry over from one line to the next like on a terminal.
+typedef struct
+{
+    uint8_t state;
+    int params[ANSI_MAX_PARAMS];
+    int param_count;
+    Attr_Run current; // Attributes in effect, `column` unused
+    bool changed;     // `current` may differ from the last run, checked at the next text
+
+    char *text; // The line being assembled
+    size_t length;
+    size_t size;
+    Attr_Run *runs;
+    size_t run_count;
+    size_t run_size;
+
+    Ansi_Line_Fn emit;
+    void *arg;
+} Ansi_Parser;
+
+// Function prototypes
+void init_ansi_parser(Ansi_Parser *parser, Ansi_Line_Fn emit, void *arg);
+size_t ansi_feed(Ansi_Parser *parser, const char *data, size_t n);
+bool ansi_finish(Ansi_Parser *parser);
+void free_ansi_parser(Ansi_Parser *parser);
+const char *ansi_kernel_name(void);
+
+#endif // ANSI_H
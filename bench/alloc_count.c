@@ -0,0 +1,78 @@
+// Preloaded into the shell by bench/allocs: counts every call to the allocator in a
+// counter that lives in the file named by $ALLOC_COUNT_FILE, so the bench can read it
+// while the shell runs. Not a benchmark itself, the Makefile builds it as a shared object.
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define ALLOC_COUNT_ENV "ALLOC_COUNT_FILE"
+
+// glibc's own allocator, under the names it keeps for interposers like this one
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+static uint64_t early;              // Allocations before the file is mapped
+static uint64_t *counter = &early;
+
+static void count(void)
+{
+    __atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+}
+
+// Map the counter, and keep the programs the shell starts from loading this too
+__attribute__((constructor)) static void map_counter(void)
+{
+    const char *path = getenv(ALLOC_COUNT_ENV);
+    int fd = path ? open(path, O_RDWR | O_CLOEXEC) : -1;
+    void *map = fd != -1 ? mmap(NULL, sizeof(uint64_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    if (fd != -1)
+        close(fd);
+    if (map != MAP_FAILED)
+        counter = map;
+    unsetenv("LD_PRELOAD");
+    unsetenv(ALLOC_COUNT_ENV);
+}
+
+void *malloc(size_t size)
+{
+    count();
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+    count();
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size)
+{
+    count();
+    return __libc_realloc(p, size);
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+    count();
+    return __libc_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    count();
+    return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **p, size_t alignment, size_t size)
+{
+    count();
+    *p = __libc_memalign(alignment, size);
+    return *p ? 0 : ENOMEM;
+}
@@ -0,0 +1,321 @@
+// Checks that editing the command line does not allocate. Drives build/main through a
+// pseudo-terminal with the allocator counter from alloc_count.c preloaded, types, moves,
+// deletes, walks the history and clears the line, and fails if the shell made any
+// allocation while it did. One round goes first to warm up and is not counted.
+//
+// usage: allocs [path/to/main [path/to/alloc_count.so]]
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#define ROWS 40
+#define COLS 120
+#define ROUNDS 100
+#define ESC_DELAY_MS 25    // ESCDELAY for the shell, so a lone Esc is not held for a second
+#define QUIET_MS 500       // The shell counts as idle once it allocates nothing for this long
+#define ECHO_MS 1000       // Longest wait for a key to be drawn before typing the next one
+#define TIMEOUT_MS 30000
+#define KEY_F2 "\033OQ"    // Quits the shell
+#define KEY_BACKSPACE "\177"
+#define KEY_ESC "\033"
+#define SYNC_KEY "}"       // Typed after a round, drawn only once the shell read every key
+
+// One round of editing, each entry one key as xterm sends it in keypad mode
+static const char *const round_keys[] = {
+    "e", "c", "h", "o", " ", "h", "e", "l", "l", "o", " ", "w", "o", "r", "l", "d",
+    "\033OD", "\033OD", "\033OD", "\033OD", "\033OD",   // Left
+    "\033OC", "\033OC", "\033OC",                       // Right
+    KEY_BACKSPACE, KEY_BACKSPACE, KEY_BACKSPACE,
+    "\033OH", "\033OF",                                 // Home, End
+    "\033OA", "\033OA", "\033OA", "\033OB", "\033OB",   // Up, Down through the history
+    KEY_ESC,                                            // Clear the line
+};
+
+// Entries for Up and Down to walk through
+static const char history_entries[] = "echo one\nls -l /tmp\necho two three\n";
+
+static int master = -1;
+static pid_t shell_pid;
+static volatile uint64_t *allocations;
+static char home[] = "/tmp/my-shell-allocs-XXXXXX"; // Throwaway $HOME, with the counter file
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void send_text(const char *text)
+{
+    size_t len = strlen(text);
+    while (len > 0)
+    {
+        ssize_t n = write(master, text, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+        {
+            perror("write");
+            exit(EXIT_FAILURE);
+        }
+        text += n;
+        len -= n;
+    }
+}
+
+// Read the shell's output until `marker` shows up
+static void wait_for(const char *marker)
+{
+    size_t marker_len = strlen(marker);
+    char tail[64] = ""; // End of the previous read, for markers split across reads
+    size_t tail_len = 0;
+    char buffer[65536 + sizeof(tail)];
+
+    while (1)
+    {
+        struct pollfd pfd = {.fd = master, .events = POLLIN};
+        int ready = poll(&pfd, 1, TIMEOUT_MS);
+        if (ready == 0)
+        {
+            fprintf(stderr, "timed out waiting for `%s`\n", marker);
+            kill(shell_pid, SIGKILL);
+            exit(EXIT_FAILURE);
+        }
+        if (ready < 0)
+            continue;
+
+        memcpy(buffer, tail, tail_len);
+        ssize_t n = read(master, buffer + tail_len, sizeof(buffer) - tail_len);
+        if (n <= 0)
+        {
+            fprintf(stderr, "shell exited while waiting for `%s`\n", marker);
+            exit(EXIT_FAILURE);
+        }
+        size_t len = tail_len + n;
+        if (memmem(buffer, len, marker, marker_len))
+            return;
+
+        tail_len = marker_len - 1 < len ? marker_len - 1 : len;
+        memcpy(tail, buffer + len - tail_len, tail_len);
+    }
+}
+
+// Wait until the shell has read everything typed so far, then take the marker back out
+static void sync_keys(void)
+{
+    send_text(SYNC_KEY);
+    wait_for(SYNC_KEY);
+    send_text(KEY_BACKSPACE);
+}
+
+// Keep the terminal drained until the shell has stopped allocating, so the prompt's
+// worker and anything else left from startup is done before counting starts
+static void wait_until_quiet(void)
+{
+    long long deadline = now_ns() + TIMEOUT_MS * 1000000LL;
+    uint64_t last = *allocations;
+    long long quiet_since = now_ns();
+    while (now_ns() - quiet_since < QUIET_MS * 1000000LL)
+    {
+        if (now_ns() > deadline)
+        {
+            fprintf(stderr, "the shell never stopped allocating\n");
+            kill(shell_pid, SIGKILL);
+            exit(EXIT_FAILURE);
+        }
+        char buffer[4096];
+        struct pollfd pfd = {.fd = master, .events = POLLIN};
+        if (poll(&pfd, 1, 50) > 0 && read(master, buffer, sizeof(buffer)) <= 0)
+        {
+            fprintf(stderr, "shell exited during startup\n");
+            exit(EXIT_FAILURE);
+        }
+        if (*allocations != last)
+        {
+            last = *allocations;
+            quiet_since = now_ns();
+        }
+    }
+}
+
+// Press one key and wait for the shell to draw something in answer. Keys sent in one burst
+// would be taken for a paste, which puts the escape sequences back as plain bytes.
+static void press(const char *key)
+{
+    send_text(key);
+    char buffer[4096];
+    struct pollfd pfd = {.fd = master, .events = POLLIN};
+    if (poll(&pfd, 1, ECHO_MS) > 0 && read(master, buffer, sizeof(buffer)) <= 0)
+    {
+        fprintf(stderr, "shell exited while typing\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Type one round. Returns the number of keys sent.
+static int type_round(void)
+{
+    size_t keys = sizeof(round_keys) / sizeof(round_keys[0]);
+    for (size_t i = 0; i < keys; i++)
+        press(round_keys[i]);
+    sync_keys();
+    return keys + 2;
+}
+
+// A counter file shared with the shell, mapped here to read it
+static void map_counter(const char *path)
+{
+    int fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd == -1 || ftruncate(fd, sizeof(uint64_t)) == -1)
+    {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    void *map = mmap(NULL, sizeof(uint64_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+    allocations = map;
+}
+
+static void home_file(char *path, size_t size, const char *name)
+{
+    snprintf(path, size, "%s/%s", home, name);
+}
+
+// Remove $HOME and what is in it, however the run ends
+static void remove_home(void)
+{
+    char path[sizeof(home) + 32];
+    home_file(path, sizeof(path), ".my-shell_history");
+    unlink(path);
+    home_file(path, sizeof(path), "allocations");
+    unlink(path);
+    rmdir(home);
+}
+
+// Start the shell on a new pty in /tmp with $HOME holding a short history
+static void start_shell(const char *binary, const char *preload, const char *counter)
+{
+    char path[sizeof(home) + 32];
+    home_file(path, sizeof(path), ".my-shell_history");
+    FILE *f = fopen(path, "w");
+    if (f == NULL || fputs(history_entries, f) == EOF || fclose(f) == EOF)
+    {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+
+    master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (master == -1 || grantpt(master) == -1 || unlockpt(master) == -1)
+    {
+        perror("posix_openpt");
+        exit(EXIT_FAILURE);
+    }
+    struct winsize size = {.ws_row = ROWS, .ws_col = COLS};
+    ioctl(master, TIOCSWINSZ, &size);
+    const char *slave_name = ptsname(master);
+
+    shell_pid = fork();
+    if (shell_pid == 0)
+    {
+        setsid();
+        int slave = open(slave_name, O_RDWR);
+        if (slave == -1)
+            _exit(127);
+        ioctl(slave, TIOCSCTTY, 0);
+        dup2(slave, STDIN_FILENO);
+        dup2(slave, STDOUT_FILENO);
+        dup2(slave, STDERR_FILENO);
+        if (slave > STDERR_FILENO)
+            close(slave);
+        if (chdir("/tmp") == -1)
+            _exit(127);
+        char delay[16];
+        snprintf(delay, sizeof(delay), "%d", ESC_DELAY_MS);
+        setenv("TERM", "xterm", 1);
+        setenv("HOME", home, 1);
+        setenv("ESCDELAY", delay, 1);
+        setenv("ALLOC_COUNT_FILE", counter, 1);
+        setenv("LD_PRELOAD", preload, 1);
+        execl(binary, binary, (char *)NULL);
+        _exit(127);
+    }
+    wait_for("$ "); // Keys typed before the shell turns echo off come back from the tty itself
+    sync_keys();
+}
+
+static void stop_shell(void)
+{
+    send_text(KEY_F2);
+    waitpid(shell_pid, NULL, 0);
+    close(master);
+}
+
+int main(int argc, char **argv)
+{
+    const char *binary_arg = argc > 1 ? argv[1] : "build/main";
+    const char *preload_arg = argc > 2 ? argv[2] : "build/bench/alloc_count.so";
+    char binary[4096], preload[4096];
+    if (realpath(binary_arg, binary) == NULL || realpath(preload_arg, preload) == NULL)
+    {
+        perror(realpath(binary_arg, binary) ? preload_arg : binary_arg);
+        return EXIT_FAILURE;
+    }
+
+    if (mkdtemp(home) == NULL)
+    {
+        perror("mkdtemp");
+        return EXIT_FAILURE;
+    }
+    atexit(remove_home);
+    char counter[sizeof(home) + 32];
+    home_file(counter, sizeof(counter), "allocations");
+    map_counter(counter);
+
+    start_shell(binary, preload, counter);
+    if (*allocations == 0)
+    {
+        fprintf(stderr, "%s was not preloaded, nothing was counted\n", preload);
+        kill(shell_pid, SIGKILL);
+        return EXIT_FAILURE;
+    }
+    type_round();
+    wait_until_quiet();
+
+    uint64_t before = *allocations;
+    int keys = 0;
+    for (int i = 0; i < ROUNDS; i++)
+        keys += type_round();
+    send_text(SYNC_KEY); // Once it is drawn the last round's Backspace was handled too
+    wait_for(SYNC_KEY);
+    keys++;
+    uint64_t made = *allocations - before;
+    stop_shell();
+
+    printf("allocs.keystrokes %d\n", keys);
+    printf("allocs.total %llu\n", (unsigned long long)made);
+    printf("allocs.per_keystroke %.3f\n", (double)made / keys);
+
+    if (made > 0)
+    {
+        fprintf(stderr, "editing the command line made %llu allocations in %d keystrokes\n", (unsigned long long)made, keys);
+        return EXIT_FAILURE;
+    }
+    return 0;
+}
@@ -0,0 +1,146 @@
+// The ANSI parser from ansi.c on colorized output like `ls --color` and `grep --color`
+// write, fed in pipe-sized reads the way the shell drains a child. Several GB go through
+// so the result is the parser's steady state, not the first pass over a cold buffer. For
+// reference the same bytes are also split on newlines only, which is what the shell did
+// before it parsed escapes, and text with no escapes at all is parsed.
+//
+// usage: ansi [gigabytes]
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "ansi.h"
+
+#define DEFAULT_GB 4
+#define BUFFER_BYTES (64 << 20) // Generated once and fed again until enough has gone through
+#define FEED_BYTES 65536         // One read() from a child's pipe
+
+static const char *names[] = {"main.c", "jobs.c", "build", "README.md", "bench", "scrollback.c",
+                              "Makefile", "output.o", "history", "a.out", "src", "notes.txt"};
+static const char *colors[] = {"01;34", "01;32", "01;36", "00", "01;35", "40;33;01"};
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void *xmalloc(size_t size)
+{
+    void *p = malloc(size);
+    if (p == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+// `ls --color` rows, `grep --color -n` matches and some plain lines in between
+static char *make_colorized(size_t size)
+{
+    char *text = xmalloc(size);
+    srand(1);
+    size_t n = 0;
+    while (n + 512 < size)
+    {
+        int kind = rand() % 3;
+        if (kind == 0)
+        {
+            for (int i = 0; i < 6; i++)
+                n += sprintf(text + n, "\033[%sm%s\033[0m  ", colors[rand() % 6], names[rand() % 12]);
+            text[n++] = '\n';
+        }
+        else if (kind == 1)
+            n += sprintf(text + n, "\033[35m\033[K%s\033[m\033[K\033[36m\033[K:\033[m\033[K\033[32m\033[K%d\033[m\033[K\033[36m\033[K:\033[m\033[K"
+                                   "    if (\033[01;31m\033[Kline\033[m\033[K < LINES - 2)\n",
+                         names[rand() % 12], rand() % 2000);
+        else
+            n += sprintf(text + n, "drwxr-xr-x 2 user user %6d May %2d 12:%02d %s\n", rand() % 100000, rand() % 28 + 1, rand() % 60, names[rand() % 12]);
+    }
+    memset(text + n, '\n', size - n);
+    return text;
+}
+
+// Log lines with no escapes in them
+static char *make_plain(size_t size)
+{
+    char *text = xmalloc(size);
+    srand(2);
+    size_t n = 0;
+    while (n + 128 < size)
+        n += sprintf(text + n, "2024-05-%02d request %s completed in %d ms\n", rand() % 28 + 1, names[rand() % 12], rand() % 100000);
+    memset(text + n, '\n', size - n);
+    return text;
+}
+
+static size_t lines_seen, runs_seen, bytes_seen;
+
+static void count_line(const char *text, size_t len, const Attr_Run *runs, size_t run_count, void *arg)
+{
+    lines_seen++;
+    runs_seen += run_count;
+    bytes_seen += len;
+}
+
+static void parse_all(const char *text, size_t size, size_t total)
+{
+    Ansi_Parser parser;
+    init_ansi_parser(&parser, count_line, NULL);
+    for (size_t done = 0; done < total;)
+        for (size_t at = 0; at < size && done < total; at += FEED_BYTES, done += FEED_BYTES)
+            ansi_feed(&parser, text + at, size - at < FEED_BYTES ? size - at : FEED_BYTES);
+    ansi_finish(&parser);
+    free_ansi_parser(&parser);
+}
+
+// What the shell did before: cut at newlines and copy each line out, escapes and all
+static void split_all(const char *text, size_t size, size_t total)
+{
+    static char line[1 << 16];
+    for (size_t done = 0; done < total;)
+        for (size_t at = 0; at < size && done < total; at += FEED_BYTES, done += FEED_BYTES)
+        {
+            const char *p = text + at;
+            const char *end = p + (size - at < FEED_BYTES ? size - at : FEED_BYTES);
+            const char *nl;
+            while ((nl = memchr(p, '\n', end - p)) != NULL)
+            {
+                memcpy(line, p, nl - p);
+                count_line(line, nl - p, NULL, 0, NULL);
+                p = nl + 1;
+            }
+        }
+}
+
+static void report(const char *name, void (*run)(const char *, size_t, size_t), const char *text, size_t total)
+{
+    lines_seen = runs_seen = bytes_seen = 0;
+    long long start = now_ns();
+    run(text, BUFFER_BYTES, total);
+    double seconds = (now_ns() - start) / 1e9;
+    printf("ansi.%s.gb_per_s %.2f\n", name, total / seconds / 1e9);
+    printf("ansi.%s.lines_per_s %.0f\n", name, lines_seen / seconds);
+    if (runs_seen)
+        printf("ansi.%s.runs_per_line %.2f\n", name, (double)runs_seen / lines_seen);
+}
+
+int main(int argc, char **argv)
+{
+    size_t total = (argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_GB) * 1000000000UL;
+    char *colorized = make_colorized(BUFFER_BYTES);
+    char *plain = make_plain(BUFFER_BYTES);
+
+    printf("ansi.kernel %s\n", ansi_kernel_name());
+    printf("ansi.gigabytes %.0f\n", total / 1e9);
+    report("colorized", parse_all, colorized, total);
+    report("colorized_split_only", split_all, colorized, total);
+    report("plain", parse_all, plain, total);
+
+    free(colorized);
+    free(plain);
+    return 0;
+}
@@ -0,0 +1,163 @@
+// First-byte latency and throughput of child output read through a pipe and through
+// a pty, the two ways execute_bin can connect a command's stdout. The child is this
+// program again, writing with stdio the way most commands do.
+//
+// usage: pty [child_sleep_ms] [throughput_mb]
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "pty.h"
+
+#define DEFAULT_SLEEP_MS 500
+#define DEFAULT_MB 64
+#define ROUNDS 5
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Child side: print a line, keep running for a while, or stream `mb` megabytes of lines
+static int child(const char *mode, int amount)
+{
+    if (strcmp(mode, "first") == 0)
+    {
+        printf("first line\n");
+        usleep(amount * 1000); // Still running, like find or tar between files
+        return 0;
+    }
+
+    char line[80];
+    memset(line, 'x', sizeof(line) - 1);
+    line[sizeof(line) - 1] = '\n';
+    for (long n = (long)amount << 20; n > 0; n -= sizeof(line))
+        fwrite(line, 1, sizeof(line), stdout);
+    return 0;
+}
+
+// Start `self <mode> <amount>` with stdout and stderr on `out`
+static pid_t start_child(const char *self, const char *mode, int amount, int out)
+{
+    char arg[16];
+    snprintf(arg, sizeof(arg), "%d", amount);
+    char *argv[] = {(char *)self, "child", (char *)mode, arg, NULL};
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, out, STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, out, STDERR_FILENO);
+    pid_t pid;
+    int err = posix_spawn(&pid, self, &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (err)
+    {
+        fprintf(stderr, "posix_spawn: %s\n", strerror(err));
+        exit(EXIT_FAILURE);
+    }
+    return pid;
+}
+
+// Connect a fresh pipe or pty, returning the read end and the child's end
+static void connect_output(bool use_pty, int *read_end, int *write_end)
+{
+    int fds[2];
+    if (use_pty ? !open_pty(&fds[0], &fds[1], 24, 80) : pipe2(fds, O_CLOEXEC) == -1)
+    {
+        perror(use_pty ? "open_pty" : "pipe2");
+        exit(EXIT_FAILURE);
+    }
+    *read_end = fds[0];
+    *write_end = fds[1];
+}
+
+// Read until EOF (or EIO, which is how a pty reports it), returning the bytes read
+static long long drain(int fd)
+{
+    char buffer[65536];
+    long long total = 0;
+    ssize_t n;
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0 || (n < 0 && errno == EINTR))
+        total += n > 0 ? n : 0;
+    return total;
+}
+
+// Milliseconds from spawn until the first output can be read, median of a few runs
+static double first_byte_ms(const char *self, bool use_pty, int sleep_ms)
+{
+    double runs[ROUNDS];
+    for (int r = 0; r < ROUNDS; r++)
+    {
+        int read_end, write_end;
+        connect_output(use_pty, &read_end, &write_end);
+        long long start = now_ns();
+        pid_t pid = start_child(self, "first", sleep_ms, write_end);
+        close(write_end);
+
+        struct pollfd pfd = {.fd = read_end, .events = POLLIN};
+        poll(&pfd, 1, -1);
+        runs[r] = (now_ns() - start) / 1e6;
+
+        drain(read_end);
+        close(read_end);
+        waitpid(pid, NULL, 0);
+    }
+
+    // Insertion sort is plenty for a handful of runs
+    for (int i = 1; i < ROUNDS; i++)
+        for (int j = i; j > 0 && runs[j] < runs[j - 1]; j--)
+        {
+            double t = runs[j];
+            runs[j] = runs[j - 1];
+            runs[j - 1] = t;
+        }
+    return runs[ROUNDS / 2];
+}
+
+static double throughput_mb_per_s(const char *self, bool use_pty, int mb)
+{
+    int read_end, write_end;
+    connect_output(use_pty, &read_end, &write_end);
+    long long start = now_ns();
+    pid_t pid = start_child(self, "bulk", mb, write_end);
+    close(write_end);
+    long long bytes = drain(read_end);
+    double seconds = (now_ns() - start) / 1e9;
+    close(read_end);
+    waitpid(pid, NULL, 0);
+    return bytes / 1048576.0 / seconds;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc == 4 && strcmp(argv[1], "child") == 0)
+        return child(argv[2], atoi(argv[3]));
+
+    int sleep_ms = argc > 1 ? atoi(argv[1]) : DEFAULT_SLEEP_MS;
+    int mb = argc > 2 ? atoi(argv[2]) : DEFAULT_MB;
+    const char *self = "/proc/self/exe";
+
+    char path[4096];
+    ssize_t len = readlink(self, path, sizeof(path) - 1);
+    if (len > 0)
+    {
+        path[len] = '\0';
+        self = path;
+    }
+
+    printf("pty.pipe.first_byte_ms %.2f\n", first_byte_ms(self, false, sleep_ms));
+    printf("pty.pty.first_byte_ms %.2f\n", first_byte_ms(self, true, sleep_ms));
+    printf("pty.pipe.mb_per_s %.0f\n", throughput_mb_per_s(self, false, mb));
+    printf("pty.pty.mb_per_s %.0f\n", throughput_mb_per_s(self, true, mb));
+    return 0;
+}
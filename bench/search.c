@@ -0,0 +1,102 @@
+// Substring kernels from substring.c against glibc memmem, searching a few hundred MB
+// of log-like text for needles that are not in it, so every byte is scanned.
+//
+// usage: search [megabytes]
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "substring.h"
+
+#define DEFAULT_MB 256
+#define ROUNDS 3
+
+static const char *words[] = {"GET", "POST", "/api/v1/users", "/static/app.js", "200", "404", "500",
+                              "request", "completed", "in", "ms", "user", "session", "cache", "miss", "hit"};
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Lines of words and numbers, like the output a scrollback fills up with
+static char *make_haystack(size_t size)
+{
+    char *text = malloc(size);
+    if (text == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    srand(1);
+    size_t n = 0;
+    while (n + 64 < size)
+    {
+        n += sprintf(text + n, "2024-05-%02d %s %s %d ", rand() % 28 + 1, words[rand() % 16], words[rand() % 16], rand() % 100000);
+        if (rand() % 4 == 0)
+            text[n++] = '\n';
+    }
+    memset(text + n, ' ', size - n);
+    return text;
+}
+
+static const char *memmem_kernel(const char *haystack, size_t length, const char *needle, size_t needle_len)
+{
+    return memmem(haystack, length, needle, needle_len);
+}
+
+// Best of a few full scans, in MB/s
+static double run(const char *(*find)(const char *, size_t, const char *, size_t), const char *text, size_t size, const char *needle)
+{
+    long long best = 0;
+    for (int r = 0; r < ROUNDS; r++)
+    {
+        long long start = now_ns();
+        if (find(text, size, needle, strlen(needle)) != NULL)
+        {
+            fprintf(stderr, "needle `%s` unexpectedly found\n", needle);
+            exit(EXIT_FAILURE);
+        }
+        long long elapsed = now_ns() - start;
+        if (best == 0 || elapsed < best)
+            best = elapsed;
+    }
+    return (double)size / (1 << 20) / (best / 1e9);
+}
+
+int main(int argc, char **argv)
+{
+    size_t mb = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_MB;
+    size_t size = mb << 20;
+    char *text = make_haystack(size);
+
+    struct
+    {
+        const char *name;
+        const char *(*find)(const char *, size_t, const char *, size_t);
+    } kernels[] = {
+        {"memmem", memmem_kernel},
+        {"scalar", find_substring_scalar},
+#if defined(__x86_64__) || defined(__i386__)
+        {"sse2", find_substring_sse2},
+        {"avx2", __builtin_cpu_supports("avx2") ? find_substring_avx2 : NULL},
+#endif
+    };
+
+    // Short and long needles, made of letters the text is full of
+    const char *needles[] = {"sesn", "2024-06-", "request completed in 9999999 ms"};
+
+    printf("search.kernel %s\n", substring_kernel_name());
+    for (size_t n = 0; n < sizeof(needles) / sizeof(needles[0]); n++)
+        for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++)
+            if (kernels[k].find)
+                printf("search.%s.len%zu_mb_per_s %.0f\n", kernels[k].name, strlen(needles[n]), run(kernels[k].find, text, size, needles[n]));
+
+    free(text);
+    return 0;
+}
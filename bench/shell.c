@@ -0,0 +1,417 @@
+// Drives build/main through a pseudo-terminal the way a user would and times what the
+// user sees: keystroke to echo, prompt to prompt for builtins and external commands,
+// cat/ls/grep run in the shell against the real executables, how long a 1M-line stream
+// takes to come through, pasting a 1 MB command line, and globbing in a directory of
+// 100k files, first and again.
+//
+// usage: shell [path/to/main]
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define ROWS 40
+#define COLS 120
+#define KEYSTROKES 1000
+#define KEYS_PER_LINE 50
+#define PROMPT_ROUNDS 200
+#define LAUNCH_ROUNDS 200
+#define STREAM_ROUNDS 3
+#define FAST_PATH_ROUNDS 100
+#define SMALL_FILE_LINES 100
+#define DIR_FILES 200
+#define GLOB_FILES 100000
+#define GLOB_ROUNDS 50
+#define PASTE_BYTES (1024 * 1024)
+#define TIMEOUT_MS 30000
+#define KEY_F2 "\033OQ" // Quits the shell
+#define KEY_BACKSPACE "\177"
+#define SYNC_KEY "}" // Typed after a command, drawn only once the shell reads keys again
+
+// Letters that never show up inside the escape sequences ncurses sends, so seeing one
+// in the output means it was echoed
+static const char echo_keys[] = "abcefgijknopqstuvwxyz";
+
+static int master = -1;
+static pid_t shell_pid;
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void send_text(const char *text)
+{
+    size_t len = strlen(text);
+    while (len > 0)
+    {
+        ssize_t n = write(master, text, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+        {
+            perror("write");
+            exit(EXIT_FAILURE);
+        }
+        text += n;
+        len -= n;
+    }
+}
+
+// Read the shell's output until `marker` shows up, returning the bytes read
+static long long wait_for(const char *marker)
+{
+    size_t marker_len = strlen(marker);
+    char tail[64] = ""; // End of the previous read, for markers split across reads
+    size_t tail_len = 0;
+    char buffer[65536 + sizeof(tail)];
+    long long total = 0;
+
+    while (1)
+    {
+        struct pollfd pfd = {.fd = master, .events = POLLIN};
+        int ready = poll(&pfd, 1, TIMEOUT_MS);
+        if (ready == 0)
+        {
+            fprintf(stderr, "timed out waiting for `%s`\n", marker);
+            kill(shell_pid, SIGKILL);
+            exit(EXIT_FAILURE);
+        }
+        if (ready < 0)
+            continue;
+
+        memcpy(buffer, tail, tail_len);
+        ssize_t n = read(master, buffer + tail_len, sizeof(buffer) - tail_len);
+        if (n <= 0)
+        {
+            fprintf(stderr, "shell exited while waiting for `%s`\n", marker);
+            exit(EXIT_FAILURE);
+        }
+        total += n;
+        size_t len = tail_len + n;
+        if (memmem(buffer, len, marker, marker_len))
+            return total;
+
+        tail_len = marker_len - 1 < len ? marker_len - 1 : len;
+        memcpy(tail, buffer + len - tail_len, tail_len);
+    }
+}
+
+// Wait until the shell is back at the prompt and has drawn everything before it. Waiting
+// for "$ " is not enough: repainting the screen draws old prompts too.
+static long long sync_prompt(void)
+{
+    long long bytes = wait_for(SYNC_KEY);
+    send_text(KEY_BACKSPACE);
+    return bytes;
+}
+
+// Start the shell on a new pty in /tmp with a throwaway $HOME, so history stays clean
+static void start_shell(const char *binary, char *home)
+{
+    master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (master == -1 || grantpt(master) == -1 || unlockpt(master) == -1)
+    {
+        perror("posix_openpt");
+        exit(EXIT_FAILURE);
+    }
+    struct winsize size = {.ws_row = ROWS, .ws_col = COLS};
+    ioctl(master, TIOCSWINSZ, &size);
+    const char *slave_name = ptsname(master);
+
+    shell_pid = fork();
+    if (shell_pid == 0)
+    {
+        setsid();
+        int slave = open(slave_name, O_RDWR);
+        if (slave == -1)
+            _exit(127);
+        ioctl(slave, TIOCSCTTY, 0);
+        dup2(slave, STDIN_FILENO);
+        dup2(slave, STDOUT_FILENO);
+        dup2(slave, STDERR_FILENO);
+        if (slave > STDERR_FILENO)
+            close(slave);
+        if (chdir("/tmp") == -1)
+            _exit(127);
+        setenv("TERM", "xterm", 1);
+        setenv("HOME", home, 1);
+        execl(binary, binary, (char *)NULL);
+        _exit(127);
+    }
+    send_text(SYNC_KEY);
+    sync_prompt();
+}
+
+static void stop_shell(void)
+{
+    send_text(KEY_F2);
+    waitpid(shell_pid, NULL, 0);
+    close(master);
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(double *sorted, int count, double p)
+{
+    int i = (int)(p / 100 * (count - 1) + 0.5);
+    return sorted[i];
+}
+
+static void report_percentiles(const char *name, double *ms, int count)
+{
+    qsort(ms, count, sizeof(double), compare_doubles);
+    printf("shell.%s.p50_ms %.3f\n", name, percentile(ms, count, 50));
+    printf("shell.%s.p90_ms %.3f\n", name, percentile(ms, count, 90));
+    printf("shell.%s.p99_ms %.3f\n", name, percentile(ms, count, 99));
+    printf("shell.%s.max_ms %.3f\n", name, ms[count - 1]);
+}
+
+// Type letters at the prompt and time each one until it is drawn. Every
+// KEYS_PER_LINE keys the line is submitted (an unknown command) to start a fresh one.
+static void bench_keystrokes(void)
+{
+    static double ms[KEYSTROKES];
+    for (int i = 0; i < KEYSTROKES; i++)
+    {
+        char key[2] = {echo_keys[i % (sizeof(echo_keys) - 1)], '\0'};
+        long long start = now_ns();
+        send_text(key);
+        wait_for(key);
+        ms[i] = (now_ns() - start) / 1e6;
+
+        if ((i + 1) % KEYS_PER_LINE == 0)
+        {
+            send_text("\n" SYNC_KEY);
+            sync_prompt();
+        }
+    }
+    report_percentiles("keystroke_echo", ms, KEYSTROKES);
+}
+
+// Time from pressing Enter on `command` until the shell is back at the prompt
+static void bench_prompt_to_prompt(const char *name, const char *command, int rounds)
+{
+    double ms[rounds];
+    char line[256];
+    snprintf(line, sizeof(line), "%s\n" SYNC_KEY, command);
+    for (int i = 0; i < rounds; i++)
+    {
+        long long start = now_ns();
+        send_text(line);
+        sync_prompt();
+        ms[i] = (now_ns() - start) / 1e6;
+    }
+    report_percentiles(name, ms, rounds);
+}
+
+// Stream a million lines through the shell and the terminal
+static void bench_stream(const char *name, const char *command)
+{
+    double best = 0;
+    long long bytes = 0;
+    char line[256];
+    snprintf(line, sizeof(line), "%s\n" SYNC_KEY, command);
+    for (int i = 0; i < STREAM_ROUNDS; i++)
+    {
+        long long start = now_ns();
+        send_text(line);
+        bytes = sync_prompt();
+        double seconds = (now_ns() - start) / 1e9;
+        if (best == 0 || seconds < best)
+            best = seconds;
+    }
+    printf("shell.%s.seconds %.3f\n", name, best);
+    printf("shell.%s.lines_per_s %.0f\n", name, 1e6 / best);
+    printf("shell.%s.terminal_bytes %lld\n", name, bytes);
+}
+
+// Paste a 1 MB `echo` line in one write and time it until the prompt is back
+static void bench_paste(void)
+{
+    char *line = malloc(PASTE_BYTES + 16);
+    if (line == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    strcpy(line, "echo ");
+    memset(line + 5, 'x', PASTE_BYTES);
+    strcpy(line + 5 + PASTE_BYTES, "\n" SYNC_KEY);
+
+    double best = 0;
+    for (int i = 0; i < STREAM_ROUNDS; i++)
+    {
+        long long start = now_ns();
+        send_text(line);
+        sync_prompt();
+        double seconds = (now_ns() - start) / 1e9;
+        if (best == 0 || seconds < best)
+            best = seconds;
+    }
+    printf("shell.paste_1mb.seconds %.3f\n", best);
+    free(line);
+}
+
+// Files for cat, ls and grep: a short file, a million-line file and a directory
+static void make_fixtures(const char *home)
+{
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/small.txt", home);
+    FILE *f = fopen(path, "w");
+    for (int i = 1; f && i <= SMALL_FILE_LINES; i++)
+        fprintf(f, "line %d of the small file\n", i);
+    snprintf(path, sizeof(path), "%s/big.txt", home);
+    FILE *g = fopen(path, "w");
+    for (int i = 1; g && i <= 1000000; i++)
+        fprintf(g, "%d\n", i);
+    snprintf(path, sizeof(path), "%s/dir", home);
+    if (f == NULL || g == NULL || mkdir(path, 0700) == -1)
+    {
+        perror("fixtures");
+        exit(EXIT_FAILURE);
+    }
+    fclose(f);
+    fclose(g);
+    for (int i = 0; i < DIR_FILES; i++)
+    {
+        snprintf(path, sizeof(path), "%s/dir/file%03d", home, i);
+        close(open(path, O_CREAT | O_WRONLY, 0600));
+    }
+}
+
+static void remove_fixtures(const char *home)
+{
+    char path[4096];
+    for (int i = 0; i < DIR_FILES; i++)
+    {
+        snprintf(path, sizeof(path), "%s/dir/file%03d", home, i);
+        unlink(path);
+    }
+    snprintf(path, sizeof(path), "%s/dir", home);
+    rmdir(path);
+    snprintf(path, sizeof(path), "%s/small.txt", home);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/big.txt", home);
+    unlink(path);
+}
+
+// Prompt to prompt for the shell's own cat, ls and grep and for the executables in /bin
+static void bench_fast_paths(const char *home)
+{
+    // Command, arguments before the file and the file in $HOME
+    const char *commands[][3] = {
+        {"cat", "", "small.txt"},
+        {"ls", "", "dir"},
+        {"grep", "7 ", "small.txt"},
+    };
+    for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++)
+    {
+        char name[64], command[256];
+        snprintf(name, sizeof(name), "%s_small", commands[i][0]);
+        snprintf(command, sizeof(command), "%s %s%s/%s", commands[i][0], commands[i][1], home, commands[i][2]);
+        bench_prompt_to_prompt(name, command, FAST_PATH_ROUNDS);
+        snprintf(name, sizeof(name), "%s_small_external", commands[i][0]);
+        snprintf(command, sizeof(command), "/bin/%s %s%s/%s", commands[i][0], commands[i][1], home, commands[i][2]);
+        bench_prompt_to_prompt(name, command, FAST_PATH_ROUNDS);
+    }
+
+    char command[256];
+    snprintf(command, sizeof(command), "cat %s/big.txt", home);
+    bench_stream("cat_1m_lines", command);
+    snprintf(command, sizeof(command), "/bin/cat %s/big.txt", home);
+    bench_stream("cat_1m_lines_external", command);
+}
+
+static void glob_file(char *path, size_t size, const char *home, int i)
+{
+    snprintf(path, size, "%s/many/file%06d.o", home, i);
+}
+
+// `echo` a glob over GLOB_FILES files: the first time reads the directory, after that
+// it is listed from the cache. `file09999*` only walks its prefix in the listing, `*9999.o`
+// matches every name.
+static void bench_glob(const char *home)
+{
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/many", home);
+    if (mkdir(path, 0700) == -1)
+    {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < GLOB_FILES; i++)
+    {
+        glob_file(path, sizeof(path), home, i);
+        close(open(path, O_CREAT | O_WRONLY, 0600));
+    }
+    usleep(100000); // Past the window where the directory is always read again
+
+    char command[4096];
+    snprintf(command, sizeof(command), "echo %s/many/file09999*", home);
+    bench_prompt_to_prompt("glob_100k_first", command, 1);
+    bench_prompt_to_prompt("glob_100k_prefix", command, GLOB_ROUNDS);
+    snprintf(command, sizeof(command), "echo %s/many/*9999.o", home);
+    bench_prompt_to_prompt("glob_100k_suffix", command, GLOB_ROUNDS);
+
+    for (int i = 0; i < GLOB_FILES; i++)
+    {
+        glob_file(path, sizeof(path), home, i);
+        unlink(path);
+    }
+    snprintf(path, sizeof(path), "%s/many", home);
+    rmdir(path);
+}
+
+int main(int argc, char **argv)
+{
+    char binary[4096];
+    if (realpath(argc > 1 ? argv[1] : "build/main", binary) == NULL)
+    {
+        perror(argc > 1 ? argv[1] : "build/main");
+        return EXIT_FAILURE;
+    }
+
+    char home[] = "/tmp/my-shell-bench-XXXXXX";
+    if (mkdtemp(home) == NULL)
+    {
+        perror("mkdtemp");
+        return EXIT_FAILURE;
+    }
+
+    start_shell(binary, home);
+    bench_keystrokes();
+    bench_prompt_to_prompt("echo", "echo hi", PROMPT_ROUNDS);
+    bench_prompt_to_prompt("time", "time", PROMPT_ROUNDS);
+    bench_prompt_to_prompt("pwd", "pwd", PROMPT_ROUNDS);
+    bench_prompt_to_prompt("launch_true", "/bin/true", LAUNCH_ROUNDS);
+    bench_prompt_to_prompt("launch_true_path", "true", LAUNCH_ROUNDS);
+    bench_stream("stream_1m_lines", "seq 1 1000000");
+    bench_paste();
+    make_fixtures(home);
+    bench_fast_paths(home);
+    bench_glob(home);
+    stop_shell();
+    remove_fixtures(home);
+
+    char history[sizeof(home) + 32];
+    snprintf(history, sizeof(history), "%s/.my-shell_history", home);
+    unlink(history);
+    rmdir(home);
+    return 0;
+}
@@ -0,0 +1,93 @@
+// Launch latency of `true` through fork+execve and through posix_spawn, with the
+// parent holding either an empty or a full scrollback's worth of touched memory.
+//
+// usage: spawn [launches] [scrollback_mb]
+#define _GNU_SOURCE
+
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#define DEFAULT_LAUNCHES 10000
+#define DEFAULT_SCROLLBACK_MB 512
+#define TRUE_PATH "/bin/true"
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static pid_t launch_fork(char **argv)
+{
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        execve(TRUE_PATH, argv, environ);
+        _exit(127);
+    }
+    return pid;
+}
+
+static pid_t launch_spawn(char **argv)
+{
+    pid_t pid;
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", 0, 0); // Stand-in for the pipe dup2s
+    int err = posix_spawn(&pid, TRUE_PATH, &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    return err == 0 ? pid : -1;
+}
+
+// Average microseconds per launch-and-reap
+static double run(pid_t (*launch)(char **), int launches)
+{
+    char *argv[] = {"true", NULL};
+    long long start = now_ns();
+    for (int i = 0; i < launches; i++)
+    {
+        pid_t pid = launch(argv);
+        if (pid < 0)
+        {
+            perror("launch");
+            exit(EXIT_FAILURE);
+        }
+        waitpid(pid, NULL, 0);
+    }
+    return (now_ns() - start) / 1000.0 / launches;
+}
+
+int main(int argc, char **argv)
+{
+    int launches = argc > 1 ? atoi(argv[1]) : DEFAULT_LAUNCHES;
+    size_t scrollback_mb = argc > 2 ? strtoul(argv[2], NULL, 10) : DEFAULT_SCROLLBACK_MB;
+
+    run(launch_spawn, launches / 10 + 1); // Warm up the exec path and page cache
+    printf("spawn.fork.empty_us %.1f\n", run(launch_fork, launches));
+    printf("spawn.posix_spawn.empty_us %.1f\n", run(launch_spawn, launches));
+
+    // Fill and touch memory the way a full scrollback arena would be resident. Huge
+    // pages are turned off so the page tables look like a long-lived, grown heap.
+    size_t size = scrollback_mb << 20;
+    char *scrollback = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (scrollback == MAP_FAILED)
+    {
+        perror("mmap");
+        return EXIT_FAILURE;
+    }
+    madvise(scrollback, size, MADV_NOHUGEPAGE);
+    memset(scrollback, 'x', size);
+
+    printf("spawn.fork.full_us %.1f\n", run(launch_fork, launches));
+    printf("spawn.posix_spawn.full_us %.1f\n", run(launch_spawn, launches));
+
+    munmap(scrollback, size);
+    return 0;
+}
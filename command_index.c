@@ -0,0 +1,308 @@
+#define _GNU_SOURCE // fstatat, dirfd
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include "command_index.h"
+
+static Command_Index index_table = {0};
+
+// FNV-1a hash of a command name
+static size_t hash_name(const char *name)
+{
+    size_t hash = 14695981039346656037ULL;
+    for (; *name; name++)
+    {
+        hash ^= (unsigned char)*name;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static void *xmalloc(size_t size)
+{
+    void *p = malloc(size);
+    if (p == NULL)
+    {
+        perror("Error allocating command index");
+        endwin();
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+// Double the bucket array once the table holds more entries than buckets
+static void grow_buckets(void)
+{
+    size_t count = index_table.bucket_count ? index_table.bucket_count * 2 : INDEX_MIN_BUCKETS;
+    Command_Entry **buckets = xmalloc(count * sizeof(*buckets));
+    memset(buckets, 0, count * sizeof(*buckets));
+
+    for (size_t b = 0; b < index_table.bucket_count; b++)
+    {
+        Command_Entry *e = index_table.buckets[b];
+        while (e)
+        {
+            Command_Entry *next = e->next;
+            size_t slot = hash_name(e->name) & (count - 1);
+            e->next = buckets[slot];
+            buckets[slot] = e;
+            e = next;
+        }
+    }
+
+    free(index_table.buckets);
+    index_table.buckets = buckets;
+    index_table.bucket_count = count;
+}
+
+static Command_Entry *find_entry(const char *name)
+{
+    if (index_table.bucket_count == 0)
+        return NULL;
+    Command_Entry *e = index_table.buckets[hash_name(name) & (index_table.bucket_count - 1)];
+    while (e && strcmp(e->name, name) != 0)
+        e = e->next;
+    return e;
+}
+
+static Command_Entry *insert_entry(const char *name)
+{
+    if (index_table.count >= index_table.bucket_count)
+        grow_buckets();
+
+    Command_Entry *e = xmalloc(sizeof(*e));
+    size_t slot = hash_name(name) & (index_table.bucket_count - 1);
+    *e = (Command_Entry){.name = strdup(name), .dir = -1, .next = index_table.buckets[slot]};
+    index_table.buckets[slot] = e;
+    index_table.count++;
+    index_table.generation++;
+    return e;
+}
+
+static void set_entry_path(Command_Entry *e, int dir)
+{
+    const char *base = index_table.dirs[dir].path;
+    free(e->path);
+    e->path = xmalloc(strlen(base) + strlen(e->name) + 2);
+    sprintf(e->path, "%s/%s", base, e->name);
+    e->dir = dir;
+}
+
+static bool is_executable_at(int dfd, const char *name)
+{
+    struct stat st;
+    return fstatat(dfd, name, &st, 0) == 0 && S_ISREG(st.st_mode) && (st.st_mode & 0111);
+}
+
+// Look for `name` in the $PATH directories after `dir`, for when its old match went away
+static void fall_back_to_later_dir(Command_Entry *e, int dir)
+{
+    for (int d = dir + 1; d < index_table.dir_count; d++)
+    {
+        char candidate[strlen(index_table.dirs[d].path) + strlen(e->name) + 2];
+        sprintf(candidate, "%s/%s", index_table.dirs[d].path, e->name);
+        if (is_executable_at(AT_FDCWD, candidate))
+        {
+            set_entry_path(e, d);
+            return;
+        }
+    }
+    free(e->path);
+    e->path = NULL;
+    e->dir = -1;
+}
+
+// Drop entries that are neither builtins, fast paths nor found anywhere in $PATH
+static void remove_dead_entries(void)
+{
+    for (size_t b = 0; b < index_table.bucket_count; b++)
+    {
+        Command_Entry **link = &index_table.buckets[b];
+        while (*link)
+        {
+            Command_Entry *e = *link;
+            if (e->path == NULL && e->builtin == NULL && e->fast_path == NULL)
+            {
+                *link = e->next;
+                free(e->name);
+                free(e);
+                index_table.count--;
+                index_table.generation++;
+            }
+            else
+                link = &e->next;
+        }
+    }
+}
+
+// Re-read one $PATH directory, keeping earlier directories' matches in front of it
+static void scan_dir(int dir)
+{
+    Path_Dir *pd = &index_table.dirs[dir];
+
+    for (size_t b = 0; b < index_table.bucket_count; b++)
+        for (Command_Entry *e = index_table.buckets[b]; e; e = e->next)
+            if (e->dir == dir)
+                e->stale = true;
+
+    struct stat st;
+    DIR *d = opendir(pd->path);
+    if (d && fstat(dirfd(d), &st) == 0)
+    {
+        pd->mtime = st.st_mtim;
+
+        struct dirent *de;
+        while ((de = readdir(d)) != NULL)
+        {
+            if (de->d_name[0] == '.' || (de->d_type != DT_REG && de->d_type != DT_LNK && de->d_type != DT_UNKNOWN))
+                continue;
+            if (!is_executable_at(dirfd(d), de->d_name))
+                continue;
+
+            Command_Entry *e = find_entry(de->d_name);
+            if (e == NULL)
+                e = insert_entry(de->d_name);
+            if (e->dir == dir)
+                e->stale = false;
+            else if (e->path == NULL || e->dir > dir)
+                set_entry_path(e, dir);
+        }
+    }
+    else
+        pd->mtime = (struct timespec){0};
+    if (d)
+        closedir(d);
+
+    // Whatever is still stale was deleted from this directory
+    for (size_t b = 0; b < index_table.bucket_count; b++)
+        for (Command_Entry *e = index_table.buckets[b]; e; e = e->next)
+            if (e->stale)
+            {
+                e->stale = false;
+                fall_back_to_later_dir(e, dir);
+            }
+    remove_dead_entries();
+}
+
+// Split $PATH into directories and index all of them from scratch
+static void rebuild_dirs(const char *path_env)
+{
+    for (int d = 0; d < index_table.dir_count; d++)
+        free(index_table.dirs[d].path);
+    free(index_table.dirs);
+    free(index_table.path_env);
+
+    for (size_t b = 0; b < index_table.bucket_count; b++)
+        for (Command_Entry *e = index_table.buckets[b]; e; e = e->next)
+        {
+            free(e->path);
+            e->path = NULL;
+            e->dir = -1;
+        }
+    remove_dead_entries();
+
+    index_table.path_env = strdup(path_env);
+    int count = 1;
+    for (const char *c = path_env; *c; c++)
+        if (*c == ':')
+            count++;
+    index_table.dirs = xmalloc(count * sizeof(Path_Dir));
+    index_table.dir_count = count;
+
+    char copy[strlen(path_env) + 1];
+    strcpy(copy, path_env);
+    char *rest = copy;
+    for (int d = 0; d < count; d++)
+    {
+        char *dir = strsep(&rest, ":");
+        index_table.dirs[d].path = strdup(*dir ? dir : "."); // An empty entry means the cwd
+    }
+    for (int d = 0; d < count; d++)
+        scan_dir(d);
+}
+
+// Register a builtin. Builtins win over executables of the same name.
+void add_builtin(const char *name, Builtin_Fn fn)
+{
+    Command_Entry *e = find_entry(name);
+    if (e == NULL)
+        e = insert_entry(name);
+    e->builtin = fn;
+}
+
+// Register an in-process version of an executable. Unlike a builtin it only runs in the
+// foreground and can hand the command back to the executable.
+void add_fast_path(const char *name, Fast_Path_Fn fn)
+{
+    Command_Entry *e = find_entry(name);
+    if (e == NULL)
+        e = insert_entry(name);
+    e->fast_path = fn;
+}
+
+// Rescan only the $PATH directories whose mtime moved since they were last read
+void refresh_command_index(void)
+{
+    const char *path_env = getenv("PATH");
+    if (path_env == NULL)
+        path_env = DEFAULT_PATH;
+
+    if (index_table.path_env == NULL || strcmp(index_table.path_env, path_env) != 0)
+    {
+        rebuild_dirs(path_env);
+        return;
+    }
+
+    for (int d = 0; d < index_table.dir_count; d++)
+    {
+        struct stat st;
+        struct timespec mtime = stat(index_table.dirs[d].path, &st) == 0 ? st.st_mtim : (struct timespec){0};
+        if (mtime.tv_sec != index_table.dirs[d].mtime.tv_sec || mtime.tv_nsec != index_table.dirs[d].mtime.tv_nsec)
+            scan_dir(d);
+    }
+}
+
+Command_Entry *lookup_command(const char *name)
+{
+    return find_entry(name);
+}
+
+// Absolute path to hand to execve for `name`, or NULL if there is no such executable
+const char *resolve_executable(const char *name)
+{
+    if (strchr(name, '/'))
+        return access(name, X_OK) == 0 ? name : NULL;
+
+    Command_Entry *e = find_entry(name);
+    if (e && e->path)
+        return e->path;
+
+    // A file made executable after it was created leaves the directory mtime alone, so check directly
+    for (int d = 0; d < index_table.dir_count; d++)
+    {
+        char candidate[strlen(index_table.dirs[d].path) + strlen(name) + 2];
+        sprintf(candidate, "%s/%s", index_table.dirs[d].path, name);
+        if (is_executable_at(AT_FDCWD, candidate))
+        {
+            if (e == NULL)
+                e = insert_entry(name);
+            set_entry_path(e, d);
+            return e->path;
+        }
+    }
+    return NULL;
+}
+
+// Changes whenever the set of names does, so copies of the names know when to rebuild
+unsigned long command_index_generation(void)
+{
+    return index_table.generation;
+}
+
+void for_each_command(Command_Visit_Fn fn, void *arg)
+{
+    for (size_t b = 0; b < index_table.bucket_count; b++)
+        for (Command_Entry *e = index_table.buckets[b]; e; e = e->next)
+            fn(e->name, arg);
+}
@@ -0,0 +1,53 @@
+#ifndef COMMAND_INDEX_H
+#define COMMAND_INDEX_H
+
+#include <stdbool.h>
+#include <sys/stat.h>
+#include "commands.h"
+
+#define INDEX_MIN_BUCKETS 1024                   // Starting size of the hash table
+#define DEFAULT_PATH "/usr/local/bin:/usr/bin:/bin" // Used when $PATH is unset
+
+// One command name known to the shell, either a builtin, an executable in $PATH, or both
+typedef struct Command_Entry
+{
+    char *name;                 // Command name, the hash key
+    char *path;                 // Absolute path of the first match in $PATH, or NULL
+    int dir;                    // Index of the $PATH directory `path` came from
+    Builtin_Fn builtin;         // Builtin implementation, or NULL
+    Fast_Path_Fn fast_path;     // Used in place of `path` in the foreground, or NULL
+    bool stale;                 // Set while the entry's directory is being rescanned
+    struct Command_Entry *next; // Next entry in the same bucket
+} Command_Entry;
+
+// A directory from $PATH along with the mtime it had when it was last scanned
+typedef struct
+{
+    char *path;
+    struct timespec mtime;
+} Path_Dir;
+
+// Hash table of every command name, kept in step with the $PATH directories
+typedef struct
+{
+    Command_Entry **buckets;
+    size_t bucket_count;
+    size_t count;
+    Path_Dir *dirs;
+    int dir_count;
+    char *path_env; // Copy of the $PATH the directory list was built from
+    unsigned long generation; // Bumped whenever a name is added or removed
+} Command_Index;
+
+typedef void (*Command_Visit_Fn)(const char *name, void *arg);
+
+// Function prototypes
+void add_builtin(const char *name, Builtin_Fn fn);
+void add_fast_path(const char *name, Fast_Path_Fn fn);
+void refresh_command_index(void);
+Command_Entry *lookup_command(const char *name);
+const char *resolve_executable(const char *name);
+unsigned long command_index_generation(void);
+void for_each_command(Command_Visit_Fn fn, void *arg);
+
+#endif // COMMAND_INDEX_H
@@ -1,61 +1,58 @@
+#define _GNU_SOURCE // pipe2, F_SETPIPE_SZ, environ
+
 #include "commands.h"
+#include "command_index.h"
+#include "jobs.h"
+#include "output.h"
+#include "pty.h"
+#include "redirect.h"
+#include "stats.h"
+
+static void *xmalloc(size_t size)
+{
+    void *p = malloc(size);
+    if (p == NULL)
+    {
+        perror("Error allocating a pipeline");
+        endwin();
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
 
 void execute_about()
 {
-    adjust_window();
-    mvwprintw(output_win, line, 0, "Welcome to my-shell. A simple shell for beginners!");
-    wrefresh(output_win);
+    print_line("Welcome to my-shell. A simple shell for beginners!");
 }
 
 void execute_greet(char *name)
 {
-    adjust_window();
-    mvwprintw(output_win, line, 0, "Hello, %s", name ? name : "John Doe (please provide a name after `greet`)");
-    char buff[LINE_LENGTH] = "Hello, ";
-    strcat(buff, name ? name : "John Doe (please provide a name after `greet`)");
-    add_to_scroll_history(&scroll_his, buff);
-    wrefresh(output_win);
+    print_line("Hello, %s", name ? name : "John Doe (please provide a name after `greet`)");
 }
 
-void execute_clear(int *history_index, int *index, int *scroll_offset)
+void execute_clear(long *history_index, int *scroll_offset)
 {
-    line = -1;           // Reset the line to the top
     *history_index = -1; // Reset history index
-    *index = 0;          // Reset index
     *scroll_offset = -1; // Reset scroll_offset
-    for (int i = 0; i < MAX_SCROLLBACK; i++)
-        memset(scroll_his.data[i], 0, LINE_LENGTH);
-    scroll_his.length = 0;
-    werase(output_win);   // Clear the window
-    wrefresh(output_win); // Refresh to clear the screen
+    output->clear_screen();
 }
 
 void execute_echo(char *message)
 {
-    adjust_window();
-    mvwprintw(output_win, line, 0, "%s", message ? message : "*cricket noises*");
-    char buff[LINE_LENGTH];
-    strcat(buff, message ? message : "*cricket noises*");
-    add_to_scroll_history(&scroll_his, buff);
-    wrefresh(output_win);
+    if (message == NULL)
+        message = "*cricket noises*";
+    output->write_line(message, strlen(message));
 }
 
 void execute_time()
 {
-    adjust_window();
-
-    char buff[LINE_LENGTH];
     // Get the current time
     time_t current_time = time(NULL);
 
     // Check if the time retrieval was successful
     if (current_time == (time_t)-1)
     {
-        char *message = "Failed to get the current time.";
-        mvwprintw(output_win, line, 0, "%s", message);
-        strcpy(buff, message);
-        add_to_scroll_history(&scroll_his, buff);
-        wrefresh(output_win);
+        print_error("Failed to get the current time.");
         return;
     }
 
@@ -63,90 +60,223 @@ void execute_time()
     struct tm *local_time = localtime(&current_time);
     if (!local_time)
     {
-        char *message = "Failed to convert to local time.";
-        mvwprintw(output_win, line, 0, "Failed to convert to local time.");
-        strcpy(buff, message);
-        add_to_scroll_history(&scroll_his, buff);
-        wrefresh(output_win);
+        print_error("Failed to convert to local time.");
         return;
     }
 
     // Format and print the time
     char time_str[64];
     strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", local_time);
-    mvwprintw(output_win, line, 0, "Current date/time: %s", time_str);
-
-    strcpy(buff, "Current date/time: ");
-    strcat(buff, time_str);
-    add_to_scroll_history(&scroll_his, buff);
+    print_line("Current date/time: %s", time_str);
 }
 
-void execute_bin(char *input)
+void execute_cd(char *path)
 {
-    // Tokenize the input string into command and arguments
-    char *args[MAX_ARGS];
-    int i = 0;
-    char *token = strtok(input, " \t\n");
-
-    while (token && i < MAX_ARGS - 1)
+    if (path == NULL)
+        path = getenv("HOME");
+    if (path == NULL || chdir(path) == -1)
     {
-        args[i++] = token;
-        token = strtok(NULL, " \t\n");
+        print_error("%s", strerror(path ? errno : ENOENT));
+        last_status = 1;
     }
-    args[i] = NULL;
+    else
+        invalidate_prompt(); // The prompt shows the working directory
+}
 
-    // Create pipe
-    int pipefd[2];
-    if (pipe(pipefd) == -1)
-    {
-        adjust_window();
-        mvwprintw(output_win, line, 0, "Error: failed to create pipe.");
-        return;
-    }
+void execute_pwd()
+{
+    char *cwd = getcwd(NULL, 0);
+    if (cwd)
+        output->write_line(cwd, strlen(cwd));
+    free(cwd); // Free memory allocated by getcwd
+}
 
-    pid_t pid = fork();
-    if (pid < 0) // Fork failed
+// Take the redirections out of one command and expand what is left into its argv. Prints a
+// message and returns false on a syntax error, otherwise the caller frees the words.
+bool prepare_stage(char *command, Stage *stage)
+{
+    return parse_redirections(command, &stage->redirections) && expand_words(command, &stage->words);
+}
+
+// Give a pipe a larger kernel buffer so stages hand off data with fewer wakeups
+static void widen_pipe(int fd)
+{
+#ifdef F_SETPIPE_SZ
+    fcntl(fd, F_SETPIPE_SZ, PIPE_BUFFER_SIZE); // Best effort, the default size still works
+#endif
+}
+
+// Run `stages[0] | stages[1] | ...` with every stage connected directly to the next.
+// Interactively, the last stage's output and every stage's errors come back to the shell
+// through a pty sized like the output window, or a pipe if no pty can be had. Headless,
+// they go straight to the shell's own stdout and stderr.
+// Each stage's `<`, `>`, `>>`, `2>` and `2>&1` are opened by the shell and put in place
+// on top of that, so redirected output goes straight to its file.
+// The stages form one job; a foreground job is waited on, a background one is not.
+// With a `record`, the output is also kept there as it is shown. Headless that means it
+// comes back through a pipe and is only shown once the job is done, by the caller.
+void execute_bin(Stage stages[], int count, const char *command, bool background, Output_Record *record)
+{
+    long long started = monotonic_ns();
+
+    // Create the pipe that carries output back to the shell
+    int outfd[2] = {-1, -1};
+    bool collect = record && !output->interactive;
+    if ((output->interactive && !open_pty(&outfd[0], &outfd[1], LINES - 1, COLS)) || collect)
     {
-        adjust_window();
-        mvwprintw(output_win, line, 0, "Error: fork failed.");
-        return;
+        if (pipe2(outfd, O_CLOEXEC) == -1)
+        {
+            print_error("Error: failed to create pipe.");
+            return;
+        }
+        widen_pipe(outfd[1]);
     }
-    else if (pid == 0) // Child process
-    {
-        dup2(pipefd[1], STDOUT_FILENO);
-        dup2(pipefd[1], STDERR_FILENO);
-        close(pipefd[0]);
-        close(pipefd[1]);
+    else
+        output->flush(); // The children write to the same stdout, keep the order
 
-        execvp(args[0], args);
-        _exit(127); // Exit child if execvp fails
-    }
-    else // Parent process
+    pid_t *pids = xmalloc(count * sizeof(pid_t)); // One per stage, and a line can hold any number
+    int spawned = 0;
+    int prev_read = -1; // Read end of the pipe feeding the next stage
+    pid_t pgid = 0;     // Every stage joins the first stage's process group
+    bool redirect_failed = false;
+    int failed = 0;     // Exit status for a stage that could not be started, 0 when all were
+
+    // The shell blocks SIGCHLD and ignores SIGTTOU, children start with neither
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t signals;
+    sigemptyset(&signals);
+    posix_spawnattr_setsigmask(&attr, &signals);
+    sigaddset(&signals, SIGTTOU);
+    posix_spawnattr_setsigdefault(&attr, &signals);
+    short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+    if (output->interactive)
+        flags |= POSIX_SPAWN_SETPGROUP; // Job control only applies with a terminal to hand over
+    posix_spawnattr_setflags(&attr, flags);
+
+    for (int s = 0; s < count; s++)
     {
-        close(pipefd[1]); // Close write end in parent
-        char buffer[BUFFER_SIZE];
-        FILE *fp = fdopen(pipefd[0], "r");
+        const Redirections *redirections = &stages[s].redirections;
+        char **args = stages[s].words.argv;
+        int fds[MAX_REDIRECTIONS];
+        const char *path = args[0] ? resolve_executable(args[0]) : NULL;
+        if (path == NULL)
+        {
+            print_error("Error: `%s` not found.", args[0] ? args[0] : "");
+            failed = 127;
+            break;
+        }
+        if (!open_redirections(redirections, fds))
+        {
+            redirect_failed = true;
+            break;
+        }
+
+        int next[2] = {-1, -1};
+        if (s < count - 1)
+        {
+            if (pipe2(next, O_CLOEXEC) == -1)
+            {
+                print_error("Error: failed to create pipe.");
+                close_redirections(redirections, fds);
+                failed = 126;
+                break;
+            }
+            widen_pipe(next[1]);
+        }
 
-        if (fp != NULL)
+        // posix_spawn shares the parent's memory until exec (CLONE_VFORK), so launching
+        // costs the same no matter how much scrollback the shell holds. Every pipe is
+        // close-on-exec, so only the dup2'd copies survive into the child.
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        if (prev_read != -1)
+            posix_spawn_file_actions_adddup2(&actions, prev_read, STDIN_FILENO);
+        if (next[1] != -1)
+            posix_spawn_file_actions_adddup2(&actions, next[1], STDOUT_FILENO);
+        else if (outfd[1] != -1)
+            posix_spawn_file_actions_adddup2(&actions, outfd[1], STDOUT_FILENO);
+        if (outfd[1] != -1)
+            posix_spawn_file_actions_adddup2(&actions, outfd[1], STDERR_FILENO);
+        for (size_t r = 0; r < redirections->count; r++) // 2>&1 copies whatever stdout is by then
+            posix_spawn_file_actions_adddup2(&actions, fds[r] != -1 ? fds[r] : STDOUT_FILENO, redirections->list[r].fd);
+
+        pid_t pid;
+        posix_spawnattr_setpgroup(&attr, pgid);
+        int err = posix_spawn(&pid, path, &actions, &attr, args, environ); // Already resolved, so no $PATH walk
+        posix_spawn_file_actions_destroy(&actions);
+        close_redirections(redirections, fds);
+        if (err != 0) // Spawn failed
         {
-            while (fgets(buffer, sizeof(buffer), fp))
+            print_error("Error: failed to run `%s`: %s", args[0], strerror(err));
+            failed = err == ENOENT ? 127 : 126;
+            if (next[0] != -1)
             {
-                // Remove trailing newline if it exists
-                size_t len = strlen(buffer);
-                if (len > 0 && buffer[len - 1] == '\n')
-                {
-                    buffer[len - 1] = '\0';
-                }
-
-                adjust_window();
-                mvwprintw(output_win, line, 0, "%s", buffer);
-                add_to_scroll_history(&scroll_his, buffer);
+                close(next[0]);
+                close(next[1]);
             }
-            fclose(fp);
+            break;
+        }
+
+        if (pgid == 0)
+        {
+            pgid = pid;
+            if (!background)
+                give_terminal(pgid);
         }
-        close(pipefd[0]);
 
-        // Wait for child process to finish
-        waitpid(pid, NULL, 0);
+        // The parent keeps no pipe ends except the one the next stage reads from
+        pids[spawned++] = pid;
+        if (prev_read != -1)
+            close(prev_read);
+        if (next[1] != -1)
+            close(next[1]);
+        prev_read = next[0];
+    }
+
+    posix_spawnattr_destroy(&attr);
+    if (prev_read != -1)
+        close(prev_read);
+    if (outfd[1] != -1)
+        close(outfd[1]); // Close write end in parent
+
+    if (failed || redirect_failed)
+    {
+        // Half a pipeline is not run: stop the stages already started and reap them here,
+        // before they become a job
+        if (spawned > 0 && output->interactive)
+            kill(-pgid, SIGKILL);
+        for (int i = 0; i < spawned; i++)
+            kill(pids[i], SIGKILL);
+        for (int i = 0; i < spawned; i++)
+            while (waitpid(pids[i], NULL, 0) == -1 && errno == EINTR)
+                ;
+        if (spawned > 0 && !background && output->interactive)
+            give_terminal(getpgrp());
+        if (outfd[0] != -1)
+            close(outfd[0]);
+        if (failed)
+            last_status = failed; // A failed redirection has set its own
+        free(pids);
+        return;
+    }
+
+    // A stage that touched the terminal before it was handed over got SIGTTIN, wake it up
+    if (!background && output->interactive)
+        kill(-pgid, SIGCONT);
+
+    Job *job = add_job(command, pids, spawned, pgid, outfd[0], background);
+    free(pids);
+    job->started = started;
+    if (collect)
+        job->capture = &record->output;
+    else
+        job->record = record;
+    if (background)
+    {
+        print_line("[%d] %d", job->id, pgid);
+        output->flush();
     }
+    else
+        wait_for_job(job);
 }
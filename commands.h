@@ -6,35 +6,68 @@
 #include <string.h>
 #include <ncurses.h>
 #include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <spawn.h>
+#include <signal.h>
+#include "expand.h"
+#include "redirect.h"
+#include "scrollback.h"
 
 #define BUFFER_SIZE 1024
-#define MAX_SCROLLBACK 1000 // Number of lines to keep in scrollback buffer
+#define READ_CHUNK 65536                   // Bytes drained from a child pipe per read()
+#define FRAME_INTERVAL_NS (1000000000 / 60) // Repaint child output at most 60 times a second
 #define LINE_LENGTH 512
-#define MAX_ARGS 10
+#define PIPE_BUFFER_SIZE (1024 * 1024) // Kernel buffer requested for pipeline pipes
 
 // Globals
 extern WINDOW *output_win;
 extern int line;
 
-// Structure to hold every line printed
+extern Scroll_History scroll_his; // Global variable
+
+// Input loop state that builtins are allowed to reset
 typedef struct
 {
-    char data[MAX_SCROLLBACK][LINE_LENGTH];
-    size_t length;
-} Scroll_History;
+    long *history_index;
+    int *scroll_offset;
+} Shell_State;
 
-extern Scroll_History scroll_his; // Global variable
+// Every builtin is called with its expanded words, its name first, and the input loop state
+typedef void (*Builtin_Fn)(const Word_List *words, Shell_State *state);
+
+// An in-process stand-in for an executable, given the expanded words like a builtin.
+// Returns false, having printed nothing, when the arguments need the real thing.
+typedef bool (*Fast_Path_Fn)(const Word_List *words);
+
+// One command of a pipeline, its redirections taken out and its words expanded
+typedef struct
+{
+    Redirections redirections;
+    Word_List words;
+} Stage;
+
+struct Output_Record; // jobs.h, which includes this file
 
 // Function prototypes
 void execute_about(void);
 void execute_greet(char *name);
-void execute_clear(int *history_index, int *index, int *scroll_offset);
+void execute_clear(long *history_index, int *scroll_offset);
 void execute_echo(char *args);
 void execute_time(void);
-void execute_bin(char *input);
+void execute_cd(char *path);
+void execute_pwd(void);
+bool prepare_stage(char *command, Stage *stage);
+void execute_bin(Stage stages[], int count, const char *command, bool background, struct Output_Record *record);
 extern void adjust_window();
-extern void add_to_scroll_history(Scroll_History *history, char *data);
+extern void show_new_lines(size_t count);
+extern void show_lines_above_prompt(size_t count);
+extern void resize_window(bool prompt_shown);
+void invalidate_prompt(void);
+void refresh_prompt(void);
+void completion_ready(void);
 
 #endif // COMMANDS_H
@@ -0,0 +1,530 @@
+#define _GNU_SOURCE // getdents64, pipe2
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <ncurses.h>
+#include <sys/stat.h>
+#include "command_index.h"
+#include "commands.h"
+#include "complete.h"
+#include "jobs.h"
+#include "stats.h"
+
+// Directories are looked at and read on a thread of their own: a stat() or getdents64 on
+// a hung network mount blocks for as long as the mount does, and a big directory takes a
+// while to read. A Tab waits COMPLETE_BUDGET_NS for the answer at most, and the listing is
+// merged into the cache whenever it arrives.
+static struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    Dir_Listing *pending; // Not started yet
+    Dir_Listing *done;    // Answers not picked up yet, newest first
+    int notify[2];        // A byte is written for each answer, the event loop waits on it
+    bool started;
+} reader = {.lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER, .notify = {-1, -1}};
+
+// The rest is only used by the shell's thread
+static Dir_Cache dir_cache[DIR_CACHE_SIZE];
+static unsigned long dir_clock = 0;
+static char *waiting_dir; // Directory a Tab gave up waiting for, NULL when none
+
+static Trie command_trie;             // Every builtin and $PATH executable
+static unsigned long command_generation; // Command index generation the trie was built from
+
+static void *xrealloc(void *p, size_t size)
+{
+    p = realloc(p, size);
+    if (p == NULL)
+    {
+        perror("Error allocating completions");
+        endwin();
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+static uint32_t new_node(Trie *trie)
+{
+    if (trie->node_count == trie->node_size)
+    {
+        trie->node_size = trie->node_size ? trie->node_size * 2 : 256;
+        trie->nodes = xrealloc(trie->nodes, trie->node_size * sizeof(Trie_Node));
+    }
+    trie->nodes[trie->node_count] = (Trie_Node){0};
+    return trie->node_count++;
+}
+
+// Empty the trie but keep its memory, leaving just the root
+static void reset_trie(Trie *trie)
+{
+    trie->node_count = 0;
+    trie->pool_used = 0;
+    new_node(trie);
+}
+
+static void free_trie(Trie *trie)
+{
+    free(trie->nodes);
+    free(trie->pool);
+    *trie = (Trie){0};
+}
+
+static void insert_name(Trie *trie, const char *name, size_t len, uint8_t type)
+{
+    if (len == 0 || len > UINT16_MAX)
+        return;
+    if (trie->node_count == 0)
+        new_node(trie);
+
+    if (trie->pool_used + len + 1 > trie->pool_size)
+    {
+        trie->pool_size = trie->pool_size ? trie->pool_size * 2 : 4096;
+        if (trie->pool_size < trie->pool_used + len + 1)
+            trie->pool_size = trie->pool_used + len + 1;
+        trie->pool = xrealloc(trie->pool, trie->pool_size);
+    }
+    uint32_t off = trie->pool_used;
+    char *text = trie->pool + off;
+    memcpy(text, name, len);
+    text[len] = '\0';
+    trie->pool_used += len + 1;
+
+    uint32_t node = TRIE_ROOT;
+    size_t pos = 0;
+    while (pos < len)
+    {
+        unsigned char c = text[pos];
+        uint32_t prev = 0;
+        uint32_t child = trie->nodes[node].child;
+        while (child && (unsigned char)trie->pool[trie->nodes[child].label] < c)
+        {
+            prev = child;
+            child = trie->nodes[child].sibling;
+        }
+
+        if (child == 0 || (unsigned char)trie->pool[trie->nodes[child].label] != c)
+        {
+            // No edge starts with this byte, so the rest of the name becomes a new leaf
+            uint32_t leaf = new_node(trie);
+            trie->nodes[leaf] = (Trie_Node){.label = off + pos, .name = off, .sibling = child,
+                                            .label_len = len - pos, .type = type, .terminal = true};
+            if (prev)
+                trie->nodes[prev].sibling = leaf;
+            else
+                trie->nodes[node].child = leaf;
+            return;
+        }
+
+        size_t k = 1;
+        while (k < trie->nodes[child].label_len && pos + k < len && trie->pool[trie->nodes[child].label + k] == text[pos + k])
+            k++;
+        if (k < trie->nodes[child].label_len)
+        {
+            // The name leaves the edge part way along, so split the edge there
+            uint32_t rest = new_node(trie);
+            Trie_Node *edge = &trie->nodes[child];
+            trie->nodes[rest] = *edge;
+            trie->nodes[rest].label += k;
+            trie->nodes[rest].label_len -= k;
+            trie->nodes[rest].sibling = 0;
+            *edge = (Trie_Node){.label = edge->label, .child = rest, .sibling = edge->sibling, .label_len = k};
+        }
+        node = child;
+        pos += k;
+    }
+    trie->nodes[node].terminal = true;
+    trie->nodes[node].name = off;
+    trie->nodes[node].type = type;
+}
+
+// Node whose subtree holds every name starting with `prefix`
+static bool find_prefix(const Trie *trie, const char *prefix, size_t len, uint32_t *found)
+{
+    if (trie->node_count == 0)
+        return false;
+
+    uint32_t node = TRIE_ROOT;
+    size_t pos = 0;
+    while (pos < len)
+    {
+        uint32_t child = trie->nodes[node].child;
+        while (child && trie->pool[trie->nodes[child].label] != prefix[pos])
+            child = trie->nodes[child].sibling;
+        if (child == 0)
+            return false;
+
+        const Trie_Node *edge = &trie->nodes[child];
+        size_t n = edge->label_len < len - pos ? edge->label_len : len - pos;
+        if (memcmp(trie->pool + edge->label, prefix + pos, n) != 0)
+            return false;
+        node = child;
+        pos += n;
+    }
+    *found = node;
+    return true;
+}
+
+static void add_completion(Completions *out, const char *name, uint8_t type)
+{
+    if (out->count == out->size)
+    {
+        out->size = out->size ? out->size * 2 : 64;
+        out->names = xrealloc(out->names, out->size * sizeof(char *));
+        out->types = xrealloc(out->types, out->size);
+    }
+    out->names[out->count] = name;
+    out->types[out->count] = type;
+    out->count++;
+}
+
+// Every name under `node` in byte order. Dot files only show up when asked for.
+static void collect_names(const Trie *trie, uint32_t node, bool hidden, Completions *out)
+{
+    const Trie_Node *n = &trie->nodes[node];
+    if (n->terminal && (hidden || trie->pool[n->name] != '.'))
+        add_completion(out, trie->pool + n->name, n->type);
+    for (uint32_t c = n->child; c; c = trie->nodes[c].sibling)
+        collect_names(trie, c, hidden, out);
+}
+
+static void insert_command(const char *name, void *arg)
+{
+    insert_name(&command_trie, name, strlen(name), DT_UNKNOWN);
+}
+
+static long long timespec_ns(const struct timespec *ts)
+{
+    return ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+// Whether what was read still stands. File times come from a clock that only ticks every
+// few milliseconds, so a change in the same tick as the one before leaves the mtime where
+// it was: a listing started less than DIR_RACY_NS after its mtime is not trusted.
+static bool listing_current(const Dir_Listing *listing, const struct stat *st)
+{
+    if (!listing->listed || listing->mtime.tv_sec != st->st_mtim.tv_sec || listing->mtime.tv_nsec != st->st_mtim.tv_nsec)
+        return false;
+    return timespec_ns(&listing->read_at) - timespec_ns(&st->st_mtim) >= DIR_RACY_NS;
+}
+
+// Look at the directory and read every entry into the listing's trie, unless the cached
+// listing still stands. Runs on the reader thread, or on the shell's for a glob.
+static void read_listing(Dir_Listing *listing)
+{
+    struct stat st;
+    listing->is_dir = stat(listing->path, &st) == 0 && S_ISDIR(st.st_mode);
+    if (!listing->is_dir || (listing->unchanged = listing_current(listing, &st)))
+        return;
+
+    clock_gettime(CLOCK_REALTIME, &listing->read_at);
+    int fd = open(listing->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1 || fstat(fd, &st) == -1)
+    {
+        listing->is_dir = false;
+        if (fd != -1)
+            close(fd);
+        return;
+    }
+    listing->mtime = st.st_mtim;
+
+    reset_trie(&listing->trie);
+    char buffer[DIR_SLICE_BYTES] __attribute__((aligned(8)));
+    ssize_t n;
+    while ((n = getdents64(fd, buffer, sizeof(buffer))) > 0)
+    {
+        for (ssize_t off = 0; off < n;)
+        {
+            struct dirent64 *d = (struct dirent64 *)(buffer + off);
+            off += d->d_reclen;
+            if (strcmp(d->d_name, ".") != 0 && strcmp(d->d_name, "..") != 0)
+                insert_name(&listing->trie, d->d_name, strlen(d->d_name), d->d_type);
+        }
+    }
+    close(fd);
+}
+
+// Answer requests one at a time, newest first
+static void *dir_reader(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&reader.lock);
+    while (1)
+    {
+        while (reader.pending == NULL)
+            pthread_cond_wait(&reader.wake, &reader.lock);
+        Dir_Listing *listing = reader.pending;
+        reader.pending = listing->next;
+        pthread_mutex_unlock(&reader.lock);
+
+        read_listing(listing);
+
+        pthread_mutex_lock(&reader.lock);
+        listing->next = reader.done;
+        reader.done = listing;
+        write(reader.notify[1], "", 1); // When the pipe is full a wakeup is waiting already
+    }
+    return NULL;
+}
+
+// The cache slot for `path`, NULL when it has none
+static Dir_Cache *cached_dir(const char *path)
+{
+    for (int i = 0; i < DIR_CACHE_SIZE; i++)
+        if (dir_cache[i].path && strcmp(dir_cache[i].path, path) == 0)
+            return &dir_cache[i];
+    return NULL;
+}
+
+// The cache slot for `path`, taking over the least recently used one for a new directory
+static Dir_Cache *find_dir(const char *path)
+{
+    Dir_Cache *slot = cached_dir(path);
+    if (slot)
+        return slot;
+    slot = &dir_cache[0];
+    for (int i = 1; i < DIR_CACHE_SIZE; i++)
+        if (dir_cache[i].used < slot->used)
+            slot = &dir_cache[i];
+
+    free(slot->path);
+    free_trie(&slot->trie);
+    *slot = (Dir_Cache){.path = strdup(path)};
+    return slot;
+}
+
+// A request for the slot's directory, carrying what is cached so an unchanged directory
+// costs the reader one stat
+static Dir_Listing new_listing(const Dir_Cache *dir)
+{
+    return (Dir_Listing){.path = dir->path, .mtime = dir->mtime, .read_at = dir->read_at, .listed = dir->listed};
+}
+
+// Take what a listing found into the slot. A listing read before the one cached is dropped.
+static void merge_listing(Dir_Cache *dir, Dir_Listing *listing)
+{
+    if (!listing->is_dir)
+        dir->listed = false;
+    else if (!listing->unchanged && (!dir->listed || timespec_ns(&listing->read_at) >= timespec_ns(&dir->read_at)))
+    {
+        free_trie(&dir->trie);
+        dir->trie = listing->trie;
+        listing->trie = (Trie){0};
+        dir->mtime = listing->mtime;
+        dir->read_at = listing->read_at;
+        dir->listed = true;
+    }
+    free_trie(&listing->trie);
+}
+
+// Ask the reader thread about the slot's directory, unless it is already on it
+static void request_listing(Dir_Cache *dir)
+{
+    if (dir->reading)
+        return;
+    Dir_Listing *listing = xrealloc(NULL, sizeof(Dir_Listing));
+    *listing = new_listing(dir);
+    listing->path = strdup(dir->path);
+    if (listing->path == NULL)
+    {
+        free(listing);
+        return;
+    }
+    dir->reading = true;
+
+    pthread_mutex_lock(&reader.lock);
+    listing->next = reader.pending;
+    reader.pending = listing;
+    pthread_cond_signal(&reader.wake);
+    pthread_mutex_unlock(&reader.lock);
+}
+
+// The reader answered: merge what it found into the cache, and press Tab again for a Tab
+// that gave up waiting on it
+static void take_listings(void *arg)
+{
+    (void)arg;
+    char bytes[64];
+    while (read(reader.notify[0], bytes, sizeof(bytes)) > 0)
+        ;
+
+    pthread_mutex_lock(&reader.lock);
+    Dir_Listing *listing = reader.done;
+    reader.done = NULL;
+    pthread_mutex_unlock(&reader.lock);
+
+    while (listing)
+    {
+        Dir_Listing *next = listing->next;
+        Dir_Cache *dir = cached_dir(listing->path); // Gone when the slot was taken over meanwhile
+        if (dir)
+        {
+            dir->reading = false;
+            merge_listing(dir, listing);
+        }
+        else
+            free_trie(&listing->trie);
+        free(listing->path);
+        free(listing);
+        listing = next;
+    }
+
+    Dir_Cache *waited = waiting_dir ? cached_dir(waiting_dir) : NULL;
+    if (waiting_dir && (waited == NULL || !waited->reading))
+    {
+        free(waiting_dir);
+        waiting_dir = NULL;
+        if (waited && waited->listed)
+            completion_ready();
+    }
+}
+
+// Wait for the reader to answer about `dir`, until `deadline` at the latest. Returns false
+// if it has not answered by then.
+static bool wait_for_listing(Dir_Cache *dir, long long deadline)
+{
+    while (dir->reading)
+    {
+        long long left = deadline - monotonic_ns();
+        struct pollfd pfd = {.fd = reader.notify[0], .events = POLLIN};
+        if (left <= 0 || poll(&pfd, 1, (left + 999999) / 1000000) == 0)
+            return false;
+        take_listings(NULL);
+    }
+    return true;
+}
+
+// Start the reader thread. Called after init_jobs(), so it blocks SIGCHLD too and the
+// signal still reaches the event loop. Without it directories are read on the shell's thread.
+void init_completion(void)
+{
+    if (pipe2(reader.notify, O_CLOEXEC | O_NONBLOCK) == -1)
+        return;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, dir_reader, NULL) != 0)
+    {
+        close(reader.notify[0]);
+        close(reader.notify[1]);
+        return;
+    }
+    pthread_detach(thread);
+    reader.started = true;
+    add_watch(reader.notify[0], take_listings, NULL);
+}
+
+// Read the slot's directory on this thread, for a glob or when there is no reader thread
+static void read_dir_now(Dir_Cache *dir)
+{
+    Dir_Listing listing = new_listing(dir);
+    read_listing(&listing);
+    merge_listing(dir, &listing);
+}
+
+// Names that complete `word`: commands when it is the first word of the line, otherwise
+// entries of the directory it names. The reader thread gets COMPLETE_BUDGET_NS to look at
+// the directory. When it takes longer a cached listing is used as it is, and without one
+// `partial` is set and completion_ready() is called once the directory has been read.
+bool find_completions(const char *word, size_t len, bool command, Completions *out)
+{
+    out->count = 0;
+    out->partial = false;
+    out->dir[0] = '\0';
+    free(waiting_dir);
+    waiting_dir = NULL;
+
+    if (command)
+    {
+        refresh_command_index();
+        if (command_trie.node_count == 0 || command_generation != command_index_generation())
+        {
+            reset_trie(&command_trie);
+            for_each_command(insert_command, NULL);
+            command_generation = command_index_generation();
+        }
+        out->base = 0;
+        uint32_t node;
+        if (find_prefix(&command_trie, word, len, &node))
+            collect_names(&command_trie, node, true, out);
+        return out->count > 0;
+    }
+
+    // The directory is everything up to the last slash, relative to the cwd unless absolute
+    const char *slash = memrchr(word, '/', len);
+    out->base = slash ? slash - word + 1 : 0;
+    char cwd[4096];
+    if (word[0] != '/' && getcwd(cwd, sizeof(cwd)) == NULL)
+        return false;
+    int n = word[0] == '/' ? snprintf(out->dir, sizeof(out->dir), "%.*s", (int)out->base, word)
+                           : snprintf(out->dir, sizeof(out->dir), "%s/%.*s", cwd, (int)out->base, word);
+    if (n < 0 || (size_t)n >= sizeof(out->dir))
+        return false;
+
+    Dir_Cache *dir = find_dir(out->dir);
+    dir->used = ++dir_clock;
+    if (!reader.started)
+        read_dir_now(dir);
+    else
+    {
+        request_listing(dir);
+        if (!wait_for_listing(dir, monotonic_ns() + COMPLETE_BUDGET_NS) && !dir->listed)
+        {
+            out->partial = true;
+            waiting_dir = strdup(dir->path);
+            return false;
+        }
+    }
+    if (!dir->listed)
+        return false;
+
+    uint32_t node;
+    if (find_prefix(&dir->trie, word + out->base, len - out->base, &node))
+        collect_names(&dir->trie, node, word[out->base] == '.', out);
+    return out->count > 0;
+}
+
+// Entries of the directory `path`, an absolute path, whose names start with `prefix`, in
+// byte order. Unlike a Tab the directory is read here and to the end, commands wait for
+// their globs anyway. Dot files only show up when the prefix starts with a dot. Globs go
+// through here, so they share the Tab cache and a directory listed again with its mtime
+// unchanged costs one stat.
+bool list_directory(const char *path, const char *prefix, size_t len, Completions *out)
+{
+    out->count = 0;
+    out->partial = false;
+    out->base = 0;
+    int n = snprintf(out->dir, sizeof(out->dir), "%s", path);
+    if (n < 0 || (size_t)n >= sizeof(out->dir))
+        return false;
+    Dir_Cache *dir = find_dir(path);
+    dir->used = ++dir_clock;
+    read_dir_now(dir);
+    if (!dir->listed)
+        return false;
+
+    uint32_t node;
+    if (find_prefix(&dir->trie, prefix, len, &node))
+        collect_names(&dir->trie, node, len > 0 && prefix[0] == '.', out);
+    return true;
+}
+
+// Whether the i-th name is a directory. getdents64 does not say for symlinks and some
+// filesystems, `look_up` stats those.
+bool completion_is_dir(const Completions *completions, size_t i, bool look_up)
+{
+    uint8_t type = completions->types[i];
+    if (type == DT_DIR)
+        return true;
+    if (!look_up || (type != DT_UNKNOWN && type != DT_LNK) || completions->dir[0] == '\0')
+        return false;
+
+    char path[strlen(completions->dir) + strlen(completions->names[i]) + 2];
+    sprintf(path, "%s/%s", completions->dir, completions->names[i]);
+    struct stat st;
+    return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
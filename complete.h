@@ -0,0 +1,83 @@
+#ifndef COMPLETE_H
+#define COMPLETE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define DIR_CACHE_SIZE 8                       // Directories whose tries are kept between Tabs
+#define DIR_SLICE_BYTES (32 * 1024)            // Directory entries read per getdents64 call
+#define COMPLETE_BUDGET_NS (20 * 1000 * 1000)  // Longest Tab waits for the reader thread
+#define DIR_RACY_NS (20 * 1000 * 1000)         // A listing read this soon after the mtime is read again
+#define TRIE_ROOT 0
+
+// One edge of a path compressed trie. Children are kept in a sibling list sorted by byte,
+// so walking the trie lists names in order.
+typedef struct
+{
+    uint32_t label;     // Offset of the edge's text in the pool
+    uint32_t name;      // Offset of the whole name in the pool, for terminal nodes
+    uint32_t child;     // First child, 0 for none (the root is never anyone's child)
+    uint32_t sibling;   // Next child of the same parent, 0 for none
+    uint16_t label_len;
+    uint8_t type;       // d_type of the entry, DT_UNKNOWN for commands
+    bool terminal;      // A name ends at this node
+} Trie_Node;
+
+// Names sharing prefixes, with their text packed into one pool
+typedef struct
+{
+    Trie_Node *nodes;
+    size_t node_count;
+    size_t node_size;
+    char *pool;
+    size_t pool_used;
+    size_t pool_size;
+} Trie;
+
+// A directory's entries, read by the reader thread and kept until its mtime moves
+typedef struct
+{
+    char *path;            // Absolute path, NULL for an unused slot
+    Trie trie;
+    struct timespec mtime; // mtime when reading started
+    struct timespec read_at; // Wall clock time reading started
+    bool listed;           // `trie` holds every entry as of `read_at`
+    bool reading;          // Asked of the reader thread, not answered yet
+    unsigned long used;    // When the slot was last completed in, the least recent is reused
+} Dir_Cache;
+
+// A directory for the reader thread to look at, and what it found. The thread only ever
+// touches its own copy, the cache is updated from it by the shell's thread.
+typedef struct Dir_Listing
+{
+    char *path;
+    struct timespec mtime;   // The cached listing's, then the directory's
+    struct timespec read_at; // When the cached listing was read, then when this one was
+    bool listed;             // A listing is cached and may still stand
+    bool is_dir;             // False when `path` is not a directory or cannot be read
+    bool unchanged;          // The cached listing still stands, `trie` is left empty
+    Trie trie;
+    struct Dir_Listing *next;
+} Dir_Listing;
+
+// Names that can finish a word, in byte order
+typedef struct
+{
+    const char **names;   // Whole names, pointing into a trie
+    uint8_t *types;       // d_type of each name
+    size_t count;
+    size_t size;
+    size_t base;          // Where the part being completed starts in the word
+    bool partial;         // The directory was not read to the end in time
+    char dir[4096];       // Directory the names are in, for looking up their types
+} Completions;
+
+// Function prototypes
+bool find_completions(const char *word, size_t len, bool command, Completions *out);
+bool list_directory(const char *path, const char *prefix, size_t len, Completions *out);
+bool completion_is_dir(const Completions *completions, size_t i, bool look_up);
+void init_completion(void);
+
+#endif // COMPLETE_H
@@ -0,0 +1,492 @@
+#include <ctype.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <pwd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <ncurses.h>
+#include <sys/stat.h>
+#include "complete.h"
+#include "expand.h"
+#include "jobs.h"
+#include "output.h"
+
+// Word expansion, between cutting a line into commands and running one: quotes and
+// backslashes, $VAR, ~ and *?[...] globbing, giving an argv as long as it needs to be.
+// Globs list directories through the completion cache, so a directory is read with
+// getdents64 once and globbed again without reading it until its mtime moves.
+
+#define PLAIN_STOP " \t\n\v\f\r\\'\"$*?[" // Bytes that end a run taken as it is
+
+typedef struct
+{
+    char *data;
+    size_t length;
+    size_t size;
+} Word_Buffer;
+
+// The word being built, both as its text and as a glob pattern with every quoted *, ?, [
+// and \ escaped, so only the ones typed bare take part in matching
+typedef struct
+{
+    Word_Buffer text;
+    Word_Buffer pattern;
+    bool started; // Even "" makes a word
+    bool glob;    // A bare *, ? or [ is in it
+} Word_Builder;
+
+static void *xrealloc(void *p, size_t size)
+{
+    p = realloc(p, size);
+    if (p == NULL)
+    {
+        perror("Error allocating arguments");
+        endwin();
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+// Append a byte, always leaving room for a NUL after it
+static void put_byte(Word_Buffer *buffer, char c)
+{
+    if (buffer->length + 2 > buffer->size)
+    {
+        buffer->size = buffer->size ? buffer->size * 2 : 64;
+        buffer->data = xrealloc(buffer->data, buffer->size);
+    }
+    buffer->data[buffer->length++] = c;
+}
+
+static void put_bytes(Word_Buffer *buffer, const char *bytes, size_t n)
+{
+    if (buffer->length + n + 1 > buffer->size)
+    {
+        buffer->size = buffer->size ? buffer->size * 2 : 64;
+        if (buffer->size < buffer->length + n + 1)
+            buffer->size = buffer->length + n + 1;
+        buffer->data = xrealloc(buffer->data, buffer->size);
+    }
+    memcpy(buffer->data + buffer->length, bytes, n);
+    buffer->length += n;
+}
+
+static void add_word(Word_List *words, const char *text, size_t len)
+{
+    if (words->count + 2 > words->size)
+    {
+        words->size = words->size ? words->size * 2 : 8;
+        words->argv = xrealloc(words->argv, words->size * sizeof(char *));
+    }
+    char *word = xrealloc(NULL, len + 1);
+    memcpy(word, text, len);
+    word[len] = '\0';
+    words->argv[words->count++] = word;
+    words->argv[words->count] = NULL;
+}
+
+void free_words(Word_List *words)
+{
+    for (size_t i = 0; i < words->count; i++)
+        free(words->argv[i]);
+    free(words->argv);
+    *words = (Word_List){0};
+}
+
+// Drop the first word, for a prefix like `cached` that is not part of the command
+void shift_words(Word_List *words)
+{
+    if (words->count == 0)
+        return;
+    free(words->argv[0]);
+    memmove(words->argv, words->argv + 1, words->count * sizeof(char *)); // The NULL too
+    words->count--;
+}
+
+// The last byte of the quoted text or backslash escape that starts at `p`. A quote left
+// open runs to the end of the text.
+char *skip_quoted(const char *p)
+{
+    if (*p == '\\')
+        return (char *)(p[1] ? p + 1 : p);
+    for (const char *q = p + 1; *q; q++)
+    {
+        if (*p == '"' && *q == '\\' && q[1])
+            q++;
+        else if (*q == *p)
+            return (char *)q;
+    }
+    return (char *)p + strlen(p) - 1;
+}
+
+// Like strpbrk, but bytes inside quotes or after a backslash never match
+char *find_unquoted(const char *text, const char *set)
+{
+    char stop[strlen(set) + 4];
+    sprintf(stop, "\\'\"%s", set);
+    for (const char *p = text + strcspn(text, stop); *p; p += strcspn(p, stop))
+    {
+        if (*p != '\\' && *p != '\'' && *p != '"')
+            return (char *)p;
+        p = skip_quoted(p) + 1;
+    }
+    return NULL;
+}
+
+// Words `first` on joined by single spaces, for builtins like `echo` that show them as one
+// line. NULL when there are none. The caller frees it.
+char *join_words(const Word_List *words, size_t first)
+{
+    if (first >= words->count)
+        return NULL;
+    size_t len = 0;
+    for (size_t i = first; i < words->count; i++)
+        len += strlen(words->argv[i]) + 1;
+    char *joined = xrealloc(NULL, len);
+    char *p = joined;
+    for (size_t i = first; i < words->count; i++)
+    {
+        size_t n = strlen(words->argv[i]);
+        memcpy(p, words->argv[i], n);
+        p += n;
+        *p++ = ' ';
+    }
+    p[-1] = '\0';
+    return joined;
+}
+
+static void add_char(Word_Builder *builder, char c, bool quoted)
+{
+    put_byte(&builder->text, c);
+    if (quoted && strchr("*?[\\", c))
+        put_byte(&builder->pattern, '\\');
+    else if (!quoted && strchr("*?[", c))
+        builder->glob = true;
+    put_byte(&builder->pattern, c);
+    builder->started = true;
+}
+
+// Whether the component `pattern` (a whole path component, NUL terminated) matches `name`,
+// which already starts with the component's `prefix_len` literal bytes. `special` is the
+// first *, ? or [ in it. `*.o` and `lib*.a` are by far the usual shapes, so one star
+// followed by plain text is matched by comparing the end of the name, anything else goes
+// to fnmatch.
+static bool match_component(const char *pattern, const char *special, size_t prefix_len, const char *name)
+{
+    if (special[0] == '*' && strpbrk(special + 1, "*?[\\") == NULL)
+    {
+        size_t suffix_len = strlen(special + 1);
+        size_t name_len = strlen(name);
+        return name_len >= prefix_len + suffix_len && memcmp(name + name_len - suffix_len, special + 1, suffix_len) == 0;
+    }
+    return fnmatch(pattern, name, 0) == 0;
+}
+
+// Add every path that matches `pattern` to `words`, in byte order. `path` holds the `len`
+// bytes matched so far, `pattern` the components still to go.
+static void glob_walk(char *path, size_t len, const char *pattern, const char *cwd, Word_List *words)
+{
+    const char *slash = strchr(pattern, '/');
+    size_t component_len = slash ? (size_t)(slash - pattern) : strlen(pattern);
+    if (component_len >= GLOB_PATH_MAX)
+        return; // Too long to match anything, and too long for the copies below
+    char component[component_len + 1];
+    memcpy(component, pattern, component_len);
+    component[component_len] = '\0';
+
+    // The literal part up to the first *, ? or [, without its escapes
+    char prefix[component_len + 1];
+    size_t prefix_len = 0;
+    const char *special = component;
+    for (; *special && !strchr("*?[", *special); special++)
+    {
+        if (*special == '\\' && special[1])
+            special++;
+        prefix[prefix_len++] = *special;
+    }
+
+    if (*special == '\0')
+    {
+        // Nothing to match in this component, so it is taken as it is
+        if (len + prefix_len + 1 >= GLOB_PATH_MAX)
+            return;
+        memcpy(path + len, prefix, prefix_len);
+        len += prefix_len;
+        if (slash)
+        {
+            path[len] = '/';
+            glob_walk(path, len + 1, slash + 1, cwd, words);
+            return;
+        }
+        path[len] = '\0';
+        struct stat st;
+        if (lstat(path, &st) == 0)
+            add_word(words, path, len);
+        return;
+    }
+
+    char dir[4096];
+    path[len] = '\0';
+    int n = path[0] == '/' ? snprintf(dir, sizeof(dir), "%s", path) : snprintf(dir, sizeof(dir), "%s/%s", cwd, path);
+    Completions names = {0};
+    if (n >= 0 && (size_t)n < sizeof(dir) && list_directory(dir, prefix, prefix_len, &names))
+    {
+        Word_List dirs = {0};
+        for (size_t i = 0; i < names.count; i++)
+        {
+            if (!match_component(component, special, prefix_len, names.names[i]))
+                continue;
+            size_t name_len = strlen(names.names[i]);
+            if (slash == NULL && len + name_len < GLOB_PATH_MAX)
+            {
+                memcpy(path + len, names.names[i], name_len);
+                add_word(words, path, len + name_len);
+            }
+            else if (slash && completion_is_dir(&names, i, true))
+                add_word(&dirs, names.names[i], name_len);
+        }
+
+        // Listing a subdirectory can take over the cache slot the names point into, so the
+        // directories to go down were copied out first
+        for (size_t i = 0; i < dirs.count; i++)
+        {
+            size_t name_len = strlen(dirs.argv[i]);
+            if (len + name_len + 1 >= GLOB_PATH_MAX)
+                continue;
+            memcpy(path + len, dirs.argv[i], name_len);
+            path[len + name_len] = '/';
+            glob_walk(path, len + name_len + 1, slash + 1, cwd, words);
+        }
+        free_words(&dirs);
+    }
+    free(names.names);
+    free(names.types);
+}
+
+static void expand_glob(const char *pattern, Word_List *words)
+{
+    char cwd[4096];
+    if (pattern[0] != '/' && getcwd(cwd, sizeof(cwd)) == NULL)
+        return;
+    char path[GLOB_PATH_MAX];
+    glob_walk(path, 0, pattern, cwd, words);
+}
+
+// End the word being built. A glob that matches nothing is left as it was typed.
+static void finish_word(Word_Builder *builder, Word_List *words)
+{
+    if (builder->started)
+    {
+        size_t before = words->count;
+        if (builder->glob)
+        {
+            builder->pattern.data[builder->pattern.length] = '\0';
+            expand_glob(builder->pattern.data, words);
+        }
+        if (words->count == before)
+            add_word(words, builder->text.length ? builder->text.data : "", builder->text.length);
+    }
+    builder->text.length = 0;
+    builder->pattern.length = 0;
+    builder->started = false;
+    builder->glob = false;
+}
+
+// Expand the `$` at `p`: $NAME, ${NAME}, $? or $$. Outside quotes the value is split into
+// words at blanks and may glob. Returns the bytes used, 0 on a syntax error.
+static size_t expand_variable(Word_Builder *builder, Word_List *words, const char *p, bool quoted)
+{
+    const char *name = p + 1;
+    size_t name_len = 0;
+    size_t used;
+    if (p[1] == '{')
+    {
+        const char *close = strchr(p + 2, '}');
+        if (close == NULL)
+        {
+            print_error("Syntax error: missing closing `}`.");
+            return 0;
+        }
+        name = p + 2;
+        name_len = close - name;
+        used = name_len + 3;
+    }
+    else
+    {
+        if (p[1] == '?' || p[1] == '$')
+            name_len = 1;
+        else if (isalpha((unsigned char)p[1]) || p[1] == '_')
+            while (isalnum((unsigned char)name[name_len]) || name[name_len] == '_')
+                name_len++;
+        used = name_len + 1;
+    }
+    if (name_len == 0 && used == 1)
+    {
+        add_char(builder, '$', quoted); // A lone `$` is just a dollar sign
+        return 1;
+    }
+
+    char number[24];
+    const char *value = number;
+    if (name_len == 1 && name[0] == '?')
+        snprintf(number, sizeof(number), "%d", last_status);
+    else if (name_len == 1 && name[0] == '$')
+        snprintf(number, sizeof(number), "%d", (int)getpid());
+    else
+    {
+        char *key = xrealloc(NULL, name_len + 1); // A pasted name can be any length
+        memcpy(key, name, name_len);
+        key[name_len] = '\0';
+        value = getenv(key);
+        free(key);
+    }
+
+    for (; value && *value; value++)
+    {
+        if (!quoted && strchr(" \t\n", *value))
+            finish_word(builder, words);
+        else
+            add_char(builder, *value, quoted || *value == '\\');
+    }
+    return used;
+}
+
+// Expand `~` or `~user` at the start of a word, up to a slash. Returns the bytes used, 0
+// when it is not a tilde prefix or names nobody.
+static size_t expand_tilde(Word_Builder *builder, const char *p)
+{
+    size_t n = 1;
+    while (isalnum((unsigned char)p[n]) || p[n] == '_' || p[n] == '-' || p[n] == '.')
+        n++;
+    if (p[n] != '\0' && p[n] != '/' && !isspace((unsigned char)p[n]))
+        return 0;
+
+    if (n > LOGIN_NAME_MAX)
+        return 0; // Longer than any user name, so nobody's
+    const char *home = n == 1 ? getenv("HOME") : NULL;
+    if (home == NULL)
+    {
+        char user[LOGIN_NAME_MAX];
+        memcpy(user, p + 1, n - 1);
+        user[n - 1] = '\0';
+        struct passwd *pw = n == 1 ? getpwuid(getuid()) : getpwnam(user);
+        if (pw == NULL)
+            return 0;
+        home = pw->pw_dir;
+    }
+    for (; *home; home++)
+        add_char(builder, *home, true);
+    builder->started = true;
+    return n;
+}
+
+// Split one command into words the way sh does: blanks separate words except inside
+// '...' or "...", a backslash takes the next byte as it is, $VAR is replaced (inside
+// double quotes too), a leading ~ becomes a home directory and a word with a bare *, ?
+// or [ is replaced by the paths it matches. There is no limit on the number of words.
+// Prints a message and returns false on a syntax error, with `words` left empty.
+bool expand_words(const char *text, Word_List *words)
+{
+    *words = (Word_List){.argv = xrealloc(NULL, 8 * sizeof(char *)), .size = 8};
+    words->argv[0] = NULL;
+
+    Word_Builder builder = {0};
+
+    bool ok = true;
+    const char *p = text;
+    while (ok && *p)
+    {
+        if (isspace((unsigned char)*p))
+        {
+            finish_word(&builder, words);
+            p++;
+        }
+        else if (*p == '\\')
+        {
+            add_char(&builder, p[1] ? p[1] : '\\', true);
+            p += p[1] ? 2 : 1;
+        }
+        else if (*p == '\'')
+        {
+            const char *close = strchr(p + 1, '\'');
+            if (close == NULL)
+                break;
+            for (p++; p < close; p++)
+                add_char(&builder, *p, true);
+            builder.started = true;
+            p++;
+        }
+        else if (*p == '"')
+        {
+            const char *open = p;
+            builder.started = true;
+            for (p++; *p && *p != '"' && ok;)
+            {
+                if (*p == '\\' && p[1] && strchr("$`\"\\", p[1]))
+                {
+                    add_char(&builder, p[1], true);
+                    p += 2;
+                }
+                else if (*p == '$')
+                {
+                    size_t used = expand_variable(&builder, words, p, true);
+                    ok = used > 0;
+                    p += used;
+                }
+                else
+                    add_char(&builder, *p++, true);
+            }
+            if (ok && *p == '\0')
+            {
+                p = open;
+                break;
+            }
+            p++;
+        }
+        else if (*p == '$')
+        {
+            size_t used = expand_variable(&builder, words, p, false);
+            ok = used > 0;
+            p += used;
+        }
+        else if (*p == '~' && !builder.started)
+        {
+            size_t used = expand_tilde(&builder, p);
+            if (used == 0)
+                add_char(&builder, *p, false);
+            p += used ? used : 1;
+        }
+        else
+        {
+            // Plain bytes go in as a run, a pasted megabyte is mostly these
+            size_t n = strcspn(p, PLAIN_STOP);
+            if (n == 0)
+                add_char(&builder, *p++, false);
+            else
+            {
+                put_bytes(&builder.text, p, n);
+                put_bytes(&builder.pattern, p, n);
+                builder.started = true;
+                p += n;
+            }
+        }
+    }
+
+    if (ok && *p)
+    {
+        print_error("Syntax error: missing closing `%c`.", *p);
+        ok = false;
+    }
+    if (ok)
+        finish_word(&builder, words);
+    free(builder.text.data);
+    free(builder.pattern.data);
+    if (!ok)
+    {
+        free_words(words);
+        last_status = 2;
+    }
+    return ok;
+}
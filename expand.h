@@ -0,0 +1,25 @@
+#ifndef EXPAND_H
+#define EXPAND_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define GLOB_PATH_MAX 4096 // Longest path a glob builds, longer matches are left out
+
+// The words of one command after expansion, ready to be an argv
+typedef struct
+{
+    char **argv;  // NULL terminated
+    size_t count;
+    size_t size;  // Slots allocated, counting the NULL
+} Word_List;
+
+// Function prototypes
+char *skip_quoted(const char *p);
+char *find_unquoted(const char *text, const char *set);
+bool expand_words(const char *text, Word_List *words);
+char *join_words(const Word_List *words, size_t first);
+void shift_words(Word_List *words);
+void free_words(Word_List *words);
+
+#endif // EXPAND_H
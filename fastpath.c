@@ -0,0 +1,660 @@
+#define _GNU_SOURCE // getdents64, strcoll_l, copy_file_range
+
+#include <dirent.h>
+#include <locale.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include "commands.h"
+#include "fastpath.h"
+#include "jobs.h"
+#include "output.h"
+#include "substring.h"
+
+// In-process versions of cat, ls and grep for the cases that come up at the prompt. Each
+// returns false without printing anything when it meets something it does not handle,
+// and the command then runs the real executable instead.
+
+static locale_t collate_locale; // $LC_COLLATE/$LANG order, the shell itself stays in "C"
+
+static void *xrealloc(void *p, size_t size)
+{
+    p = realloc(p, size);
+    if (p == NULL)
+    {
+        perror("Error allocating output");
+        endwin();
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+static void append_bytes(Line_Buffer *out, const char *data, size_t len)
+{
+    if (out->length + len > out->size)
+    {
+        out->size = out->size ? out->size * 2 : 4096;
+        if (out->size < out->length + len)
+            out->size = out->length + len;
+        out->data = xrealloc(out->data, out->size);
+    }
+    memcpy(out->data + out->length, data, len);
+    out->length += len;
+}
+
+static bool write_all(int fd, const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+// Show `out` once it holds a chunk worth painting, or everything when `flush` is set.
+// Output going to a file or stdout is written as it is, without splitting lines.
+static void show_buffered(Line_Buffer *out, bool flush)
+{
+    if (output->fd != -1 && (flush || out->length >= FAST_PATH_CHUNK))
+    {
+        output->flush();
+        write_all(output->fd, out->data, out->length);
+        out->length = 0;
+    }
+    else if (flush || out->length >= FAST_PATH_CHUNK)
+        show_captured_output(out, flush);
+}
+
+// Copy `len` bytes of a file to `out` inside the kernel: copy_file_range between files
+// (which can share extents on filesystems that support it), sendfile to anything else,
+// and plain writes from a mapping when neither applies
+static bool copy_to_fd(int in, int out, size_t len)
+{
+    bool ranges = true, send = true;
+    while (len > 0)
+    {
+        ssize_t n = -1;
+        if (ranges && (n = copy_file_range(in, NULL, out, NULL, len, 0)) < 0)
+            ranges = false; // EXDEV, EBADF for O_APPEND, EINVAL for pipes and ttys
+        if (!ranges && send && (n = sendfile(out, in, NULL, len)) < 0)
+            send = false;
+        if (!ranges && !send)
+            break;
+        if (n == 0)
+            return true; // The file shrank under us
+        if (n > 0)
+            len -= n;
+    }
+    if (len == 0)
+        return true;
+
+    off_t done = lseek(in, 0, SEEK_CUR);
+    void *map = mmap(NULL, done + len, PROT_READ, MAP_PRIVATE, in, 0);
+    if (map == MAP_FAILED)
+        return false;
+    bool ok = write_all(out, (char *)map + done, len);
+    munmap(map, done + len);
+    return ok;
+}
+
+// Show text straight from a mapping, a chunk of whole lines at a time
+static void show_text(const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        size_t n = len;
+        if (n > FAST_PATH_CHUNK)
+        {
+            const char *nl = memrchr(data, '\n', FAST_PATH_CHUNK);
+            n = nl ? (size_t)(nl - data) + 1 : FAST_PATH_CHUNK;
+        }
+        Line_Buffer chunk = {.data = (char *)data, .length = n};
+        show_captured_output(&chunk, false);
+        data += n;
+        len -= n;
+    }
+}
+
+// Map a whole regular file read-only. Empty files give a NULL mapping of length 0.
+static bool map_file(const char *path, const char **data, size_t *len)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1)
+    {
+        if (fd != -1)
+            close(fd);
+        return false;
+    }
+
+    *len = st.st_size;
+    *data = NULL;
+    if (*len > 0)
+    {
+        void *map = mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED)
+        {
+            close(fd);
+            return false;
+        }
+        madvise(map, *len, MADV_SEQUENTIAL);
+        *data = map;
+    }
+    close(fd);
+    return true;
+}
+
+static bool is_regular_file(const char *path)
+{
+    struct stat st;
+    return stat(path, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+// cat file...
+bool fast_cat(const Word_List *list)
+{
+    if (list->count > FAST_PATH_MAX_ARGS)
+        return false;
+    char **words = list->argv + 1;
+    int count = list->count - 1;
+
+    // Options, stdin, pipes and devices are all left to the real cat
+    if (count == 0)
+        return false;
+    for (int i = 0; i < count; i++)
+        if (words[i][0] == '-' || !is_regular_file(words[i]))
+            return false;
+
+    for (int i = 0; i < count; i++)
+    {
+        // Redirected or headless, the bytes never need to come into the shell
+        if (output->fd != -1)
+        {
+            int fd = open(words[i], O_RDONLY | O_CLOEXEC);
+            struct stat st;
+            output->flush();
+            if (fd == -1 || fstat(fd, &st) == -1 || !copy_to_fd(fd, output->fd, st.st_size))
+            {
+                print_error("cat: %s: %s", words[i], strerror(errno));
+                last_status = 1;
+            }
+            if (fd != -1)
+                close(fd);
+            continue;
+        }
+
+        const char *data;
+        size_t len;
+        if (!map_file(words[i], &data, &len))
+        {
+            print_error("cat: %s: %s", words[i], strerror(errno));
+            last_status = 1;
+            continue;
+        }
+        show_text(data, len);
+        if (data)
+            munmap((void *)data, len);
+    }
+    Line_Buffer none = {0};
+    show_captured_output(&none, true);
+    return true;
+}
+
+static void add_ls_entry(Ls_Group *group, const char *name, unsigned long ino, unsigned char type)
+{
+    size_t len = strlen(name);
+    if (group->pool_used + len + 1 > group->pool_size)
+    {
+        group->pool_size = group->pool_size ? group->pool_size * 2 : 4096;
+        if (group->pool_size < group->pool_used + len + 1)
+            group->pool_size = group->pool_used + len + 1;
+        group->pool = xrealloc(group->pool, group->pool_size);
+    }
+    if (group->count == group->size)
+    {
+        group->size = group->size ? group->size * 2 : 64;
+        group->entries = xrealloc(group->entries, group->size * sizeof(Ls_Entry));
+    }
+
+    memcpy(group->pool + group->pool_used, name, len + 1);
+    group->entries[group->count++] = (Ls_Entry){.name = group->pool_used, .ino = ino, .type = type};
+    group->pool_used += len + 1;
+}
+
+static void free_ls_group(Ls_Group *group)
+{
+    free(group->entries);
+    free(group->pool);
+}
+
+// GNU ls quotes names like these on a terminal, leave them to it
+static bool needs_quoting(const char *name)
+{
+    for (const unsigned char *c = (const unsigned char *)name; *c; c++)
+        if (*c < 0x20 || *c == 0x7f || strchr(" !\"#$&'()*;<=>?[\\]^`{|}~", *c))
+            return true;
+    return false;
+}
+
+// Columns taken by a UTF-8 name, counting every character as one
+static size_t name_width(const char *name)
+{
+    size_t width = 0;
+    for (const unsigned char *c = (const unsigned char *)name; *c; c++)
+        if ((*c & 0xc0) != 0x80)
+            width++;
+    return width;
+}
+
+static const char *sort_pool; // Pool of the group being sorted
+
+static int compare_names(const void *a, const void *b)
+{
+    return strcoll_l(sort_pool + ((const Ls_Entry *)a)->name, sort_pool + ((const Ls_Entry *)b)->name, collate_locale);
+}
+
+static int compare_inodes(const void *a, const void *b)
+{
+    unsigned long x = (*(Ls_Entry *const *)a)->ino, y = (*(Ls_Entry *const *)b)->ino;
+    return (x > y) - (x < y);
+}
+
+// Read every name in a directory, `all` keeps dot files and `almost_all` keeps them but
+// not . and ..
+static bool read_ls_dir(int dfd, Ls_Group *group, bool all, bool almost_all)
+{
+    char buffer[LS_SLICE_BYTES] __attribute__((aligned(8)));
+    ssize_t n;
+    while ((n = getdents64(dfd, buffer, sizeof(buffer))) > 0)
+    {
+        for (ssize_t off = 0; off < n;)
+        {
+            struct dirent64 *d = (struct dirent64 *)(buffer + off);
+            off += d->d_reclen;
+            bool dots = strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0;
+            if (d->d_name[0] == '.' && !all && !(almost_all && !dots))
+                continue;
+            add_ls_entry(group, d->d_name, d->d_ino, d->d_type);
+        }
+    }
+    return n == 0;
+}
+
+// Work out the -F suffix of every entry. Only regular files (for the executable bit) and
+// entries the directory gave no type for need a stat, and those are done together in
+// inode order so the inode table is walked front to back.
+static void classify_entries(int dfd, Ls_Group *group)
+{
+    Ls_Entry **pending = xrealloc(NULL, (group->count + 1) * sizeof(Ls_Entry *));
+    size_t count = 0;
+    for (size_t i = 0; i < group->count; i++)
+        if (group->entries[i].type == DT_REG || group->entries[i].type == DT_UNKNOWN)
+            pending[count++] = &group->entries[i];
+    qsort(pending, count, sizeof(Ls_Entry *), compare_inodes);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        struct stat st;
+        if (fstatat(dfd, group->pool + pending[i]->name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+            continue;
+        pending[i]->type = IFTODT(st.st_mode);
+        if (S_ISREG(st.st_mode) && (st.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH)))
+            pending[i]->indicator = '*';
+    }
+    free(pending);
+
+    for (size_t i = 0; i < group->count; i++)
+    {
+        switch (group->entries[i].type)
+        {
+        case DT_DIR: group->entries[i].indicator = '/'; break;
+        case DT_LNK: group->entries[i].indicator = '@'; break;
+        case DT_FIFO: group->entries[i].indicator = '|'; break;
+        case DT_SOCK: group->entries[i].indicator = '='; break;
+        }
+    }
+}
+
+// Lay the names out in columns down then across, as many as fit in `width`, the way GNU
+// ls does on a terminal. Column widths are each column's longest name plus the gap.
+static void show_ls_columns(const Ls_Group *group, size_t width, Line_Buffer *out)
+{
+    size_t count = group->count;
+    size_t cols = 1;
+    for (size_t try = count < width / (1 + LS_COLUMN_GAP) ? count : width / (1 + LS_COLUMN_GAP); try > 1; try--)
+    {
+        size_t rows = (count + try - 1) / try;
+        if ((count + rows - 1) / rows < try)
+            continue; // Same rows as a narrower layout, GNU ls never leaves a column empty
+        size_t total = 0;
+        for (size_t c = 0; c < try && total < width; c++)
+        {
+            size_t widest = 0;
+            for (size_t r = 0; r < rows && c * rows + r < count; r++)
+                if (group->entries[c * rows + r].width > widest)
+                    widest = group->entries[c * rows + r].width;
+            total += widest + (c + 1 < try ? LS_COLUMN_GAP : 0);
+        }
+        if (total < width)
+        {
+            cols = try;
+            break;
+        }
+    }
+
+    size_t rows = (count + cols - 1) / cols;
+    size_t widths[cols];
+    for (size_t c = 0; c < cols; c++)
+    {
+        widths[c] = 0;
+        for (size_t r = 0; r < rows && c * rows + r < count; r++)
+            if (group->entries[c * rows + r].width > widths[c])
+                widths[c] = group->entries[c * rows + r].width;
+    }
+
+    for (size_t r = 0; r < rows; r++)
+    {
+        size_t pos = 0;
+        for (size_t c = 0; c < cols && c * rows + r < count; c++)
+        {
+            const Ls_Entry *e = &group->entries[c * rows + r];
+            append_bytes(out, group->pool + e->name, strlen(group->pool + e->name));
+            if (e->indicator)
+                append_bytes(out, &e->indicator, 1);
+            if (c + 1 < cols && (c + 1) * rows + r < count)
+            {
+                // Pad with tabs where they reach the next column, like GNU ls
+                size_t from = pos + e->width;
+                pos += widths[c] + LS_COLUMN_GAP;
+                while (from < pos)
+                {
+                    bool tab = pos / LS_TAB_SIZE > (from + 1) / LS_TAB_SIZE;
+                    append_bytes(out, tab ? "\t" : " ", 1);
+                    from = tab ? from + LS_TAB_SIZE - from % LS_TAB_SIZE : from + 1;
+                }
+            }
+        }
+        append_bytes(out, "\n", 1);
+        show_buffered(out, false);
+    }
+}
+
+// ls [-a] [-A] [-F] [-1] [path...]
+bool fast_ls(const Word_List *list)
+{
+    if (list->count > FAST_PATH_MAX_ARGS)
+        return false;
+    char **words = list->argv + 1;
+    int count = list->count - 1;
+
+    bool all = false, almost_all = false, classify = false, one_per_line = !output->interactive;
+    int first = 0;
+    for (; first < count && words[first][0] == '-' && words[first][1]; first++)
+    {
+        for (const char *f = words[first] + 1; *f; f++)
+        {
+            if (*f == 'a')
+                all = true;
+            else if (*f == 'A')
+                almost_all = true;
+            else if (*f == 'F')
+                classify = true;
+            else if (*f == '1')
+                one_per_line = true;
+            else
+                return false;
+        }
+    }
+    if (collate_locale == 0)
+        collate_locale = newlocale(LC_COLLATE_MASK, "", 0);
+    if (collate_locale == 0)
+        collate_locale = newlocale(LC_COLLATE_MASK, "C", 0);
+
+    // Files named on the command line come first, then each directory under its name
+    char *dot[] = {"."};
+    char **paths = first < count ? words + first : dot;
+    int path_count = first < count ? count - first : 1;
+    Ls_Group files = {0};
+    Ls_Group dirs[path_count];
+    int dir_count = 0;
+    bool handled = true;
+    for (int i = 0; i < path_count && handled; i++)
+    {
+        struct stat st;
+        if (lstat(paths[i], &st) == -1 || (S_ISLNK(st.st_mode) && (classify || stat(paths[i], &st) == -1)))
+            handled = false; // Errors and -F on a symlink are the real ls's business
+        else if (!S_ISDIR(st.st_mode))
+            add_ls_entry(&files, paths[i], st.st_ino, IFTODT(st.st_mode));
+        else
+        {
+            dirs[dir_count] = (Ls_Group){.title = paths[i]};
+            int dfd = open(paths[i], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            handled = dfd != -1 && read_ls_dir(dfd, &dirs[dir_count], all, almost_all);
+            if (handled && classify)
+                classify_entries(dfd, &dirs[dir_count]);
+            if (dfd != -1)
+                close(dfd);
+            dir_count++;
+        }
+    }
+    if (handled && classify)
+        classify_entries(AT_FDCWD, &files);
+
+    Ls_Group *groups[dir_count + 1];
+    int group_count = 0;
+    if (files.count)
+        groups[group_count++] = &files;
+    for (int d = 0; d < dir_count; d++)
+        groups[group_count++] = &dirs[d];
+    for (int g = 0; g < group_count && handled; g++)
+    {
+        for (size_t e = 0; e < groups[g]->count; e++)
+        {
+            Ls_Entry *entry = &groups[g]->entries[e];
+            if (output->interactive && needs_quoting(groups[g]->pool + entry->name))
+                handled = false;
+            entry->width = name_width(groups[g]->pool + entry->name) + (entry->indicator != '\0');
+        }
+        sort_pool = groups[g]->pool;
+        qsort(groups[g]->entries, groups[g]->count, sizeof(Ls_Entry), compare_names);
+    }
+
+    if (handled)
+    {
+        // Directories are listed in name order too
+        for (int a = files.count ? 1 : 0; a < group_count; a++)
+            for (int b = a + 1; b < group_count; b++)
+                if (strcoll_l(groups[b]->title, groups[a]->title, collate_locale) < 0)
+                {
+                    Ls_Group *t = groups[a];
+                    groups[a] = groups[b];
+                    groups[b] = t;
+                }
+
+        Line_Buffer out = {0};
+        size_t width = getmaxx(output_win);
+        for (int g = 0; g < group_count; g++)
+        {
+            if (g > 0)
+                append_bytes(&out, "\n", 1);
+            if (groups[g]->title && path_count > 1)
+            {
+                append_bytes(&out, groups[g]->title, strlen(groups[g]->title));
+                append_bytes(&out, ":\n", 2);
+            }
+            if (one_per_line)
+                show_ls_columns(groups[g], 0, &out);
+            else
+                show_ls_columns(groups[g], width, &out);
+        }
+        show_buffered(&out, true);
+        free(out.data);
+    }
+
+    free_ls_group(&files);
+    for (int d = 0; d < dir_count; d++)
+        free_ls_group(&dirs[d]);
+    return handled;
+}
+
+// Append one selected line, with the file name and line number in front when asked for
+static void add_grep_line(Line_Buffer *out, const char *file, long number, const char *line, size_t len)
+{
+    char prefix[64];
+    if (file)
+    {
+        append_bytes(out, file, strlen(file));
+        append_bytes(out, ":", 1);
+    }
+    if (number > 0)
+        append_bytes(out, prefix, snprintf(prefix, sizeof(prefix), "%ld:", number));
+    append_bytes(out, line, len);
+    append_bytes(out, "\n", 1);
+    show_buffered(out, false);
+}
+
+static long count_lines(const char *start, const char *end)
+{
+    long lines = 0;
+    for (const char *nl; start < end && (nl = memchr(start, '\n', end - start)); start = nl + 1)
+        lines++;
+    return lines;
+}
+
+// Select the lines of one file holding (or with `invert`, not holding) the pattern. The
+// whole file is searched in one pass, lines are only split out around the matches.
+static long grep_file(const char *data, size_t len, const char *pattern, const char *file, bool numbers,
+                      bool invert, bool count_only, Line_Buffer *out)
+{
+    size_t pattern_len = strlen(pattern);
+    const char *p = data;
+    const char *end = data + len;
+    long number = 1;
+    long selected = 0;
+    while (p < end)
+    {
+        const char *hit = find_substring(p, end - p, pattern, pattern_len);
+        const char *stop = end; // Lines from p up to here do not match
+        if (hit)
+        {
+            const char *nl = memrchr(p, '\n', hit - p);
+            stop = nl ? nl + 1 : p;
+        }
+
+        if (invert)
+        {
+            while (p < stop)
+            {
+                const char *nl = memchr(p, '\n', stop - p);
+                const char *line_end = nl ? nl : stop;
+                if (!count_only)
+                    add_grep_line(out, file, numbers ? number : 0, p, line_end - p);
+                selected++;
+                number++;
+                p = line_end + 1;
+            }
+        }
+        else if (numbers)
+            number += count_lines(p, stop);
+        if (hit == NULL)
+            break;
+
+        const char *nl = memchr(stop, '\n', end - stop);
+        const char *line_end = nl ? nl : end;
+        if (!invert)
+        {
+            if (!count_only)
+                add_grep_line(out, file, numbers ? number : 0, stop, line_end - stop);
+            selected++;
+        }
+        number++;
+        p = line_end + 1;
+    }
+    return selected;
+}
+
+// grep [-n] [-c] [-v] [-F] pattern file...
+bool fast_grep(const Word_List *list)
+{
+    if (list->count > FAST_PATH_MAX_ARGS)
+        return false;
+    char **words = list->argv + 1;
+    int count = list->count - 1;
+
+    bool numbers = false, invert = false, count_only = false, fixed = false;
+    int first = 0;
+    for (; first < count && words[first][0] == '-' && words[first][1]; first++)
+    {
+        for (const char *f = words[first] + 1; *f; f++)
+        {
+            if (*f == 'n')
+                numbers = true;
+            else if (*f == 'v')
+                invert = true;
+            else if (*f == 'c')
+                count_only = true;
+            else if (*f == 'F')
+                fixed = true;
+            else
+                return false;
+        }
+    }
+
+    // Only plain, non-empty strings searched for in regular files, without NULs up front
+    if (count - first < 2 || !words[first][0] || (!fixed && strpbrk(words[first], ".[]*^$\\")))
+        return false;
+    const char *pattern = words[first];
+    char **files = words + first + 1;
+    int file_count = count - first - 1;
+    for (int i = 0; i < file_count; i++)
+        if (!is_regular_file(files[i]))
+            return false;
+
+    const char *data[file_count];
+    size_t len[file_count];
+    bool handled = true;
+    for (int i = 0; i < file_count; i++)
+    {
+        if (handled && map_file(files[i], &data[i], &len[i]))
+            handled = memchr(data[i], '\0', len[i] < BINARY_PROBE_BYTES ? len[i] : BINARY_PROBE_BYTES) == NULL;
+        else
+        {
+            data[i] = NULL;
+            len[i] = 0;
+            handled = false;
+        }
+    }
+
+    if (handled)
+    {
+        Line_Buffer out = {0};
+        long selected = 0;
+        for (int i = 0; i < file_count; i++)
+        {
+            const char *name = file_count > 1 ? files[i] : NULL;
+            long n = grep_file(data[i], len[i], pattern, name, numbers, invert, count_only, &out);
+            if (count_only)
+            {
+                char line[LINE_LENGTH];
+                int line_len = name ? snprintf(line, sizeof(line), "%s:%ld", name, n) : snprintf(line, sizeof(line), "%ld", n);
+                add_grep_line(&out, NULL, 0, line, line_len < (int)sizeof(line) ? line_len : (int)sizeof(line) - 1);
+            }
+            selected += n;
+        }
+        show_buffered(&out, true);
+        free(out.data);
+        last_status = selected > 0 ? 0 : 1;
+    }
+
+    for (int i = 0; i < file_count; i++)
+        if (data[i])
+            munmap((void *)data[i], len[i]);
+    return handled;
+}
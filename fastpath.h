@@ -0,0 +1,42 @@
+#ifndef FASTPATH_H
+#define FASTPATH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "expand.h"
+
+#define FAST_PATH_CHUNK (1024 * 1024)   // Bytes of output handed to the screen at a time
+#define LS_SLICE_BYTES (32 * 1024)      // Directory entries read per getdents64 call
+#define LS_COLUMN_GAP 2                 // Spaces between `ls` columns, as GNU ls uses
+#define LS_TAB_SIZE 8                   // Tab stops GNU ls pads columns to
+#define BINARY_PROBE_BYTES (32 * 1024)  // grep leaves files with a NUL this early to the real grep
+#define FAST_PATH_MAX_ARGS 1024         // Longer argument lists are left to the real program
+
+// One directory entry read by `ls`
+typedef struct
+{
+    size_t name;         // Offset of the name in the group's pool
+    unsigned long ino;
+    unsigned char type;  // d_type, filled in by fstatat when the directory did not say
+    char indicator;      // Suffix shown by -F, '\0' for none
+    size_t width;        // Columns the name takes on screen, with its indicator
+} Ls_Entry;
+
+// The names `ls` shows under one heading, or the files named on the command line
+typedef struct
+{
+    const char *title; // Directory name shown above the names, NULL for none
+    Ls_Entry *entries;
+    size_t count;
+    size_t size;
+    char *pool;        // Text of every name
+    size_t pool_used;
+    size_t pool_size;
+} Ls_Group;
+
+// Function prototypes
+bool fast_cat(const Word_List *list);
+bool fast_ls(const Word_List *list);
+bool fast_grep(const Word_List *list);
+
+#endif // FASTPATH_H
@@ -0,0 +1,388 @@
+#define _GNU_SOURCE // memrchr, memmem
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "history.h"
+
+// Forget the trigram index so it is rebuilt from the start of the file
+static void reset_index(History *history)
+{
+    for (size_t i = 0; i < history->gram_size; i++)
+        free(history->grams[i].data);
+    free(history->grams);
+    free(history->entries);
+    history->grams = NULL;
+    history->gram_count = history->gram_size = 0;
+    history->entries = NULL;
+    history->entry_count = history->entry_size = 0;
+    history->indexed = 0;
+}
+
+// Map whatever the history file holds now, other shells may have appended to it
+static void refresh_history_map(History *history)
+{
+    struct stat st;
+    if (history->fd == -1 || fstat(history->fd, &st) == -1 || (size_t)st.st_size == history->size)
+        return;
+
+    if (history->data)
+        munmap(history->data, history->size);
+    if ((size_t)st.st_size < history->size)
+        reset_index(history); // Truncated behind our back, offsets no longer mean anything
+    history->data = NULL;
+    history->size = 0;
+
+    if (st.st_size > 0)
+    {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, history->fd, 0);
+        if (map != MAP_FAILED)
+        {
+            history->data = map;
+            history->size = st.st_size;
+        }
+    }
+}
+
+// Open and map the history file. Nothing is read up front, so startup does not grow with the file.
+void init_history(History *history)
+{
+    *history = (History){.fd = -1};
+
+    const char *home = getenv("HOME");
+    if (home)
+    {
+        char path[strlen(home) + strlen(HISTORY_FILE) + 2];
+        sprintf(path, "%s/%s", home, HISTORY_FILE);
+        history->fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    }
+    refresh_history_map(history);
+}
+
+void add_to_history(History *history, const char *command)
+{
+    size_t len = strlen(command);
+
+    if (history->fd != -1)
+    {
+        // One locked O_APPEND write per entry, so concurrent shells never interleave. The
+        // pieces are gathered by writev, a command of any length is not copied.
+        flock(history->fd, LOCK_EX);
+        refresh_history_map(history);
+        struct iovec parts[3];
+        int count = 0;
+        if (history->size && history->data[history->size - 1] != '\n')
+            parts[count++] = (struct iovec){"\n", 1}; // A shell that died mid-write left the last entry unterminated
+        parts[count++] = (struct iovec){(void *)command, len};
+        parts[count++] = (struct iovec){"\n", 1};
+        size_t n = len + count - 1;
+        if (writev(history->fd, parts, count) != (ssize_t)n)
+            perror("Error writing history");
+        flock(history->fd, LOCK_UN);
+
+        refresh_history_map(history);
+        return;
+    }
+
+    // Without a history file the entries live in a heap buffer with the same layout
+    if (history->size + len + 1 > history->capacity)
+    {
+        size_t capacity = history->capacity ? history->capacity * 2 : 4096;
+        while (capacity < history->size + len + 1)
+            capacity *= 2;
+        char *data = realloc(history->data, capacity);
+        if (data == NULL)
+            return;
+        history->data = data;
+        history->capacity = capacity;
+    }
+    memcpy(history->data + history->size, command, len);
+    history->size += len;
+    history->data[history->size++] = '\n';
+}
+
+// Get the text of the entry starting at `cursor`, returning its length
+size_t history_entry(const History *history, long cursor, const char **text)
+{
+    *text = history->data + cursor;
+    const char *nl = memchr(*text, '\n', history->size - cursor);
+    return nl ? (size_t)(nl - *text) : history->size - cursor;
+}
+
+// Step back one entry. A cursor of -1 means "below the newest entry".
+bool history_prev(History *history, long *cursor)
+{
+    size_t end = *cursor == -1 ? history->size : (size_t)*cursor;
+    if (end == 0)
+        return *cursor != -1; // Already at the oldest entry, stay there
+
+    if (history->data[end - 1] == '\n')
+        end--;
+    const char *nl = memrchr(history->data, '\n', end);
+    *cursor = nl ? nl - history->data + 1 : 0;
+    return true;
+}
+
+// Step forward one entry, going back to -1 after the newest one
+bool history_next(History *history, long *cursor)
+{
+    if (*cursor == -1)
+        return false;
+
+    const char *nl = memchr(history->data + *cursor, '\n', history->size - *cursor);
+    size_t next = nl ? nl - history->data + 1 : history->size;
+    if (next >= history->size)
+    {
+        *cursor = -1;
+        return false;
+    }
+    *cursor = next;
+    return true;
+}
+
+static uint32_t gram_key(const char *p)
+{
+    const unsigned char *u = (const unsigned char *)p;
+    return (1u << 31) | (u[0] << 16) | (u[1] << 8) | u[2];
+}
+
+static Posting_List *find_gram(const History *history, uint32_t key)
+{
+    if (history->gram_size == 0)
+        return NULL;
+    size_t mask = history->gram_size - 1;
+    for (size_t i = (key * 2654435761u) & mask;; i = (i + 1) & mask)
+    {
+        if (history->grams[i].key == key)
+            return &history->grams[i];
+        if (history->grams[i].key == 0)
+            return NULL;
+    }
+}
+
+static Posting_List *insert_gram(History *history, uint32_t key)
+{
+    if ((history->gram_count + 1) * 2 > history->gram_size)
+    {
+        // Keep the table at most half full
+        size_t size = history->gram_size ? history->gram_size * 2 : MIN_GRAM_BUCKETS;
+        Posting_List *grams = calloc(size, sizeof(Posting_List));
+        if (grams == NULL)
+            return NULL;
+        for (size_t i = 0; i < history->gram_size; i++)
+        {
+            Posting_List *old = &history->grams[i];
+            if (old->key == 0)
+                continue;
+            size_t j = (old->key * 2654435761u) & (size - 1);
+            while (grams[j].key)
+                j = (j + 1) & (size - 1);
+            grams[j] = *old;
+        }
+        free(history->grams);
+        history->grams = grams;
+        history->gram_size = size;
+    }
+
+    size_t mask = history->gram_size - 1;
+    size_t i = (key * 2654435761u) & mask;
+    while (history->grams[i].key && history->grams[i].key != key)
+        i = (i + 1) & mask;
+    if (history->grams[i].key == 0)
+    {
+        history->grams[i].key = key;
+        history->gram_count++;
+    }
+    return &history->grams[i];
+}
+
+static void add_posting(History *history, uint32_t key, uint32_t id)
+{
+    Posting_List *list = insert_gram(history, key);
+    if (list == NULL || (list->count && list->last_id == id))
+        return; // Out of memory, or the trigram repeats within this entry
+
+    if (list->length + 5 > list->size)
+    {
+        uint32_t size = list->size ? list->size * 2 : 8;
+        uint8_t *data = realloc(list->data, size);
+        if (data == NULL)
+            return;
+        list->data = data;
+        list->size = size;
+    }
+
+    // Store the gap from the previous entry as a little-endian base-128 varint
+    uint32_t delta = id - list->last_id;
+    while (delta >= 0x80)
+    {
+        list->data[list->length++] = (delta & 0x7f) | 0x80;
+        delta >>= 7;
+    }
+    list->data[list->length++] = delta;
+    list->last_id = id;
+    list->count++;
+}
+
+// Idle task: index the next slice of whole entries. Returns true while there is more to do.
+bool index_history_slice(void *arg)
+{
+    History *history = arg;
+
+    size_t end = history->indexed + INDEX_SLICE_BYTES;
+    if (end > history->size)
+        end = history->size;
+
+    while (history->indexed < history->size)
+    {
+        const char *start = history->data + history->indexed;
+        const char *nl = memchr(start, '\n', history->size - history->indexed);
+        if (nl == NULL)
+            return false; // A trailing fragment waits for its newline
+
+        if (history->entry_count == history->entry_size)
+        {
+            size_t size = history->entry_size ? history->entry_size * 2 : 1024;
+            size_t *entries = realloc(history->entries, size * sizeof(size_t));
+            if (entries == NULL)
+                return false;
+            history->entries = entries;
+            history->entry_size = size;
+        }
+        uint32_t id = history->entry_count;
+        history->entries[history->entry_count++] = history->indexed;
+
+        for (const char *p = start; p + 3 <= nl; p++)
+            add_posting(history, gram_key(p), id);
+
+        history->indexed = nl - history->data + 1;
+        if (history->indexed >= end)
+            break;
+    }
+    return history->indexed < history->size;
+}
+
+// Newest entry in [lo, hi) containing `query`, scanning back one chunk at a time
+static bool scan_range(const History *history, const char *query, size_t qlen, size_t lo, size_t hi, long *found)
+{
+    while (hi > lo)
+    {
+        size_t chunk_lo = lo;
+        if (hi - lo > SEARCH_CHUNK_BYTES)
+        {
+            // Start the chunk on an entry boundary
+            const char *nl = memrchr(history->data + lo, '\n', hi - SEARCH_CHUNK_BYTES - lo);
+            chunk_lo = nl ? nl - history->data + 1 : lo;
+        }
+
+        const char *base = history->data + chunk_lo;
+        const char *end = history->data + hi;
+        const char *p = base;
+        const char *m;
+        long last = -1;
+        while ((m = memmem(p, end - p, query, qlen)) != NULL)
+        {
+            const char *start = memrchr(base, '\n', m - base);
+            last = (start ? start + 1 : base) - history->data;
+            const char *nl = memchr(m, '\n', end - m);
+            if (nl == NULL)
+                break;
+            p = nl + 1;
+        }
+        if (last != -1)
+        {
+            *found = last;
+            return true;
+        }
+        hi = chunk_lo;
+    }
+    return false;
+}
+
+// Newest indexed entry starting before `hi` that contains `query` (at least 3 bytes)
+static bool search_index(const History *history, const char *query, size_t qlen, size_t hi, long *found)
+{
+    // Every trigram of the query must occur, and the rarest one gives the fewest candidates
+    Posting_List *best = NULL;
+    for (size_t i = 0; i + 3 <= qlen; i++)
+    {
+        Posting_List *list = find_gram(history, gram_key(query + i));
+        if (list == NULL)
+            return false;
+        if (best == NULL || list->count < best->count)
+            best = list;
+    }
+
+    uint32_t *ids = malloc(best->count * sizeof(uint32_t));
+    if (ids == NULL)
+        return false;
+    uint32_t id = 0;
+    size_t n = 0;
+    for (uint32_t i = 0; i < best->length;)
+    {
+        uint32_t delta = 0;
+        for (int shift = 0;; shift += 7)
+        {
+            uint8_t b = best->data[i++];
+            delta |= (uint32_t)(b & 0x7f) << shift;
+            if (!(b & 0x80))
+                break;
+        }
+        id += delta;
+        ids[n++] = id;
+    }
+
+    // Candidates share a trigram with the query, confirm the whole query from the newest down
+    bool hit = false;
+    while (n-- > 0)
+    {
+        size_t start = history->entries[ids[n]];
+        if (start >= hi)
+            continue;
+        size_t end = ids[n] + 1 < history->entry_count ? history->entries[ids[n] + 1] : history->indexed;
+        if (memmem(history->data + start, end - start, query, qlen))
+        {
+            *found = start;
+            hit = true;
+            break;
+        }
+    }
+    free(ids);
+    return hit;
+}
+
+// Find the newest entry starting before `before` (-1 for the end) that contains `query`
+bool search_history(History *history, const char *query, long before, long *found)
+{
+    size_t qlen = strlen(query);
+    if (qlen == 0)
+        return false;
+
+    refresh_history_map(history);
+
+    // Search up to the end of the entry holding the byte just before `before`
+    size_t hi = history->size;
+    if (before >= 0 && (size_t)before < history->size)
+    {
+        const char *nl = before > 0 ? memchr(history->data + before - 1, '\n', history->size - before + 1) : NULL;
+        hi = nl ? nl - history->data + 1 : (size_t)before;
+    }
+
+    // Entries the indexer has not reached yet are scanned directly
+    if (hi > history->indexed)
+    {
+        if (scan_range(history, query, qlen, history->indexed, hi, found))
+            return true;
+        hi = history->indexed;
+    }
+
+    if (qlen < 3)
+        return scan_range(history, query, qlen, 0, hi, found);
+    return search_index(history, query, qlen, hi, found);
+}
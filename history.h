@@ -0,0 +1,52 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define HISTORY_FILE ".my-shell_history"  // Created in $HOME
+#define INDEX_SLICE_BYTES (64 * 1024)     // History indexed per idle pass of the event loop
+#define SEARCH_CHUNK_BYTES (1024 * 1024)  // Unindexed history scanned per step, newest first
+#define MIN_GRAM_BUCKETS 4096             // Starting size of the trigram table
+
+// Entry numbers holding one trigram, delta and varint encoded in ascending order
+typedef struct
+{
+    uint32_t key;     // Trigram packed into 24 bits, with bit 31 set when the slot is used
+    uint32_t count;   // Entries in the list
+    uint32_t last_id; // Newest entry added, the base for the next delta
+    uint32_t length;  // Bytes of `data` in use
+    uint32_t size;    // Bytes allocated for `data`
+    uint8_t *data;
+} Posting_List;
+
+// Command history: an append-only file shared by every shell, mapped read-only.
+// Entries are newline terminated and addressed by the offset where they start.
+typedef struct
+{
+    int fd;          // History file opened for appending, -1 when kept in memory only
+    char *data;      // Mapped file contents, or a heap buffer without a file
+    size_t size;     // Bytes of history visible through `data`
+    size_t capacity; // Bytes allocated when `data` is a heap buffer
+
+    // Trigram index over the first `indexed` bytes, extended in the background
+    size_t indexed;
+    size_t *entries; // Start offset of each indexed entry, by entry number
+    size_t entry_count;
+    size_t entry_size;
+    Posting_List *grams; // Open addressing table keyed by trigram
+    size_t gram_count;
+    size_t gram_size;
+} History;
+
+// Function prototypes
+void init_history(History *history);
+void add_to_history(History *history, const char *command);
+size_t history_entry(const History *history, long cursor, const char **text);
+bool history_prev(History *history, long *cursor);
+bool history_next(History *history, long *cursor);
+bool search_history(History *history, const char *query, long before, long *found);
+bool index_history_slice(void *history);
+
+#endif // HISTORY_H
@@ -0,0 +1,593 @@
+#define _GNU_SOURCE // signalfd
+
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <sys/ioctl.h>
+#include <sys/signalfd.h>
+#include <sys/time.h>
+#include "jobs.h"
+#include "output.h"
+#include "pty.h"
+#include "stats.h"
+
+int last_status = 0;
+
+static Job *jobs = NULL;       // Oldest job first
+static int signal_fd = -1;     // Delivers SIGCHLD and SIGWINCH to the event loop
+static pid_t shell_pgid;       // Process group that owns the terminal at the prompt
+static size_t unpainted = 0;   // Lines added to scrollback but not painted yet
+static long long next_frame = 0;
+static bool at_prompt = false; // Paint above the prompt instead of below the last output
+static bool resized = false;   // SIGWINCH arrived, the screen is redrawn after the events
+
+// Slices of background work, run whenever a poll finds nothing ready
+static struct
+{
+    Idle_Fn fn;
+    void *arg;
+} idle_tasks[MAX_IDLE_TASKS];
+static int idle_task_count = 0;
+static bool idle_pending = false; // Some task may have work, so don't block in poll
+
+// Descriptors of other modules, handled as soon as they are readable
+static struct
+{
+    int fd;
+    Watch_Fn fn;
+    void *arg;
+} watches[MAX_WATCHES];
+static int watch_count = 0;
+
+static void *xmalloc(size_t size)
+{
+    void *p = malloc(size);
+    if (p == NULL)
+    {
+        perror("Error allocating a job");
+        endwin();
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+// Monotonic clock reading in nanoseconds
+static long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void append_partial(Line_Buffer *partial, const char *data, size_t n)
+{
+    if (partial->length + n > partial->size)
+    {
+        size_t size = partial->size ? partial->size * 2 : LINE_LENGTH;
+        while (size < partial->length + n)
+            size *= 2;
+        char *grown = realloc(partial->data, size);
+        if (grown == NULL)
+            return; // Drop the fragment rather than abort mid-stream
+        partial->data = grown;
+        partial->size = size;
+    }
+    memcpy(partial->data + partial->length, data, n);
+    partial->length += n;
+}
+
+// Copy output into a job's record until it grows past the limit, then give up on it
+static void record_output(Output_Record *record, const char *data, size_t n)
+{
+    if (record->complete && record->output.length + n > record->limit)
+    {
+        free(record->output.data);
+        record->output = (Line_Buffer){0};
+        record->complete = false;
+    }
+    size_t before = record->output.length;
+    if (record->complete)
+        append_partial(&record->output, data, n);
+    if (record->output.length != before + n)
+        record->complete = false; // Out of memory, a fragment was dropped
+}
+
+// Child output goes to scrollback with the colors the parser found in it
+static void add_output_line(const char *text, size_t len, const Attr_Run *runs, size_t run_count, void *arg)
+{
+    add_to_scroll_history_runs(&scroll_his, text, len, runs, run_count);
+}
+
+// Add a formatted status line to scrollback, painted with the next frame
+static void job_line(const char *format, ...)
+{
+    char buff[LINE_LENGTH];
+    va_list ap;
+    va_start(ap, format);
+    vsnprintf(buff, sizeof(buff), format, ap);
+    va_end(ap);
+    if (!output->interactive)
+    {
+        output->write_line(buff, strlen(buff));
+        return;
+    }
+    add_to_scroll_history(&scroll_his, buff);
+    unpainted++;
+}
+
+// Show lines added since the last frame, unless a frame was painted too recently
+static void paint_output(bool force)
+{
+    if (!unpainted || (!force && now_ns() < next_frame))
+        return;
+    if (at_prompt)
+        show_lines_above_prompt(unpainted);
+    else
+    {
+        show_new_lines(unpainted);
+        wrefresh(output_win);
+    }
+    unpainted = 0;
+    next_frame = now_ns() + FRAME_INTERVAL_NS;
+}
+
+static void close_job_output(Job *job)
+{
+    // Output that did not end with a newline still counts as a line
+    if (ansi_finish(&job->parser))
+        unpainted++;
+    close(job->out_fd);
+    job->out_fd = -1;
+}
+
+// Read up to `chunks` blocks' worth of output from a job, closing its pipe at EOF. A pty
+// hands over at most a few KB per read, so the budget is counted in bytes, not reads.
+static void drain_job(Job *job, int chunks)
+{
+    char buffer[READ_CHUNK];
+    size_t budget = (size_t)chunks * READ_CHUNK;
+    while (budget > 0)
+    {
+        ssize_t n = read(job->out_fd, buffer, sizeof(buffer));
+        if (n > 0 && job->capture)
+        {
+            append_partial(job->capture, buffer, n);
+            budget -= (size_t)n < budget ? (size_t)n : budget;
+        }
+        else if (n > 0)
+        {
+            if (job->record)
+                record_output(job->record, buffer, n);
+            unpainted += ansi_feed(&job->parser, buffer, n);
+            budget -= (size_t)n < budget ? (size_t)n : budget;
+        }
+        else if (n < 0 && errno == EINTR)
+            continue;
+        else if (n < 0 && errno == EAGAIN)
+            return;
+        else
+        {
+            close_job_output(job); // EOF on a pipe, EIO on a pty once every writer is gone
+            return;
+        }
+    }
+}
+
+void remove_job(Job *job)
+{
+    for (Job **link = &jobs; *link; link = &(*link)->next)
+        if (*link == job)
+        {
+            *link = job->next;
+            break;
+        }
+    if (job->out_fd != -1)
+        close(job->out_fd);
+    free_ansi_parser(&job->parser);
+    free(job->pids);
+    free(job->command);
+    free(job);
+}
+
+// Every stage has exited: pick up what they left in the pipe and mark the job done
+static void finish_job(Job *job)
+{
+    // Anything written before exit is already buffered, so this cannot take long. The pipe
+    // is closed afterwards even if a leftover grandchild still holds the write end.
+    if (job->out_fd != -1)
+    {
+        drain_job(job, PIPE_BUFFER_SIZE / READ_CHUNK + 1);
+        if (job->out_fd != -1)
+            close_job_output(job);
+    }
+    job->state = JOB_DONE;
+    record_command(job->command, job->started, monotonic_ns(), &job->usage);
+}
+
+// Add one stage's resource use to its job's total
+static void add_usage(struct rusage *total, const struct rusage *stage)
+{
+    timeradd(&total->ru_utime, &stage->ru_utime, &total->ru_utime);
+    timeradd(&total->ru_stime, &stage->ru_stime, &total->ru_stime);
+    if (stage->ru_maxrss > total->ru_maxrss)
+        total->ru_maxrss = stage->ru_maxrss;
+    total->ru_nvcsw += stage->ru_nvcsw;
+    total->ru_nivcsw += stage->ru_nivcsw;
+}
+
+// Collect every child status change reported since the last SIGCHLD
+static void reap_children(void)
+{
+    struct signalfd_siginfo info;
+    while (read(signal_fd, &info, sizeof(info)) > 0)
+        if (info.ssi_signo == SIGWINCH)
+            resized = true; // Otherwise only a wakeup, waitpid has the details
+
+    int status;
+    pid_t pid;
+    struct rusage usage;
+    // Only the shell's own children, helper threads reap the ones they start
+    while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED | __WNOTHREAD, &usage)) > 0)
+    {
+        for (Job *job = jobs; job; job = job->next)
+            for (int i = 0; i < job->pid_count; i++)
+            {
+                if (job->pids[i] != pid)
+                    continue;
+                if (WIFSTOPPED(status))
+                    job->state = JOB_STOPPED;
+                else if (WIFCONTINUED(status))
+                    job->state = JOB_RUNNING;
+                else
+                {
+                    if (i == job->pid_count - 1) // A pipeline's status is its last stage's
+                        job->status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+                    add_usage(&job->usage, &usage);
+                    job->pids[i] = 0;
+                    if (--job->live == 0)
+                        finish_job(job);
+                }
+            }
+    }
+}
+
+// Announce background jobs that finished or stopped, and forget the finished ones
+static void report_background_jobs(void)
+{
+    Job *job = jobs;
+    while (job)
+    {
+        Job *next = job->next;
+        if (job->background && job->state == JOB_DONE)
+        {
+            job_line("[%d]+  Done                    %s", job->id, job->command);
+            remove_job(job);
+        }
+        else if (job->background && job->state != job->reported)
+        {
+            if (job->state == JOB_STOPPED)
+                job_line("[%d]+  Stopped                 %s", job->id, job->command);
+            job->reported = job->state;
+        }
+        job = next;
+    }
+}
+
+// Whether the terminal is no longer the size curses thinks it is
+static bool terminal_resized(void)
+{
+    struct winsize size;
+    return ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && (size.ws_row != LINES || size.ws_col != COLS);
+}
+
+// Wait for the next event and handle it: child output, child status changes, or a
+// keypress when `want_keys` is set. Returns true when there is keyboard input to read.
+static bool poll_events(bool want_keys)
+{
+    int count = 1 + want_keys + watch_count;
+    for (Job *job = jobs; job; job = job->next)
+        if (job->out_fd >= 0)
+            count++;
+
+    struct pollfd fds[count];
+    Job *owners[count];
+    int n = 0;
+    fds[n++] = (struct pollfd){.fd = signal_fd, .events = POLLIN};
+    if (want_keys)
+        fds[n++] = (struct pollfd){.fd = STDIN_FILENO, .events = POLLIN};
+    for (int i = 0; i < watch_count; i++)
+        fds[n++] = (struct pollfd){.fd = watches[i].fd, .events = POLLIN};
+    int first_job = n;
+    for (Job *job = jobs; job; job = job->next)
+        if (job->out_fd >= 0)
+        {
+            owners[n] = job;
+            fds[n++] = (struct pollfd){.fd = job->out_fd, .events = POLLIN};
+        }
+
+    int timeout = -1;
+    if (unpainted)
+    {
+        long long wait = next_frame - now_ns();
+        timeout = wait > 0 ? (int)((wait + 999999) / 1000000) : 0;
+    }
+
+    if (idle_pending)
+        timeout = 0;
+
+    // A foreground job owns the terminal, so SIGWINCH goes to it and not to the shell
+    bool check_size = !want_keys && output->interactive;
+    if (check_size && (timeout < 0 || timeout > RESIZE_CHECK_MS))
+        timeout = RESIZE_CHECK_MS;
+
+    int ready = poll(fds, n, timeout);
+    if (ready < 0)
+        return false; // EINTR, go around again
+    if (ready == 0 && idle_pending)
+    {
+        idle_pending = false;
+        for (int i = 0; i < idle_task_count; i++)
+            if (idle_tasks[i].fn(idle_tasks[i].arg))
+                idle_pending = true;
+    }
+    else if (ready > 0)
+        idle_pending = idle_task_count > 0; // Whatever happened may have made new work
+
+    if (fds[0].revents)
+        reap_children();
+    for (int i = 0; i < watch_count; i++)
+        if (fds[1 + want_keys + i].revents)
+            watches[i].fn(watches[i].arg);
+
+    // Jobs share the loop fairly, a flooding job only gets a few reads per pass
+    for (int i = first_job; i < n; i++)
+        if (fds[i].revents && owners[i]->out_fd == fds[i].fd)
+            drain_job(owners[i], DRAIN_CHUNKS);
+
+    report_background_jobs();
+    paint_output(false);
+    if (check_size && terminal_resized())
+        resized = true;
+    if (resized && output->interactive)
+    {
+        // Output still to paint goes in first, so the redraw includes it
+        paint_output(true);
+        resize_window(at_prompt);
+    }
+    resized = false;
+    return want_keys && fds[1].revents;
+}
+
+void init_jobs(void)
+{
+    shell_pgid = getpgrp();
+
+    // The shell takes the terminal back from finished jobs while it is not the foreground group
+    signal(SIGTTOU, SIG_IGN);
+
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigaddset(&set, SIGWINCH); // Taken from ncurses too, so a resize is seen while a job runs
+    sigprocmask(SIG_BLOCK, &set, NULL);
+    signal_fd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd == -1)
+    {
+        perror("Error creating signalfd");
+        endwin();
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Register background work to be done a slice at a time while the shell is idle
+void add_idle_task(Idle_Fn fn, void *arg)
+{
+    if (idle_task_count == MAX_IDLE_TASKS)
+        return;
+    idle_tasks[idle_task_count].fn = fn;
+    idle_tasks[idle_task_count].arg = arg;
+    idle_task_count++;
+    idle_pending = true;
+}
+
+// Have the event loop call `fn` whenever `fd` is readable, whatever else it is waiting for
+void add_watch(int fd, Watch_Fn fn, void *arg)
+{
+    if (watch_count == MAX_WATCHES)
+        return;
+    watches[watch_count].fd = fd;
+    watches[watch_count].fn = fn;
+    watches[watch_count].arg = arg;
+    watch_count++;
+}
+
+// Make `pgid` the terminal's foreground process group, if the shell is running one
+void give_terminal(pid_t pgid)
+{
+    if (output->interactive && isatty(STDIN_FILENO))
+        tcsetpgrp(STDIN_FILENO, pgid);
+}
+
+// Pass a new output window size on to every job drawing into a pty
+void resize_jobs(int rows, int cols)
+{
+    for (Job *job = jobs; job; job = job->next)
+        if (job->out_fd != -1 && isatty(job->out_fd))
+        {
+            set_pty_size(job->out_fd, rows, cols);
+            kill(-job->pgid, SIGWINCH); // The pty is not their controlling terminal, so the kernel won't
+        }
+}
+
+// Send SIGHUP to every job when the shell exits, waking stopped ones so they see it
+void hangup_jobs(void)
+{
+    for (Job *job = jobs; job; job = job->next)
+    {
+        kill(-job->pgid, SIGHUP);
+        if (job->state == JOB_STOPPED)
+            kill(-job->pgid, SIGCONT);
+    }
+}
+
+Job *add_job(const char *command, pid_t *pids, int count, pid_t pgid, int out_fd, bool background)
+{
+    size_t command_size = strlen(command) + 1;
+    Job *job = xmalloc(sizeof(Job));
+    *job = (Job){
+        .id = 1,
+        .pgid = pgid,
+        .pids = xmalloc(count * sizeof(pid_t)),
+        .pid_count = count,
+        .live = count,
+        .out_fd = out_fd,
+        .state = JOB_RUNNING,
+        .reported = JOB_RUNNING,
+        .background = background,
+        .command = memcpy(xmalloc(command_size), command, command_size),
+    };
+    memcpy(job->pids, pids, count * sizeof(pid_t));
+    init_ansi_parser(&job->parser, add_output_line, NULL);
+    if (out_fd != -1)
+        fcntl(out_fd, F_SETFL, fcntl(out_fd, F_GETFL) | O_NONBLOCK);
+
+    Job **link = &jobs;
+    for (; *link; link = &(*link)->next)
+        if ((*link)->id >= job->id)
+            job->id = (*link)->id + 1;
+    *link = job;
+    return job;
+}
+
+// Run the event loop until a foreground job finishes or is stopped with Ctrl-Z
+void wait_for_job(Job *job)
+{
+    job->background = false;
+    while (job->state == JOB_RUNNING)
+        poll_events(false);
+
+    give_terminal(shell_pgid);
+    if (job->state == JOB_STOPPED)
+    {
+        if (job->record)
+            job->record->complete = false; // The caller stops waiting, and may not keep it
+        job->record = NULL;
+        job->background = true;
+        job->reported = JOB_STOPPED;
+        job_line("[%d]+  Stopped                 %s", job->id, job->command);
+    }
+    else
+    {
+        last_status = job->status;
+        remove_job(job);
+    }
+    paint_output(true);
+}
+
+// Run the event loop once without reading keys, for builtins waiting on several jobs
+void poll_jobs(void)
+{
+    poll_events(false);
+}
+
+// Show output a job collected in `captured` as if it had just been written, then empty it.
+// `flush` paints it now instead of with the next frame.
+void show_captured_output(Line_Buffer *captured, bool flush)
+{
+    if (!output->interactive)
+    {
+        for (size_t start = 0; start < captured->length;)
+        {
+            const char *nl = memchr(captured->data + start, '\n', captured->length - start);
+            size_t end = nl ? (size_t)(nl - captured->data) : captured->length;
+            output->write_line(captured->data + start, end - start);
+            start = end + 1;
+        }
+    }
+    else
+    {
+        Ansi_Parser parser;
+        init_ansi_parser(&parser, add_output_line, NULL);
+        unpainted += ansi_feed(&parser, captured->data, captured->length);
+        unpainted += ansi_finish(&parser);
+        free_ansi_parser(&parser);
+        paint_output(flush);
+    }
+    captured->length = 0;
+}
+
+// Get the next key for the input loop, streaming background output while waiting
+int read_key(void)
+{
+    int ch;
+    at_prompt = true;
+    while ((ch = wgetch(output_win)) == ERR || ch == KEY_RESIZE)
+    {
+        if (ch == KEY_RESIZE)
+            resize_window(true); // ncurses saw the resize first
+        else
+            poll_events(true);
+    }
+    if (ch == '\n')
+        paint_output(true); // Settle background output before the command runs
+    at_prompt = false;
+    return ch;
+}
+
+// Find the job named by `%n` or `n`, or the newest job when no argument is given
+static Job *find_job(char *arg)
+{
+    Job *found = NULL;
+    int id = arg ? atoi(arg[0] == '%' ? arg + 1 : arg) : 0;
+    for (Job *job = jobs; job; job = job->next)
+        if (id == 0 || job->id == id)
+            found = job;
+    return found;
+}
+
+void execute_jobs()
+{
+    for (Job *job = jobs; job; job = job->next)
+        job_line("[%d]%c  %-22s  %s", job->id, job->next ? ' ' : '+',
+                 job->state == JOB_STOPPED ? "Stopped" : "Running", job->command);
+    paint_output(true);
+}
+
+void execute_fg(char *arg)
+{
+    Job *job = find_job(arg);
+    if (job == NULL)
+    {
+        print_error("fg: %s: no such job", arg ? arg : "current");
+        paint_output(true);
+        return;
+    }
+
+    job_line("%s", job->command);
+    paint_output(true);
+
+    give_terminal(job->pgid);
+    if (job->state == JOB_STOPPED)
+    {
+        kill(-job->pgid, SIGCONT);
+        job->state = JOB_RUNNING;
+    }
+    wait_for_job(job);
+}
+
+void execute_bg(char *arg)
+{
+    Job *job = find_job(arg);
+    if (job == NULL)
+        print_error("bg: %s: no such job", arg ? arg : "current");
+    else if (job->state != JOB_STOPPED)
+        print_error("bg: job %d already in background", job->id);
+    else
+    {
+        kill(-job->pgid, SIGCONT);
+        job->state = job->reported = JOB_RUNNING;
+        job->background = true;
+        job_line("[%d]+ %s &", job->id, job->command);
+    }
+    paint_output(true);
+}
@@ -0,0 +1,84 @@
+#ifndef JOBS_H
+#define JOBS_H
+
+#include <stdbool.h>
+#include <sys/resource.h>
+#include "ansi.h"
+#include "commands.h"
+
+#define DRAIN_CHUNKS 4   // Reads taken from one job per loop pass, so keys are never starved
+#define MAX_IDLE_TASKS 8 // Background work run when the event loop has nothing else to do
+#define MAX_WATCHES 4    // Descriptors of other modules the event loop waits on
+#define RESIZE_CHECK_MS 100 // How often the terminal size is checked while a job has the terminal
+
+// Runs one small slice of background work, returning true while more remains
+typedef bool (*Idle_Fn)(void *arg);
+
+// Handles a watched descriptor that became readable
+typedef void (*Watch_Fn)(void *arg);
+
+// Text left over after the last newline of a read, waiting for the rest of its line
+typedef struct
+{
+    char *data;
+    size_t length;
+    size_t size;
+} Line_Buffer;
+
+// A copy of a job's output taken while it is shown, for the result cache
+typedef struct Output_Record
+{
+    Line_Buffer output;
+    size_t limit;  // Longest output worth keeping
+    bool complete; // Cleared when the output outgrows `limit` or the job is stopped
+} Output_Record;
+
+typedef enum
+{
+    JOB_RUNNING,
+    JOB_STOPPED,
+    JOB_DONE
+} Job_State;
+
+// A pipeline started by execute_bin, tracked until every stage has been reaped
+typedef struct Job
+{
+    int id;              // Number shown by `jobs` and taken by `fg`/`bg`
+    pid_t pgid;          // Process group shared by every stage
+    pid_t *pids;         // Stage pids, 0 once a stage has been reaped
+    int pid_count;       // Number of stages
+    int live;            // Stages not reaped yet
+    int out_fd;          // Read end of the output pty or pipe, -1 once closed
+    Ansi_Parser parser;  // Turns the output into scrollback lines
+    Line_Buffer *capture; // Output is collected here instead of shown, when set
+    Output_Record *record; // Output is also copied here as it is shown, when set
+    Job_State state;
+    Job_State reported; // Last state announced for a background job
+    int status;         // Exit status of the last stage, once it has been reaped
+    long long started;  // Monotonic time the first stage was launched
+    struct rusage usage; // Resource use of the stages reaped so far
+    bool background;
+    char *command; // Command line as typed, for `jobs`
+    struct Job *next;
+} Job;
+
+extern int last_status; // Exit status of the last foreground command
+
+// Function prototypes
+void init_jobs(void);
+Job *add_job(const char *command, pid_t *pids, int count, pid_t pgid, int out_fd, bool background);
+void wait_for_job(Job *job);
+void poll_jobs(void);
+void remove_job(Job *job);
+void show_captured_output(Line_Buffer *captured, bool flush);
+int read_key(void);
+void give_terminal(pid_t pgid);
+void hangup_jobs(void);
+void resize_jobs(int rows, int cols);
+void add_idle_task(Idle_Fn fn, void *arg);
+void add_watch(int fd, Watch_Fn fn, void *arg);
+void execute_jobs(void);
+void execute_fg(char *arg);
+void execute_bg(char *arg);
+
+#endif // JOBS_H
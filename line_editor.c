@@ -0,0 +1,321 @@
+#include <stdio.h>
+#include "commands.h"
+#include "line_editor.h"
+#include "output.h"
+#include "wrap.h"
+
+static void *xrealloc(void *p, size_t size)
+{
+    p = realloc(p, size);
+    if (p == NULL)
+    {
+        perror("Error allocating the input line");
+        endwin();
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+static size_t gap_length(const Gap_Buffer *buffer)
+{
+    return buffer->size - (buffer->gap_end - buffer->gap_start);
+}
+
+// Make room for at least `need` more bytes in the gap
+static void grow_gap(Gap_Buffer *buffer, size_t need)
+{
+    if (buffer->gap_end - buffer->gap_start >= need)
+        return;
+    size_t after = buffer->size - buffer->gap_end;
+    size_t size = buffer->size ? buffer->size : EDITOR_MIN_SIZE;
+    while (size - gap_length(buffer) < need)
+        size *= 2;
+    buffer->data = xrealloc(buffer->data, size);
+    memmove(buffer->data + size - after, buffer->data + buffer->gap_end, after);
+    buffer->gap_end = size - after;
+    buffer->size = size;
+}
+
+static void move_gap(Gap_Buffer *buffer, size_t pos)
+{
+    if (pos < buffer->gap_start)
+    {
+        size_t n = buffer->gap_start - pos;
+        memmove(buffer->data + buffer->gap_end - n, buffer->data + pos, n);
+        buffer->gap_start -= n;
+        buffer->gap_end -= n;
+    }
+    else if (pos > buffer->gap_start)
+    {
+        size_t n = pos - buffer->gap_start;
+        memmove(buffer->data + buffer->gap_start, buffer->data + buffer->gap_end, n);
+        buffer->gap_start += n;
+        buffer->gap_end += n;
+    }
+}
+
+// Byte shown at cell `c` counting from the start of the prompt, blank past the end
+static char cell_char(const Line_Editor *editor, size_t c)
+{
+    if (c < editor->prompt_len)
+        return editor->prompt[c];
+    size_t i = c - editor->prompt_len;
+    if (i < editor->text.gap_start)
+        return editor->text.data[i];
+    i += editor->text.gap_end - editor->text.gap_start;
+    return i < editor->text.size ? editor->text.data[i] : ' ';
+}
+
+// Write cells [from, to) with the editor's first row at window row `top`. Rows outside
+// the window are skipped, so the cost is bounded by the screen, not the line.
+static void draw_cells(const Line_Editor *editor, int top, size_t from, size_t to)
+{
+    size_t cols = COLS;
+    int last = LINES - 2;
+    if (top < 0 && from < (size_t)-top * cols)
+        from = (size_t)-top * cols;
+    if (top > last)
+        return;
+    if (to > (size_t)(last - top + 1) * cols)
+        to = (size_t)(last - top + 1) * cols;
+
+    char row_text[cols];
+    while (from < to)
+    {
+        int row = top + from / cols;
+        size_t col = from % cols;
+        size_t end = (from / cols + 1) * cols < to ? (from / cols + 1) * cols : to;
+        size_t n = end - from;
+        for (size_t i = 0; i < n; i++)
+            row_text[i] = cell_char(editor, from + i);
+
+        // Filling the last column with a plain add would scroll the window at the bottom
+        if (col + n == cols)
+        {
+            if (n > 1)
+                mvwaddnstr(output_win, row, col, row_text, n - 1);
+            mvwinsch(output_win, row, cols - 1, (unsigned char)row_text[n - 1]);
+        }
+        else
+            mvwaddnstr(output_win, row, col, row_text, n);
+        from = end;
+    }
+}
+
+static size_t cell_count(const Line_Editor *editor)
+{
+    return editor->prompt_len + editor_length(editor);
+}
+
+// Redraw window rows [first, first + count): the line where it is, and above it the
+// newest scrollback rows, wrapped to the window
+static void draw_rows(const Line_Editor *editor, int first, int count)
+{
+    size_t cols = COLS;
+    Wrap_Position pos = {scroll_his.length, 0};
+    long blank = 0; // Rows above the oldest scrollback row
+    if (first < line)
+        blank = (line - first) + wrap_move(&scroll_his, &pos, first - line, COLS);
+    for (int r = first; r < first + count; r++)
+    {
+        wmove(output_win, r, 0);
+        wclrtoeol(output_win);
+        if (r >= line)
+            draw_cells(editor, line, (r - line) * cols, (r - line + 1) * cols);
+        else if (blank > 0)
+            blank--;
+        else
+        {
+            draw_scroll_row(r, pos.line, pos.row * cols);
+            wrap_move(&scroll_his, &pos, 1, COLS);
+        }
+    }
+}
+
+// Scroll the window `n` rows up (down when negative) with the editor, drawing the rows
+// that come into view
+static void scroll_rows(const Line_Editor *editor, int n)
+{
+    int rows = LINES - 1;
+    line -= n;
+    if (n >= rows || -n >= rows)
+    {
+        draw_rows(editor, 0, rows);
+        return;
+    }
+    wscrl(output_win, n);
+    draw_rows(editor, n > 0 ? rows - n : 0, n > 0 ? n : -n);
+}
+
+void init_line_editor(Line_Editor *editor)
+{
+    *editor = (Line_Editor){0};
+    grow_gap(&editor->text, EDITOR_MIN_SIZE);
+}
+
+// Begin a new, empty line after `prompt` on row `line`
+void editor_start(Line_Editor *editor, const char *prompt, size_t prompt_len)
+{
+    editor->text.gap_start = 0;
+    editor->text.gap_end = editor->text.size;
+    editor->prompt = prompt;
+    editor->prompt_len = prompt_len;
+}
+
+size_t editor_length(const Line_Editor *editor)
+{
+    return gap_length(&editor->text);
+}
+
+size_t editor_cursor(const Line_Editor *editor)
+{
+    return editor->text.gap_start;
+}
+
+// The whole line as one NUL terminated string, valid until the next edit. The caller may
+// change it, the editor keeps its own copy.
+char *editor_text(Line_Editor *editor)
+{
+    size_t len = editor_length(editor);
+    if (editor->flat_size < len + 1)
+    {
+        editor->flat_size = len + 1;
+        editor->flat = xrealloc(editor->flat, editor->flat_size);
+    }
+    size_t before = editor->text.gap_start;
+    memcpy(editor->flat, editor->text.data, before);
+    memcpy(editor->flat + before, editor->text.data + editor->text.gap_end, len - before);
+    editor->flat[len] = '\0';
+    return editor->flat;
+}
+
+// Window row of the last row the line takes up
+int editor_last_row(const Line_Editor *editor)
+{
+    return line + cell_count(editor) / COLS;
+}
+
+// Move the terminal cursor to the editing position, scrolling it into view first. A line
+// that shrank brings back the rows it had pushed off the top.
+void editor_place_cursor(Line_Editor *editor)
+{
+    size_t cell = editor->prompt_len + editor_cursor(editor);
+    int row = line + cell / COLS;
+    int bottom = LINES - 2;
+    if (row > bottom)
+        scroll_rows(editor, row - bottom);
+    else
+    {
+        if (row < 0)
+            scroll_rows(editor, row);
+
+        // Down until the end is on the bottom row, or the oldest scrollback is on the top
+        int last = editor_last_row(editor);
+        if (last < bottom)
+        {
+            Wrap_Position oldest = {scroll_his.length, 0};
+            int above = -wrap_move(&scroll_his, &oldest, -(LINES - 1), COLS); // A screen is enough
+            int n = last - bottom;
+            if (n < line - above)
+                n = line - above;
+            if (n < 0)
+                scroll_rows(editor, n);
+        }
+    }
+    wmove(output_win, line + cell / COLS, cell % COLS);
+}
+
+// Type `text` at the cursor. Only the cells from the cursor on change.
+void editor_insert(Line_Editor *editor, const char *text, size_t len)
+{
+    size_t from = editor->prompt_len + editor_cursor(editor);
+    grow_gap(&editor->text, len);
+    memcpy(editor->text.data + editor->text.gap_start, text, len);
+    editor->text.gap_start += len;
+    editor_place_cursor(editor);
+    draw_cells(editor, line, from, cell_count(editor));
+    editor_place_cursor(editor);
+}
+
+void editor_backspace(Line_Editor *editor)
+{
+    if (editor->text.gap_start == 0)
+        return;
+    editor->text.gap_start--;
+    size_t from = editor->prompt_len + editor_cursor(editor);
+    draw_cells(editor, line, from, cell_count(editor) + 1); // One blank where the end was
+    editor_place_cursor(editor);
+}
+
+// Delete the character under the cursor
+void editor_delete(Line_Editor *editor)
+{
+    if (editor->text.gap_end == editor->text.size)
+        return;
+    editor->text.gap_end++;
+    size_t from = editor->prompt_len + editor_cursor(editor);
+    draw_cells(editor, line, from, cell_count(editor) + 1);
+    editor_place_cursor(editor);
+}
+
+void editor_move(Line_Editor *editor, size_t pos)
+{
+    size_t len = editor_length(editor);
+    move_gap(&editor->text, pos < len ? pos : len);
+    editor_place_cursor(editor);
+}
+
+// Replace the whole line, leaving the cursor at the end
+void editor_set_text(Line_Editor *editor, const char *text, size_t len)
+{
+    size_t old_cells = cell_count(editor);
+    editor->text.gap_start = 0;
+    editor->text.gap_end = editor->text.size;
+    grow_gap(&editor->text, len);
+    memcpy(editor->text.data, text, len);
+    editor->text.gap_start = len;
+    size_t cells = cell_count(editor);
+    draw_cells(editor, line, editor->prompt_len, cells > old_cells ? cells : old_cells);
+    editor_place_cursor(editor);
+}
+
+// Show a different prompt in front of the same text, like the reverse search label
+void editor_set_prompt(Line_Editor *editor, const char *prompt, size_t prompt_len)
+{
+    size_t old_cells = cell_count(editor);
+    editor->prompt = prompt;
+    editor->prompt_len = prompt_len;
+    size_t cells = cell_count(editor);
+    draw_cells(editor, line, 0, cells > old_cells ? cells : old_cells);
+    editor_place_cursor(editor);
+}
+
+// Draw the prompt and the line from row `line` on
+void editor_draw(Line_Editor *editor)
+{
+    draw_cells(editor, line, 0, cell_count(editor));
+    editor_place_cursor(editor);
+}
+
+// Draw the editor's `k`th row on window row `row`, for the scrolled back view
+void editor_draw_row(const Line_Editor *editor, int row, size_t k)
+{
+    size_t cols = COLS;
+    if (k * cols < cell_count(editor))
+        draw_cells(editor, row - (int)k, k * cols, (k + 1) * cols);
+}
+
+// Paint every row of the window again, after a resize
+void editor_redraw(Line_Editor *editor)
+{
+    editor_place_cursor(editor); // Scrolls first, so the rows drawn are the final ones
+    draw_rows(editor, 0, LINES - 1);
+    editor_place_cursor(editor);
+}
+
+// Wipe every row the line is on, so output can be painted there
+void editor_erase(const Line_Editor *editor)
+{
+    wmove(output_win, line < 0 ? 0 : line, 0);
+    wclrtobot(output_win);
+}
@@ -0,0 +1,51 @@
+#ifndef LINE_EDITOR_H
+#define LINE_EDITOR_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define EDITOR_MIN_SIZE 256      // Starting size of the gap buffer
+#define PASTE_CHUNK (64 * 1024)  // Keys already waiting that are inserted with one redraw
+#define PASTE_READ 128           // Bytes of a paste read at once, few enough for ungetch() to take back
+
+// The line being typed, with a gap at the cursor so typing and deleting there only
+// touch the bytes next to it. Moving the cursor moves the gap.
+typedef struct
+{
+    char *data;
+    size_t size;      // Bytes allocated, text and gap together
+    size_t gap_start; // Cursor position, also the length of the text before it
+    size_t gap_end;   // Where the text after the cursor starts
+} Gap_Buffer;
+
+// The prompt and the text after it, wrapped over as many rows as they need. `line` is the
+// window row of the first one, which goes negative once a long line pushes it off the top.
+typedef struct
+{
+    Gap_Buffer text;
+    const char *prompt;
+    size_t prompt_len;
+    char *flat;       // The text in one piece, rebuilt by editor_text()
+    size_t flat_size;
+} Line_Editor;
+
+// Function prototypes
+void init_line_editor(Line_Editor *editor);
+void editor_start(Line_Editor *editor, const char *prompt, size_t prompt_len);
+size_t editor_length(const Line_Editor *editor);
+size_t editor_cursor(const Line_Editor *editor);
+char *editor_text(Line_Editor *editor);
+void editor_insert(Line_Editor *editor, const char *text, size_t len);
+void editor_backspace(Line_Editor *editor);
+void editor_delete(Line_Editor *editor);
+void editor_move(Line_Editor *editor, size_t pos);
+void editor_set_text(Line_Editor *editor, const char *text, size_t len);
+void editor_set_prompt(Line_Editor *editor, const char *prompt, size_t prompt_len);
+void editor_draw(Line_Editor *editor);
+void editor_redraw(Line_Editor *editor);
+void editor_draw_row(const Line_Editor *editor, int row, size_t k);
+void editor_erase(const Line_Editor *editor);
+void editor_place_cursor(Line_Editor *editor);
+int editor_last_row(const Line_Editor *editor);
+
+#endif // LINE_EDITOR_H
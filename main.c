@@ -3,224 +3,438 @@
 #include <ncurses.h>
 #include <stdlib.h>
 #include "commands.h"
+#include "command_index.h"
+#include "jobs.h"
+#include "history.h"
+#include "substring.h"
+#include "output.h"
+#include "stats.h"
+#include "complete.h"
+#include "parallel.h"
+#include "fastpath.h"
+#include "redirect.h"
+#include "line_editor.h"
+#include "wrap.h"
+#include "expand.h"
+#include "memo.h"
+#include "prompt.h"
 #include <errno.h>
+#include <sys/ioctl.h>
 
-#define SHELL_AND_WD_MAX_LENGTH 128
-#define LINE_LENGTH 512
+#define SHELL_AND_WD_MAX_LENGTH 256
+#define CWD_MAX_LENGTH 4096 // Longest working directory the prompt can show
 #define MAX_INPUT 200
-#define MAX_HISTORY 32
 #define KEY_ESC 27
-#define NUM_COMMANDS 14
-
-// Structure to hold a command
-typedef struct
-{
-    char data[MAX_INPUT];
-    size_t length;
-} Command;
-
-// Structure to hold command history
-typedef struct
-{
-    Command commands[MAX_HISTORY];
-    size_t length;
-} History;
+#define KEY_CTRL_A 1
+#define KEY_CTRL_E 5
+#define KEY_CTRL_F 6
+#define KEY_CTRL_G 7
+#define KEY_CTRL_R 18
+#define KEY_TAB 9
+#define SCROLL_OLDEST ((long)(~0UL >> 1)) // scroll_view() step to the oldest row
+#define SCROLL_NEWEST (-SCROLL_OLDEST - 1) // scroll_view() step back to the prompt
 
 // Prototypes
 void init_ncurses(void);
-void add_to_history(History *history, const Command *command);
-void add_to_scroll_history(Scroll_History *history, char *data);
-char *get_shell_prompt(void);
+void load_history_entry(History *history, long cursor, Line_Editor *editor);
+bool reverse_search(History *history, Line_Editor *editor);
+const char *get_shell_prompt(size_t *length);
 inline void adjust_window(void);
 bool shell_at_bottom(void);
-void handle_command(char *command, int *history_index, int *index, int *scroll_offset);
-void redraw_output(Scroll_History *history, int offset);
-void handle_scroll_reset(int *offset, char *prompt, char *data, int index);
-bool check_bins(char *token, char *command);
-char *get_home(void);
+void handle_command(char *command, long *history_index, int *scroll_offset);
+void run_command(char *command, bool background, Shell_State *state);
+void redraw_output(void);
+void handle_scroll_reset(int *offset);
+void scroll_view(int *offset, long n);
+void search_scrollback(int *offset);
+void register_builtins(void);
+void report_unknown_command(const char *token);
+void run_pipeline(char *command, const char *text, bool background);
+void show_lines_above_prompt(size_t count);
+int run_headless(int argc, char *argv[]);
+void run_script_line(char *command);
+void complete_input(Line_Editor *editor);
 
 // Global variables
 WINDOW *output_win;
+WINDOW *status_win; // Bottom row, below the output window
+static bool status_note; // A note is showing in the status row, cleared by the next key
 int line;
-Scroll_History scroll_his = {.length = 0};
+Scroll_History scroll_his = {.fd = -1};
+
+// The prompt for the current directory. The directory part is found once and kept until it
+// goes stale, the segments after it are put together again for every prompt.
+static struct
+{
+    char text[SHELL_AND_WD_MAX_LENGTH];
+    size_t length;
+    char cwd[CWD_MAX_LENGTH];              // "" when getcwd failed
+    char dir[SHELL_AND_WD_MAX_LENGTH];     // cwd as shown, with ~ for the home directory
+    bool stale;
+} shell_prompt = {.stale = true};
+
+// Scrollback search, highlighted on every row drawn while it is active
+static struct
+{
+    char query[MAX_INPUT];
+    size_t length; // 0 when no search is active
+    long line;     // Scrollback line of the current match, -1 for none
+    size_t column; // Byte offset of the current match in that line
+} search = {.line = -1};
+
+// The scrolled back view. Its top row is kept as a position in the scrollback rather than
+// as a distance from the bottom, so new output and a resize leave it where it is.
+static struct
+{
+    Wrap_Position top;
+    Wrap_Index index; // Every window row, built again whenever the view moves
+} view;
+
+// What is on the prompt line, so output from background jobs can be drawn above it
+static struct
+{
+    Line_Editor *editor;
+    int *scroll_offset;
+    bool live; // The prompt is on screen, being edited
+} prompt_line;
+
+// Lines can be any length, so copies of them go on the heap rather than the stack
+static void *xmalloc(size_t size)
+{
+    void *p = malloc(size);
+    if (p == NULL)
+    {
+        perror("Error allocating a command line");
+        endwin();
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
 
-int main(void)
+int main(int argc, char *argv[])
 {
+    // `-c 'commands'`, a script file, or commands piped in run without the screen
+    if (argc > 1 || !isatty(STDIN_FILENO))
+        return run_headless(argc, argv);
+
     // Initialize the ncurses window
     init_ncurses();
+    init_scroll_history(&scroll_his); // Sized by the memory budget
 
     // Start at the user directory
     chdir("/home/cj-suarez");
 
-    History history = {.length = 0}; // Initialize command history
-    Command input_buffer = {0};      // Initialize the input buffer
+    // Start watching for children before any are spawned
+    init_jobs();
+    init_prompt_segments(); // After init_jobs, so the worker thread blocks SIGCHLD too
+    init_completion();      // Likewise for the thread that reads directories for Tab
+
+    // Index the builtins and every executable in $PATH
+    register_builtins();
+    if (getenv(TRACE_ENV) && !open_trace(getenv(TRACE_ENV))) // Opt-in trace of every command
+        perror(getenv(TRACE_ENV));
+    refresh_command_index();
+
+    History history;
+    init_history(&history); // Map the history file shared by every shell
+    add_idle_task(index_history_slice, &history);
+
+    Line_Editor editor; // The line being typed
+    init_line_editor(&editor);
     int ch;
-    int history_index = -1; // Index for history navigation
-    int scroll_offset = -1; // Index for scroll navigation
+    long history_index = -1; // Offset of the history entry being shown, -1 when not navigating
+    int scroll_offset = -1; // -1 at the prompt, otherwise lines from the view's top to the newest
+    bool input_queued = false; // ncurses may hold keys not read yet, so the terminal must wait
+    prompt_line.editor = &editor;
+    prompt_line.scroll_offset = &scroll_offset;
 
     while (1)
     {
-        char *prompt = get_shell_prompt();
-        mvwprintw(output_win, line, 0, "%s", prompt);
+        size_t prompt_len;
+        const char *prompt = get_shell_prompt(&prompt_len);
+        editor_start(&editor, prompt, prompt_len);
+        editor_draw(&editor);
         wrefresh(output_win); // Refresh to show the prompt
-
-        memset(input_buffer.data, 0, sizeof(input_buffer.data));
-        int index = 0;
-        input_buffer.length = 1;
+        prompt_line.live = true;
 
         /* Handle input*/
-        while ((ch = wgetch(output_win)) != '\n') // Read until Enter key
+        bool submit = false;                          // Set when a key other than Enter runs the command
+        while (!submit && (ch = read_key()) != '\n') // Read until Enter key
         {
+            if (status_note)
+            {
+                werase(status_win);
+                wrefresh(status_win);
+                status_note = false;
+            }
+
             switch (ch)
             {
             case KEY_F(2):
                 // Exit shell
-                endwin(); // End ncurses mode
+                hangup_jobs(); // Don't leave background jobs running on their own
+                endwin();      // End ncurses mode
                 return 0;
 
             case KEY_BACKSPACE:
-                handle_scroll_reset(&scroll_offset, prompt, input_buffer.data, index);
-                // Delete a character
-                if (index > 0)
+                handle_scroll_reset(&scroll_offset);
+                // Delete the character before the cursor
+                if (editor_cursor(&editor) > 0)
                 {
-                    index--;
                     history_index = -1;
-                    input_buffer.length--;
-                    memmove(&input_buffer.data[index], &input_buffer.data[index + 1], input_buffer.length - index);
-                    mvwdelch(output_win, line, index + strlen(prompt));
-                    wmove(output_win, line, index + strlen(prompt));
+                    editor_backspace(&editor);
                 }
                 break;
 
-            case KEY_UP:
-                handle_scroll_reset(&scroll_offset, prompt, input_buffer.data, index);
-                // Navigate through the command history (move back)
-                if (history.length)
+            case KEY_DC:
+                handle_scroll_reset(&scroll_offset);
+                // Delete the character under the cursor
+                if (editor_cursor(&editor) < editor_length(&editor))
                 {
-                    if (history_index > 0)
-                        history_index--;
-                    else if (history_index == -1)
-                        history_index = history.length - 1;
-                    wmove(output_win, line, strlen(prompt));
-                    wclrtoeol(output_win);
-                    memset(input_buffer.data, 0, MAX_INPUT);
-                    strcpy(input_buffer.data, history.commands[history_index].data);
-                    index = input_buffer.length = strlen(input_buffer.data);
-                    mvwprintw(output_win, line, strlen(prompt), "%s", input_buffer.data);
-                    wmove(output_win, line, strlen(prompt) + index);
+                    history_index = -1;
+                    editor_delete(&editor);
                 }
                 break;
 
+            case KEY_UP:
+                handle_scroll_reset(&scroll_offset);
+                // Navigate through the command history (move back)
+                if (history_prev(&history, &history_index))
+                    load_history_entry(&history, history_index, &editor);
+                break;
+
             case KEY_DOWN:
-                handle_scroll_reset(&scroll_offset, prompt, input_buffer.data, index);
+                handle_scroll_reset(&scroll_offset);
                 // Navigate through the command history
-                if (history_index < history.length - 1)
-                {
-                    history_index++;
-                    strcpy(input_buffer.data, history.commands[history_index].data);
-                }
-                else if (history_index == history.length - 1)
-                {
-                    history_index = -1;
-                    memset(input_buffer.data, 0, MAX_INPUT);
-                }
-                input_buffer.length = index = strlen(input_buffer.data);
-
-                // Clear and redraw the input buffer
-                wmove(output_win, line, strlen(prompt));
-                wclrtoeol(output_win);
-                mvwprintw(output_win, line, strlen(prompt), "%s", input_buffer.data);
-                wmove(output_win, line, strlen(prompt) + index);
+                if (history_next(&history, &history_index))
+                    load_history_entry(&history, history_index, &editor);
+                else if (history_index == -1)
+                    editor_set_text(&editor, "", 0); // Walked past the newest entry
+                break;
 
+            case KEY_CTRL_R:
+                handle_scroll_reset(&scroll_offset);
+                // Incremental search back through the history
+                history_index = -1;
+                submit = reverse_search(&history, &editor);
                 break;
 
             case KEY_LEFT:
-                handle_scroll_reset(&scroll_offset, prompt, input_buffer.data, index);
+                handle_scroll_reset(&scroll_offset);
                 // Move cursor left
-                if (index > 0)
-                    wmove(output_win, line, strlen(prompt) + --index);
+                if (editor_cursor(&editor) > 0)
+                    editor_move(&editor, editor_cursor(&editor) - 1);
                 break;
 
             case KEY_RIGHT:
-                handle_scroll_reset(&scroll_offset, prompt, input_buffer.data, index);
+                handle_scroll_reset(&scroll_offset);
                 // Move cursor right
-                if (index < input_buffer.length)
-                    wmove(output_win, line, strlen(prompt) + ++index);
+                editor_move(&editor, editor_cursor(&editor) + 1);
+                break;
+
+            case KEY_HOME:
+            case KEY_CTRL_A:
+                handle_scroll_reset(&scroll_offset);
+                editor_move(&editor, 0);
+                break;
+
+            case KEY_END:
+            case KEY_CTRL_E:
+                handle_scroll_reset(&scroll_offset);
+                editor_move(&editor, editor_length(&editor));
                 break;
 
             case KEY_ESC:
-                handle_scroll_reset(&scroll_offset, prompt, input_buffer.data, index);
+                input_queued = true; // The rest of an unknown escape sequence is left in ncurses
+                handle_scroll_reset(&scroll_offset);
                 // Clear the line
-                index = 0;
-                wmove(output_win, line, strlen(prompt));
-                memset(input_buffer.data, 0, input_buffer.length);
-                wclrtoeol(output_win);
+                editor_set_text(&editor, "", 0);
                 break;
 
-            case KEY_SR: // Scroll up
-                if (shell_at_bottom() && scroll_his.length - LINES - scroll_offset + 2 > 0)
-                {
-                    scroll_offset++;                           // Increase offset when scrolling up
-                    redraw_output(&scroll_his, scroll_offset); // Redraw with new offset
-                }
+            case KEY_TAB:
+                handle_scroll_reset(&scroll_offset);
+                // Complete the command or file name before the cursor
+                history_index = -1;
+                complete_input(&editor);
                 break;
 
-            case KEY_SF: // Scroll down
-                if (scroll_offset > 0)
-                {
-                    scroll_offset--;                           // Decrease offset when scrolling down
-                    redraw_output(&scroll_his, scroll_offset); // Redraw with new offset
-                }
-                else if (scroll_offset == 0)
+            case KEY_CTRL_F:
+                // Search the scrollback
+                search_scrollback(&scroll_offset);
+                break;
+
+            case KEY_SR:    // Scroll up one line
+            case KEY_PPAGE: // Scroll up one page
+            case KEY_SHOME: // Jump to the oldest line
+                if (scroll_offset >= 0 || shell_at_bottom()) // Otherwise everything is already on screen
+                    scroll_view(&scroll_offset, ch == KEY_SR ? 1 : ch == KEY_PPAGE ? LINES - 2 : SCROLL_OLDEST);
+                break;
+
+            case KEY_SF:    // Scroll down one line
+            case KEY_NPAGE: // Scroll down one page
+            case KEY_SEND: // Jump back to the prompt
+                if (scroll_offset >= 0)
+                    scroll_view(&scroll_offset, ch == KEY_SF ? -1 : ch == KEY_NPAGE ? -(LINES - 2) : SCROLL_NEWEST);
+                break;
+
+            case '/':
+                // While scrolled back `/` searches, like in a pager
+                if (scroll_offset >= 0)
                 {
-                    redraw_output(&scroll_his, scroll_offset);                                 // Redraw with new offset
-                    mvwprintw(output_win, LINES - 2, 0, "%s", prompt);                         // Redraw prompt on the last visible line
-                    mvwprintw(output_win, LINES - 2, strlen(prompt), "%s", input_buffer.data); // Redraw current input line
-                    wmove(output_win, LINES - 2, strlen(prompt) + index);                      // Move cursor to the end of input line
+                    search_scrollback(&scroll_offset);
+                    break;
                 }
-                break;
+                // fall through
 
             default:
-                if (ch >= 32 && ch <= 126 && index < LINE_LENGTH - 1) // Printable characters
+                if (ch >= 32 && ch <= 126) // Printable characters
                 {
-                    handle_scroll_reset(&scroll_offset, prompt, input_buffer.data, index);
+                    handle_scroll_reset(&scroll_offset);
+                    history_index = -1; // Reset history navigation
 
-                    history_index = -1;              // Reset history navigation
-                    input_buffer.data[index++] = ch; // Add the character to input buffer
-                    input_buffer.length++;
+                    // A paste arrives as a burst of keys, everything already waiting goes in
+                    // with one insert and one redraw
+                    char typed[PASTE_CHUNK];
+                    size_t n = 0;
+                    typed[n++] = ch;
+                    while (n + PASTE_READ <= sizeof(typed))
+                    {
+                        if (input_queued)
+                        {
+                            // Bytes waiting in ncurses come before anything still unread
+                            ch = wgetch(output_win);
+                            if (ch == ERR)
+                                input_queued = false;
+                            else if (ch >= 32 && ch <= 126)
+                                typed[n++] = ch;
+                            else
+                                ungetch(ch); // Enter and other keys are handled by the loop
+                            if (ch >= 32 && ch <= 126)
+                                continue;
+                            break;
+                        }
 
-                    mvwaddch(output_win, line, strlen(prompt) + index - 1, ch); // Display the typed character
-                    wmove(output_win, line, strlen(prompt) + index);            // Move cursor after typed character
+                        // ncurses reads one byte per read(), so the terminal is read here in
+                        // slices instead. Whatever follows the text goes back to ncurses, which
+                        // is why a slice is no bigger than ungetch() takes.
+                        struct pollfd pfd = {.fd = STDIN_FILENO, .events = POLLIN};
+                        ssize_t got = poll(&pfd, 1, 0) == 1 ? read(STDIN_FILENO, typed + n, PASTE_READ) : 0;
+                        if (got <= 0)
+                            break;
+                        ssize_t text = 0;
+                        while (text < got && typed[n + text] >= 32 && typed[n + text] <= 126)
+                            text++;
+                        for (ssize_t i = got - 1; i >= text; i--)
+                            ungetch((unsigned char)typed[n + i]);
+                        n += text;
+                        if (text < got)
+                        {
+                            input_queued = true;
+                            break;
+                        }
+                    }
+                    editor_insert(&editor, typed, n);
                 }
                 break;
             }
             wrefresh(output_win);
         }
 
+        prompt_line.live = false;
+        editor_move(&editor, editor_length(&editor));
+        char *command = editor_text(&editor);
+        size_t command_len = editor_length(&editor);
+
         /* Adding line to history */
-        char buff[LINE_LENGTH];                   // Create buffer to store line data
-        strcpy(buff, prompt);                     // Copy the shell prompt into buffer
-        strcat(buff, input_buffer.data);          // Append the command into buffer
-        add_to_scroll_history(&scroll_his, buff); // Add the line into scroll history
+        {
+            // The prompt may have been redrawn with new segments since it was first shown
+            prompt = editor.prompt;
+            prompt_len = editor.prompt_len;
+            char *buff = xmalloc(prompt_len + command_len + 1);  // Create buffer to store line data
+            memcpy(buff, prompt, prompt_len);                    // Copy the shell prompt into buffer
+            memcpy(buff + prompt_len, command, command_len + 1); // Append the command into buffer
+            add_to_scroll_history_n(&scroll_his, buff, prompt_len + command_len); // Add the line into scroll history
+            free(buff);
+        }
 
-        free(prompt); // Free the memory that was allocated by get_shell_prompt()
+        // Output starts under the last row of the line, wrapped the way scrollback wraps it
+        line += wrap_line_rows(&scroll_his, scroll_his.length - 1, COLS) - 1;
 
         /* Adding comamnd to history */
-        if (input_buffer.data[0]) // Add to history only if there is input
-        {
-            add_to_history(&history, &input_buffer);
-            history_index = history.length; // Set to end of history
-        }
+        if (command[0]) // Add to history only if there is input
+            add_to_history(&history, command);
+        history_index = -1; // Start navigation from the newest entry again
 
-        handle_command(input_buffer.data, &history_index, &index, &scroll_offset);
+        long long started = monotonic_ns();
+        handle_command(command, &history_index, &scroll_offset);
+        set_command_duration(monotonic_ns() - started);
 
-        memset(input_buffer.data, 0, input_buffer.length);
-        input_buffer.length = 0;
         adjust_window();
         wrefresh(output_win);
     }
 }
 
+// Run commands from `-c`, a script file or stdin without curses. Builtins print to a
+// buffered stdout and children write to the shell's stdout and stderr directly, so no
+// output is copied through the shell. Exits with the last command's status.
+int run_headless(int argc, char *argv[])
+{
+    use_stdout_output();
+    init_jobs();
+    register_builtins();
+    if (getenv(TRACE_ENV) && !open_trace(getenv(TRACE_ENV))) // Opt-in trace of every command
+        perror(getenv(TRACE_ENV));
+    refresh_command_index();
+
+    if (argc > 1 && strcmp(argv[1], "-c") == 0)
+    {
+        if (argc < 3)
+        {
+            fprintf(stderr, "my-shell: -c: option requires an argument\n");
+            return 2;
+        }
+        char *rest = argv[2];
+        char *command;
+        while ((command = strsep(&rest, "\n")) != NULL)
+            run_script_line(command);
+    }
+    else
+    {
+        FILE *script = argc > 1 ? fopen(argv[1], "r") : stdin;
+        if (script == NULL)
+        {
+            perror(argv[1]);
+            return 127;
+        }
+
+        char *command = NULL;
+        size_t size = 0;
+        ssize_t len;
+        while ((len = getline(&command, &size, script)) != -1)
+        {
+            if (len > 0 && command[len - 1] == '\n')
+                command[len - 1] = '\0';
+            run_script_line(command);
+        }
+        free(command);
+    }
+
+    output->flush();
+    return last_status;
+}
+
+// Run one line of a script, skipping blank lines and comments (which covers `#!`)
+void run_script_line(char *command)
+{
+    command += strspn(command, " \t");
+    if (*command == '\0' || *command == '#')
+        return;
+
+    long history_index = -1;
+    int scroll_offset = -1;
+    handle_command(command, &history_index, &scroll_offset);
+}
+
 void init_ncurses(void)
 {
     // Initialize ncurses
@@ -230,6 +444,11 @@ void init_ncurses(void)
         perror("Error initializing ncurses");
         exit(EXIT_FAILURE);
     }
+    if (has_colors())
+    {
+        start_color();
+        use_default_colors(); // Color 0 of a run is -1, the terminal's own color
+    }
 
     cbreak();
     noecho();
@@ -243,197 +462,1041 @@ void init_ncurses(void)
         exit(EXIT_FAILURE);
     }
 
+    // The row under the output window holds the scrollback search bar
+    status_win = newwin(1, COLS, LINES - 1, 0);
+    if (status_win == NULL)
+    {
+        perror("Error creating status window");
+        endwin();
+        exit(EXIT_FAILURE);
+    }
+
     keypad(output_win, TRUE);
+    nodelay(output_win, TRUE);  // read_key() waits in the event loop instead of in wgetch
     scrollok(output_win, TRUE); // Allow scrolling in the window
     wrefresh(output_win);       // Refresh to show the window
 }
 
-void add_to_history(History *history, const Command *command)
+// Put a history entry on the input line
+void load_history_entry(History *history, long cursor, Line_Editor *editor)
+{
+    const char *text;
+    size_t len = history_entry(history, cursor, &text);
+    editor_set_text(editor, text, len);
+}
+
+// Ctrl-R: search back through the history as the query is typed. Ctrl-R again finds an
+// older match, Esc or Ctrl-G gives up, Enter runs the match (returns true), and any other
+// key keeps the match for editing.
+bool reverse_search(History *history, Line_Editor *editor)
+{
+    char query[MAX_INPUT] = "";
+    size_t query_len = 0;
+    long match = -1;
+    bool failed = false;
+
+    size_t saved_len = editor_length(editor);
+    char *saved = xmalloc(saved_len + 1);
+    memcpy(saved, editor_text(editor), saved_len + 1);
+    char label[MAX_INPUT + 32];
+
+    while (1)
+    {
+        if (match != -1)
+            load_history_entry(history, match, editor);
+
+        // The label stands in for the prompt, so background output redraws the search
+        int label_len = snprintf(label, sizeof(label), "(%sreverse-i-search)`%s': ", failed ? "failed " : "", query);
+        if (label_len >= (int)sizeof(label))
+            label_len = sizeof(label) - 1;
+        editor_set_prompt(editor, label, label_len);
+        wrefresh(output_win);
+
+        int ch = read_key();
+        if (ch == KEY_CTRL_R)
+        {
+            long older;
+            if (match != -1 && search_history(history, query, match, &older))
+                match = older;
+            else
+                failed = true;
+        }
+        else if (ch == KEY_BACKSPACE || (ch >= 32 && ch <= 126))
+        {
+            if (ch == KEY_BACKSPACE)
+            {
+                if (query_len > 0)
+                    query[--query_len] = '\0';
+                match = -1; // A shorter query starts over from the newest entry
+            }
+            else if (query_len < MAX_INPUT - 1)
+                query[query_len++] = ch;
+
+            // A longer query can still match the current entry, so search from just past it
+            long found;
+            failed = query_len && !search_history(history, query, match == -1 ? -1 : match + 1, &found);
+            if (query_len && !failed)
+                match = found;
+        }
+        else
+        {
+            if (ch == KEY_ESC || ch == KEY_CTRL_G)
+                editor_set_text(editor, saved, saved_len);
+            free(saved);
+            editor_set_prompt(editor, shell_prompt.text, shell_prompt.length); // Segments may have changed meanwhile
+            return ch == '\n';
+        }
+    }
+}
+
+// Find the directory part of the prompt. Only called when it has been marked stale, so
+// getcwd and getenv stay off the per-prompt and per-keystroke paths.
+static void build_shell_prompt(void)
 {
-    if (history->length < MAX_HISTORY)
+    char *cwd = shell_prompt.cwd;
+    char *dir = shell_prompt.dir;
+
+    if (getcwd(cwd, sizeof(shell_prompt.cwd)) == NULL)
     {
-        // Add new command to history
-        history->commands[history->length] = *command;
-        history->length++;
+        cwd[0] = '\0';
+        dir[0] = '\0'; // fallback in case getcwd fails, "my-shell $ "
     }
     else
     {
-        // Shift commands to make room for the new one
-        for (size_t i = 0; i < MAX_HISTORY - 1; i++)
+        // Replace the home directory (/home/$USER) with "~" when it is a prefix of cwd
+        const char *user = getenv("USER");
+        size_t home_len = strlen("/home/");
+        bool hd_in_cwd = strncmp(cwd, "/home/", home_len) == 0;
+        if (hd_in_cwd && user)
         {
-            history->commands[i] = history->commands[i + 1];
+            hd_in_cwd = strncmp(cwd + home_len, user, strlen(user)) == 0;
+            home_len += strlen(user);
         }
-        history->commands[MAX_HISTORY - 1] = *command;
+
+        // A long cwd is cut to fit, the same as the old heap prompt
+        snprintf(dir, sizeof(shell_prompt.dir), "%s%s", hd_in_cwd ? "~" : "", cwd + (hd_in_cwd ? home_len : 0));
+    }
+    shell_prompt.stale = false;
+}
+
+// Put the prompt together from the directory and the segments known now
+static size_t assemble_prompt(char *text)
+{
+    char segments[SHELL_AND_WD_MAX_LENGTH];
+    format_prompt_segments(segments, sizeof(segments), shell_prompt.cwd);
+    const char *dir = shell_prompt.dir;
+    int len = snprintf(text, SHELL_AND_WD_MAX_LENGTH, "my-shell%s%s%s$ ", dir[0] ? " " : "", dir, segments);
+    if (len < 0)
+        len = 0;
+    if (len >= SHELL_AND_WD_MAX_LENGTH)
+        len = SHELL_AND_WD_MAX_LENGTH - 1;
+    return len;
+}
+
+// The prompt for the current directory, with its length in `length`. The worker is asked
+// for fresh segments, and the prompt is drawn again in place when they arrive.
+const char *get_shell_prompt(size_t *length)
+{
+    if (shell_prompt.stale)
+        build_shell_prompt();
+    if (shell_prompt.cwd[0])
+        request_prompt_segments(shell_prompt.cwd);
+    shell_prompt.length = assemble_prompt(shell_prompt.text);
+    *length = shell_prompt.length;
+    return shell_prompt.text;
+}
+
+// New segments arrived: put them in the prompt, and draw it again if it is being edited
+void refresh_prompt(void)
+{
+    char text[SHELL_AND_WD_MAX_LENGTH];
+    size_t length = assemble_prompt(text);
+    if (length == shell_prompt.length && memcmp(text, shell_prompt.text, length) == 0)
+        return;
+    memcpy(shell_prompt.text, text, length + 1);
+    shell_prompt.length = length;
+
+    Line_Editor *editor = prompt_line.editor;
+    if (!prompt_line.live || editor->prompt != shell_prompt.text)
+        return; // Not on screen, or the search label stands in for it until the search ends
+    if (*prompt_line.scroll_offset >= 0)
+        editor->prompt_len = length; // Scrolled back, the rows show the new text when drawn
+    else
+    {
+        editor_set_prompt(editor, shell_prompt.text, length);
+        wrefresh(output_win);
     }
 }
 
-char *get_shell_prompt(void)
+// Called after a successful `cd` or an environment change, the next prompt is rebuilt
+void invalidate_prompt(void)
 {
-    char *cwd = getcwd(NULL, 0);
-    if (cwd == NULL)
-        return strdup("my-shell $ "); // fallback in case getcwd fails
+    shell_prompt.stale = true;
+}
+
+inline void adjust_window(void)
+{
+    if (line >= LINES - 2) // Check if we need to scroll
+    {
+        wscrl(output_win, 1);
+        line = LINES - 2; // Keep cursor on the last visible line
+    }
+    else
+    {
+        line++;
+    }
+}
+
+// Paint the newest scrollback rows on window rows [0, rows), the newest on the last of them
+static void paint_tail(int rows)
+{
+    Wrap_Position pos = {scroll_his.length, 0};
+    int blank = rows + wrap_move(&scroll_his, &pos, -rows, COLS); // Rows above the oldest line
+    for (int r = 0; r < rows; r++)
+    {
+        wmove(output_win, r, 0);
+        wclrtoeol(output_win);
+        if (r < blank)
+            continue;
+        draw_scroll_row(r, pos.line, pos.row * COLS);
+        wrap_move(&scroll_his, &pos, 1, COLS);
+    }
+}
+
+// Paint the newest `count` scrollback lines below the current line in one pass, each
+// wrapped over as many rows as it needs. The caller refreshes.
+void show_new_lines(size_t count)
+{
+    int rows = LINES - 1;
+    if (count > scroll_his.length)
+        count = scroll_his.length;
+    if (count == 0)
+        return;
+
+    // Rows the new lines take, counted only as far as a screen
+    Wrap_Position first = {scroll_his.length - count, 0};
+    long new_rows = wrap_distance(&scroll_his, first, (Wrap_Position){scroll_his.length, 0}, rows, COLS);
 
-    char *hd = get_home(); // Get the user's home directory
-    bool hd_in_cwd = true;
+    if (new_rows >= rows)
+    {
+        // The whole window is new output, so only the final screen is drawn
+        paint_tail(rows);
+        line = LINES - 2;
+        return;
+    }
+
+    // Scroll once for the whole batch instead of once per line
+    int overflow = line + (int)new_rows - (LINES - 2);
+    if (overflow > 0)
+    {
+        wscrl(output_win, overflow);
+        line -= overflow;
+    }
+    for (long r = 0; r < new_rows; r++)
+    {
+        draw_scroll_row(++line, first.line, first.row * COLS);
+        wrap_move(&scroll_his, &first, 1, COLS);
+    }
+}
+
+// Top row of the view at the bottom, with the prompt's first row on the last window row
+static Wrap_Position view_bottom(void)
+{
+    Wrap_Position top = {scroll_his.length, 0};
+    wrap_move(&scroll_his, &top, -(LINES - 2), COLS);
+    return top;
+}
 
-    // Check if the home directory path is a prefix of cwd
-    if (strlen(cwd) >= strlen(hd))
+static size_t scroll_line_length(size_t i)
+{
+    return get_scroll_line_length(&scroll_his, i);
+}
+
+// Mark every match of the search on a row, the current one in bold. A match that wraps
+// onto the next row is marked on both.
+static void highlight_matches(int row, Wrap_Position pos, const char *text)
+{
+    size_t len = scroll_line_length(pos.line);
+    size_t from = pos.row * COLS;
+    size_t to = from + COLS < len ? from + COLS : len;
+    size_t start = from > search.length - 1 ? from - (search.length - 1) : 0;
+    size_t end = to + search.length - 1 < len ? to + search.length - 1 : len;
+    const char *m = text + start;
+    while ((m = find_substring(m, text + end - m, search.query, search.length)) != NULL)
     {
-        for (int i = 0; hd[i] != 0; i++)
+        size_t column = m - text;
+        size_t a = column > from ? column : from;
+        size_t b = column + search.length < to ? column + search.length : to;
+        attr_t attrs = (long)pos.line == search.line && column == search.column ? A_REVERSE | A_BOLD : A_REVERSE;
+        mvwchgat(output_win, row, a - from, b - a, attrs, 0, NULL);
+        m += search.length;
+    }
+}
+
+// Draw one row of the scrolled view: a row of scrollback, or of the prompt below the newest
+static void draw_view_row(int row)
+{
+    Wrap_Position pos = view.index.rows[row];
+    wmove(output_win, row, 0);
+    wclrtoeol(output_win);
+    if (pos.line < scroll_his.length)
+    {
+        draw_scroll_row(row, pos.line, pos.row * COLS);
+        if (search.length)
+            highlight_matches(row, pos, get_scroll_line(&scroll_his, pos.line));
+    }
+    else
+        editor_draw_row(prompt_line.editor, row, pos.row); // The line can wrap onto several rows
+}
+
+// Repaint the whole view, one screen of rows and nothing more
+void redraw_output(void)
+{
+    werase(output_win); // Clear the window
+
+    build_wrap_index(&view.index, &scroll_his, view.top, LINES - 1, COLS);
+    for (int r = 0; r < LINES - 1; r++)
+        draw_view_row(r);
+}
+
+// Leave the view and give the screen back to the prompt, whose first row is on the last
+// window row or right under the scrollback when that is shorter
+static void leave_view(int *offset)
+{
+    *offset = -1;
+    line = wrap_distance(&scroll_his, view_bottom(), (Wrap_Position){scroll_his.length, 0}, LINES - 2, COLS);
+    editor_place_cursor(prompt_line.editor);
+}
+
+// Move the view `n` rows back towards older output, or forward when negative. The window
+// contents are shifted with wscrl and only the rows that come into view are drawn, so a step
+// costs the same however long the scrollback is. Reaching the bottom hands the screen back
+// to the prompt.
+void scroll_view(int *offset, long n)
+{
+    int rows = LINES - 1;
+    Wrap_Position bottom = view_bottom();
+    bool entering = *offset < 0;
+    if (entering)
+        view.top = bottom;
+
+    Wrap_Position top = view.top;
+    long moved; // Rows moved back, negative going forward
+    if (n == SCROLL_OLDEST || n == SCROLL_NEWEST)
+    {
+        // Jumps replace every row, so the rows in between are never counted
+        top = n == SCROLL_OLDEST ? (Wrap_Position){0, 0} : bottom;
+        moved = top.line == view.top.line && top.row == view.top.row ? 0 : rows;
+    }
+    else if (n > 0)
+        moved = -wrap_move(&scroll_his, &top, -n, COLS);
+    else
+    {
+        moved = -wrap_distance(&scroll_his, top, bottom, -n, COLS);
+        wrap_move(&scroll_his, &top, -moved, COLS);
+    }
+    if (entering && moved == 0)
+        return;
+
+    view.top = top;
+    if (entering || labs(moved) >= rows)
+        redraw_output(); // Entering the view, or a jump that replaces every row
+    else if (moved != 0)
+    {
+        wscrl(output_win, -moved);
+        build_wrap_index(&view.index, &scroll_his, view.top, rows, COLS);
+        if (moved > 0)
+            for (int r = 0; r < moved; r++)
+                draw_view_row(r);
+        else
+            for (int r = rows + moved; r < rows; r++)
+                draw_view_row(r);
+    }
+
+    if (!wrap_before(top, bottom))
+        leave_view(offset); // Back at the bottom, the prompt row is live again
+    else
+        *offset = scroll_his.length - top.line;
+}
+
+// Run a command line: commands joined by `;`, `&`, `&&` and `||`, left to right. `&&`
+// runs the next command only if the last one succeeded and `||` only if it failed; `&`
+// runs the command before it in the background and moves straight on. Operators inside
+// quotes are just text.
+void handle_command(char *command, long *history_index, int *scroll_offset)
+{
+    // Cut the line into commands, each with the operator that ends it ("" for the last)
+    size_t max_items = 2;
+    for (const char *c = command; (c = strpbrk(c, ";&|")) != NULL; c++)
+        max_items++; // Every operator has at least one of these
+    struct Command_Item
+    {
+        char *text;
+        const char *op;
+    } *items = xmalloc(max_items * sizeof(struct Command_Item)); // As many as the line holds
+    size_t count = 0;
+    char *p = command;
+    while (1)
+    {
+        char *start = p;
+        const char *op = "";
+        for (; *p; p++)
         {
-            if (hd[i] != cwd[i])
-            {
-                hd_in_cwd = false;
+            p += strcspn(p, "\\'\"&|;");
+            if (*p == '\0')
                 break;
+            if (*p == '\\' || *p == '\'' || *p == '"')
+            {
+                p = skip_quoted(p);
+                continue;
             }
+            if (p[0] == '&' && p[1] == '&')
+                op = "&&";
+            else if (p[0] == '|' && p[1] == '|')
+                op = "||";
+            else if (p[0] == ';')
+                op = ";";
+            else if (p[0] == '&' && (p == command || (p[-1] != '>' && p[-1] != '<'))) // Not `2>&1`
+                op = "&";
+            else
+                continue;
+            break;
+        }
+        if (*p)
+        {
+            *p = '\0';
+            p += strlen(op);
         }
 
-        // If the home directory is a prefix, replace it with "~"
-        if (hd_in_cwd)
+        const char *prev = count > 0 ? items[count - 1].op : "";
+        if (start[strspn(start, " \t")] == '\0')
         {
-            // Allocate memory for the prompt and replace /home/{$USER} with ~
-            size_t offset = strlen(hd);
-            char *shortened_cwd = cwd + offset; // Get the part after home directory
-            char *prompt = malloc(SHELL_AND_WD_MAX_LENGTH);
-            snprintf(prompt, SHELL_AND_WD_MAX_LENGTH, "my-shell ~%s$ ", shortened_cwd);
-            free(cwd);
-            free(hd);
-            return prompt;
+            // Only the end of the line, or of a `;` or `&` list, may be left empty
+            if (*op || strcmp(prev, "&&") == 0 || strcmp(prev, "||") == 0)
+            {
+                print_error("Syntax error: missing command %s `%s`.", *op ? "before" : "after", *op ? op : prev);
+                last_status = 2;
+                free(items);
+                return;
+            }
+            break;
         }
+        items[count].text = start;
+        items[count].op = op;
+        count++;
+        if (*op == '\0')
+            break;
     }
 
-    // If the cwd is not in home, just display the full cwd
-    char *prompt = malloc(SHELL_AND_WD_MAX_LENGTH);
-    snprintf(prompt, SHELL_AND_WD_MAX_LENGTH, "my-shell %s$ ", cwd);
-    free(cwd);
-    free(hd);
-    return prompt;
+    Shell_State state = {history_index, scroll_offset};
+    for (size_t i = 0; i < count; i++)
+    {
+        const char *prev = i > 0 ? items[i - 1].op : ";";
+        if (strcmp(prev, "&&") == 0 && last_status != 0)
+            continue;
+        if (strcmp(prev, "||") == 0 && last_status == 0)
+            continue;
+        run_command(items[i].text, strcmp(items[i].op, "&") == 0, &state);
+    }
+    free(items);
 }
 
-char *get_home(void)
+// Run a command without pipes: a builtin, a fast path or one external program. `text` is
+// the command as typed.
+static void run_simple_command(char *command, const char *text, bool background, Shell_State *state)
 {
-    char *user = getenv("USER");
-    if (!user)
-        return strdup("/home/"); // Fallback if getenv fails
+    Stage stage;
+    if (!prepare_stage(command, &stage))
+        return;
 
-    // Allocate memory for home directory and construct it
-    char *home = malloc(strlen("/home/") + strlen(user) + 1);
-    strcpy(home, "/home/");
-    strcat(home, user);
+    // `cached CMD ...` runs CMD through the result cache, `cached` on its own is a builtin
+    bool cached = stage.words.count > 1 && strcmp(stage.words.argv[0], "cached") == 0 && stage.words.argv[1][0] != '-';
+    if (cached)
+        shift_words(&stage.words);
+    char **words = stage.words.argv;
+    if (stage.words.count > 0)
+    {
+        // Builtins never change, so only the $PATH part of the index needs to be current
+        Command_Entry *entry = strchr(words[0], '/') ? NULL : lookup_command(words[0]);
+        bool fast_path = entry && entry->fast_path && !background && !cached;
+        if (entry && (entry->builtin || fast_path))
+        {
+            // Builtins print through `output` and report errors with print_error(), so
+            // redirections swap those for the files
+            int fds[MAX_REDIRECTIONS];
+            if (!open_redirections(&stage.redirections, fds))
+            {
+                free_words(&stage.words);
+                return;
+            }
+            const Output_Backend *screen = output;
+            int out = redirected_fd(&stage.redirections, fds, STDOUT_FILENO);
+            int err = redirected_fd(&stage.redirections, fds, STDERR_FILENO);
+            bool redirected = out != -1 || err != -1;
+            if (redirected)
+                redirect_output(out, err);
+
+            last_status = 0; // Builtins that fail set their own status
+            long long start = monotonic_ns();
+            bool handled = true;
+            if (entry->builtin)
+                entry->builtin(&stage.words, state);
+            else
+                handled = entry->fast_path(&stage.words);
+            if (redirected)
+                restore_output(screen);
+            close_redirections(&stage.redirections, fds);
+            if (handled)
+            {
+                record_command(text, start, monotonic_ns(), NULL);
+                free_words(&stage.words);
+                return;
+            }
+        }
 
-    return home;
+        refresh_command_index(); // Pick up executables added to or removed from $PATH
+        if (!resolve_executable(words[0]))
+            report_unknown_command(words[0]);
+        else if (cached)
+            run_cached(&stage, 1, text, background);
+        else
+            execute_bin(&stage, 1, text, background, NULL);
+    }
+    free_words(&stage.words);
 }
 
-inline void adjust_window(void)
+// Run one pipeline or simple command, in the background if asked
+void run_command(char *command, bool background, Shell_State *state)
 {
-    if (line >= LINES - 2) // Check if we need to scroll
+    // Keep the command as typed for `jobs`
+    command += strspn(command, " \t");
+    size_t len = strlen(command);
+    while (len > 0 && (command[len - 1] == ' ' || command[len - 1] == '\t'))
+        command[--len] = '\0';
+    char *text = xmalloc(len + 3);
+    sprintf(text, "%s%s", command, background ? " &" : "");
+
+    if (find_unquoted(command, "|"))
     {
-        wscrl(output_win, 1);
-        line = LINES - 2; // Keep cursor on the last visible line
+        refresh_command_index(); // Pick up executables added to or removed from $PATH
+        run_pipeline(command, text, background);
     }
     else
+        run_simple_command(command, text, background, state);
+    free(text);
+}
+
+// Split `cmd1 | cmd2 | ... | cmdN` into stages, check every command, then run them together
+void run_pipeline(char *command, const char *text, bool background)
+{
+    int count = 1;
+    for (char *c = command; (c = find_unquoted(c, "|")) != NULL; c++)
+        count++;
+
+    Stage *stages = xmalloc(count * sizeof(Stage)); // A Stage is large, and there is one per `|`
+    int prepared = 0;
+    bool cached = false;
+    char *rest = command;
+    for (; prepared < count; prepared++)
     {
-        line++;
+        char *stage = rest;
+        char *bar = find_unquoted(rest, "|");
+        if (bar)
+        {
+            *bar = '\0';
+            rest = bar + 1;
+        }
+        if (!prepare_stage(stage, &stages[prepared]))
+            break;
+
+        Word_List *list = &stages[prepared].words;
+        if (prepared == 0 && list->count > 1 && strcmp(list->argv[0], "cached") == 0 && list->argv[1][0] != '-')
+        {
+            cached = true;
+            shift_words(list);
+        }
+        char **words = list->argv;
+        if (stages[prepared].words.count == 0)
+        {
+            print_error("Syntax error: empty command in pipeline.");
+            last_status = 2;
+            prepared++;
+            break;
+        }
+        if (!resolve_executable(words[0]))
+        {
+            report_unknown_command(words[0]);
+            prepared++;
+            break;
+        }
     }
+
+    if (prepared == count && cached)
+        run_cached(stages, count, text, background);
+    else if (prepared == count)
+        execute_bin(stages, count, text, background, NULL);
+    for (int i = 0; i < prepared; i++)
+        free_words(&stages[i].words);
+    free(stages);
 }
 
-void add_to_scroll_history(Scroll_History *history, char *data)
+void report_unknown_command(const char *token)
 {
-    if (history->length < MAX_SCROLLBACK)
-        // Add new command to history
-        strcpy(history->data[history->length++], data);
-    else
+    print_error("`%s` command is unknown! Type `help` for a list of valid commands.", token);
+    last_status = 127;
+}
+
+// Newest match in scrollback lines before `line`, or in `line` itself starting before `column`
+static bool find_older_match(long line, size_t column)
+{
+    for (long i = line; i >= 0; i--)
     {
-        // Shift commands to make room for the new one
-        for (size_t i = 0; i < MAX_SCROLLBACK - 1; i++)
+        if ((size_t)i >= scroll_his.length)
+            continue;
+        const char *text = get_scroll_line(&scroll_his, i);
+        size_t len = scroll_line_length(i);
+        if (i == line && column + search.length - 1 < len)
+            len = column + search.length - 1; // Only matches that start before `column`
+
+        // The kernel finds the first match, so walk forward to the last one
+        const char *last = NULL;
+        const char *m = text;
+        while ((m = find_substring(m, text + len - m, search.query, search.length)) != NULL)
+            last = m++;
+        if (last)
         {
-            strcpy(history->data[i], history->data[i + 1]);
+            search.line = i;
+            search.column = last - text;
+            return true;
         }
-        strcpy(history->data[MAX_SCROLLBACK - 1], data);
     }
+    return false;
 }
 
-void redraw_output(Scroll_History *history, int offset)
+// Oldest match in scrollback lines after `line`, or in `line` itself starting after `column`
+static bool find_newer_match(long line, size_t column)
 {
-    werase(output_win); // Clear the window
+    for (size_t i = line < 0 ? 0 : line; i < scroll_his.length; i++)
+    {
+        const char *text = get_scroll_line(&scroll_his, i);
+        size_t skip = (long)i == line ? column + 1 : 0;
+        size_t len = scroll_line_length(i);
+        if (skip >= len)
+            continue;
+
+        const char *m = find_substring(text + skip, len - skip, search.query, search.length);
+        if (m)
+        {
+            search.line = i;
+            search.column = m - text;
+            return true;
+        }
+    }
+    return false;
+}
 
-    size_t l = 0;
-    int start = history->length - LINES - offset + 2;
-    for (int i = start; i < history->length; i++)
+// Bring the current match on screen, near the middle if the view has to move, and
+// redraw every row so the highlights follow the query
+static void show_search_match(int *offset)
+{
+    if (search.line != -1)
     {
-        mvwprintw(output_win, l++, 0, "%s", history->data[i]);
+        Wrap_Position match = {search.line, search.column / COLS};
+        build_wrap_index(&view.index, &scroll_his, view.top, LINES - 1, COLS);
+        bool shown = false;
+        for (int r = 0; r < view.index.count && !shown; r++)
+            shown = view.index.rows[r].line == match.line && view.index.rows[r].row == match.row;
+        if (!shown)
+        {
+            wrap_move(&scroll_his, &match, -(LINES - 1) / 2, COLS);
+            Wrap_Position bottom = view_bottom();
+            view.top = wrap_before(bottom, match) ? bottom : match;
+            *offset = scroll_his.length - view.top.line;
+        }
     }
+    redraw_output();
 }
 
-// Process command
-void handle_command(char *command, int *history_index, int *index, int *scroll_offset)
+// Draw the search bar on the bottom row with the cursor after the query
+static void draw_search_bar(bool found)
 {
-    // Make a copy of the original command so strtok doesn't modify it
-    char command_copy[strlen(command) + 1];
-    strcpy(command_copy, command);
+    werase(status_win);
+    mvwprintw(status_win, 0, 0, "/%s", search.query);
+    if (search.length && !found)
+        wprintw(status_win, "  (no match)");
+    else if (search.length)
+        wprintw(status_win, "  (line %ld of %zu)", search.line + 1, scroll_his.length);
+    wmove(status_win, 0, 1 + search.length);
+    wrefresh(output_win);
+    wrefresh(status_win); // Last, so the cursor ends up in the search bar
+}
 
-    char *token = strtok(command_copy, " ");
-    if (token)
+// Ctrl-F, or `/` while scrolled back: find text in the scrollback as it is typed. Up or
+// Ctrl-F goes to the previous (older) match, Down to the next (newer) one. Enter leaves
+// the view on the match, Esc or Ctrl-G goes back to the prompt.
+void search_scrollback(int *offset)
+{
+    // The search works on the scrolled view, starting from the bottom
+    if (*offset < 0)
     {
-        if (strcmp("about", token) == 0)
-            execute_about();
-        else if (strcmp("greet", token) == 0)
-            execute_greet(strtok(NULL, ""));
-        else if (strcmp("clear", token) == 0)
-            execute_clear(history_index, index, scroll_offset);
-        else if (strcmp("echo", token) == 0)
-            execute_echo(strtok(NULL, ""));
-        else if (strcmp("time", token) == 0)
-            execute_time();
-        else if (strcmp("cd", token) == 0)
+        view.top = view_bottom();
+        *offset = scroll_his.length - view.top.line;
+        redraw_output();
+    }
+
+    search.query[0] = '\0';
+    search.length = 0;
+    search.line = -1;
+    bool found = false;
+    draw_search_bar(found);
+
+    while (1)
+    {
+        int ch = read_key();
+        if (ch == KEY_UP || ch == KEY_CTRL_F)
         {
-            if (chdir(strtok(NULL, " ")) == -1)
+            if (found && find_older_match(search.line, search.column))
+                show_search_match(offset);
+        }
+        else if (ch == KEY_DOWN)
+        {
+            if (found && find_newer_match(search.line, search.column))
+                show_search_match(offset);
+        }
+        else if (ch == KEY_BACKSPACE || (ch >= 32 && ch <= 126))
+        {
+            long line = (long)scroll_his.length;
+            size_t column = 0;
+            if (ch == KEY_BACKSPACE)
+            {
+                if (search.length > 0)
+                    search.query[--search.length] = '\0';
+            }
+            else if (search.length < MAX_INPUT - 1)
             {
-                adjust_window();
-                mvwprintw(output_win, line, 0, "%s", strerror(errno));
+                search.query[search.length++] = ch;
+                search.query[search.length] = '\0';
+                if (found)
+                {
+                    // A longer query can still match where the last one did
+                    line = search.line;
+                    column = search.column + 1;
+                }
             }
+
+            found = search.length && find_older_match(line, column);
+            if (!found)
+                search.line = -1;
+            show_search_match(offset);
         }
-        else if (strcmp("pwd", token) == 0)
+        else if (ch == '\n' || ch == KEY_ESC || ch == KEY_CTRL_G)
         {
-            adjust_window();
-            char *cwd = getcwd(NULL, 0);
-            mvwprintw(output_win, line, 0, "%s", cwd);
-            free(cwd); // Free memory allocated by getcwd
+            search.length = 0;
+            werase(status_win);
+            wrefresh(status_win);
+
+            if (ch != '\n')
+                view.top = view_bottom(); // Enter stays on the match, the others go back to the bottom
+            redraw_output();
+            if (!wrap_before(view.top, view_bottom()))
+                leave_view(offset); // At the bottom, give the prompt back
+            wrefresh(output_win);
+            return;
         }
-        else if (check_bins(token, command))
-            execute_bin(command); // Pass original command here
-        else
+        draw_search_bar(found);
+    }
+}
+
+// Show a note in the status row until the next key
+static void show_status_note(const char *text)
+{
+    werase(status_win);
+    mvwprintw(status_win, 0, 0, "%s", text);
+    wrefresh(status_win);
+    status_note = true;
+}
+
+// Print the matches in columns above the prompt, one screen at a time. Each page goes
+// through the scrollback like any other output, so earlier rows just scroll up.
+static void list_completions(const Completions *completions)
+{
+    // The names point into a directory's trie, which a listing merged while waiting for
+    // the next page frees, so the pager works on its own copy of them
+    size_t pool_size = 0;
+    for (size_t i = 0; i < completions->count; i++)
+        pool_size += strlen(completions->names[i]) + 1;
+    char *pool = xmalloc(pool_size);
+    const char **names = xmalloc(completions->count * sizeof(char *));
+    for (size_t i = 0, used = 0; i < completions->count; i++)
+    {
+        size_t len = strlen(completions->names[i]) + 1;
+        names[i] = memcpy(pool + used, completions->names[i], len);
+        used += len;
+    }
+    Completions copy = *completions;
+    copy.names = names;
+    completions = &copy;
+
+    size_t width = 0;
+    for (size_t i = 0; i < completions->count; i++)
+    {
+        size_t len = strlen(completions->names[i]) + completion_is_dir(completions, i, false);
+        if (len > width)
+            width = len;
+    }
+    width += 2;
+    size_t columns = width < (size_t)COLS ? COLS / width : 1;
+    size_t rows = (completions->count + columns - 1) / columns;
+    size_t page = LINES - 2; // Rows that fit above the prompt
+
+    size_t pending = 0;
+    for (size_t r = 0; r < rows; r++)
+    {
+        char text[LINE_LENGTH];
+        size_t len = 0;
+        for (size_t c = 0; c < columns && r * columns + c < completions->count; c++)
+        {
+            size_t i = r * columns + c;
+            int n = snprintf(text + len, sizeof(text) - len, "%s%s", completions->names[i], completion_is_dir(completions, i, false) ? "/" : "");
+            if (n < 0 || (size_t)n >= sizeof(text) - len)
+                break;
+            len += n;
+            while (len < (c + 1) * width && len < sizeof(text) - 1)
+                text[len++] = ' ';
+        }
+        text[len] = '\0';
+        add_to_scroll_history(&scroll_his, text);
+
+        if (++pending < page && r + 1 < rows)
+            continue;
+        show_lines_above_prompt(pending);
+        pending = 0;
+        if (r + 1 < rows)
         {
-            adjust_window();
-            unsigned int len = strlen(token) + strlen("`` command is unknown! Type `help` for a list of valid commands.");
-            char *error_msg = malloc(len);
-            snprintf(error_msg, len, "`%s` command is unknown! Type `help` for a list of valid commands.", token);
-            mvwprintw(output_win, line, 0, "%s", error_msg);
-            add_to_scroll_history(&scroll_his, error_msg);
-            free(error_msg);
+            char more[LINE_LENGTH];
+            snprintf(more, sizeof(more), "--More-- %zu of %zu rows, Space for the next page", r + 1, rows);
+            show_status_note(more);
+            int ch = read_key();
+            werase(status_win);
+            wrefresh(status_win);
+            status_note = false;
+            wrefresh(output_win); // Put the cursor back on the prompt
+            if (ch != ' ')
+                break;
         }
     }
+    free(names);
+    free(pool);
 }
 
-void handle_scroll_reset(int *offset, char *prompt, char *data, int index)
+// The line as it was when a Tab had to wait for a directory, NULL when none is waiting
+static struct
+{
+    char *text;
+    size_t length;
+    size_t cursor;
+} tab_wait;
+
+// The directory a Tab waited for has been read. If the line is still as the Tab left it,
+// press Tab again for the user.
+void completion_ready(void)
+{
+    Line_Editor *editor = prompt_line.editor;
+    bool same = tab_wait.text && prompt_line.live && editor->prompt == shell_prompt.text &&
+                editor_length(editor) == tab_wait.length && editor_cursor(editor) == tab_wait.cursor &&
+                memcmp(editor_text(editor), tab_wait.text, tab_wait.length) == 0;
+    free(tab_wait.text);
+    tab_wait.text = NULL;
+    if (same)
+        ungetch(KEY_TAB); // Taken by read_key() as if it was typed
+}
+
+// Tab: extend the word before the cursor as far as every match agrees, adding a space or a
+// slash once only one match is left. With nothing to add the matches are listed.
+void complete_input(Line_Editor *editor)
+{
+    static Completions completions;
+    free(tab_wait.text);
+    tab_wait.text = NULL;
+
+    const char *text = editor_text(editor);
+    size_t start = editor_cursor(editor);
+    while (start > 0 && text[start - 1] != ' ')
+        start--;
+    bool command = strspn(text, " ") >= start; // Nothing but spaces before it
+    const char *word = text + start;
+    size_t len = editor_cursor(editor) - start;
+    if (memchr(word, '/', len))
+        command = false;
+
+    bool found = find_completions(word, len, command, &completions);
+    if (completions.partial)
+    {
+        // The directory is still being read, completion_ready() comes back once it is
+        tab_wait.length = editor_length(editor);
+        tab_wait.cursor = editor_cursor(editor);
+        tab_wait.text = memcpy(xmalloc(tab_wait.length + 1), editor_text(editor), tab_wait.length + 1);
+        char note[sizeof(completions.dir) + 64];
+        snprintf(note, sizeof(note), "Reading %s...", completions.dir);
+        show_status_note(note);
+        return;
+    }
+    if (!found)
+        return;
+
+    // Matches come out sorted, so the first and last share the longest common prefix
+    const char *first = completions.names[0];
+    const char *last = completions.names[completions.count - 1];
+    size_t typed = len - completions.base;
+    size_t common = typed;
+    while (first[common] && first[common] == last[common])
+        common++;
+
+    size_t n = common - typed;
+    char insert[n + 1];
+    memcpy(insert, first + typed, n);
+    if (completions.count == 1)
+        insert[n++] = completion_is_dir(&completions, 0, true) ? '/' : ' ';
+
+    if (n == 0)
+    {
+        if (completions.count > 1)
+            list_completions(&completions);
+        return;
+    }
+
+    editor_insert(editor, insert, n);
+}
+
+// Typing while scrolled back returns the view to the prompt first
+void handle_scroll_reset(int *offset)
 {
     if (*offset >= 0)
+        scroll_view(offset, SCROLL_NEWEST);
+}
+
+// Paint output that arrived while the user was typing, then put the prompt back under it
+void show_lines_above_prompt(size_t count)
+{
+    if (*prompt_line.scroll_offset >= 0)
     {
-        *offset = 0;                                                  // Reset scroll offset
-        redraw_output(&scroll_his, *offset);                          // Redraw output with new offset
-        mvwprintw(output_win, LINES - 2, 0, "%s", prompt);            // Redraw prompt on the last visible line
-        mvwprintw(output_win, LINES - 2, strlen(prompt), "%s", data); // Redraw current input line
-        wmove(output_win, LINES - 2, strlen(prompt) + index);         // Move cursor to end of input line
+        // Scrolled back: keep the same lines in view, the new ones show up on the way down
+        if (view.top.line > scroll_his.length)
+        {
+            // The lines on screen were pushed out of the scrollback
+            view.top = (Wrap_Position){0, 0};
+            redraw_output();
+            wrefresh(output_win);
+        }
+        *prompt_line.scroll_offset = scroll_his.length - view.top.line;
+        return;
     }
+
+    editor_erase(prompt_line.editor);
+    line = (line < 0 ? 0 : line) - 1; // Let the output take over the prompt's rows
+    show_new_lines(count);
+
+    adjust_window();
+    editor_draw(prompt_line.editor);
+    wrefresh(output_win);
 }
 
-bool shell_at_bottom(void) { return line == LINES - 2; }
+bool shell_at_bottom(void) { return editor_last_row(prompt_line.editor) >= LINES - 2; }
 
-bool check_bins(char *token, char *command)
+// The terminal changed size: fit the windows to it, tell the jobs drawing into ptys, and
+// paint the screen again. Only the rows on screen are wrapped at the new width, so this is
+// as quick with millions of lines of scrollback as with none.
+void resize_window(bool prompt_shown)
 {
-    char *bins[NUM_COMMANDS] = {"ls", "mv", "mkdir", "cp", "rm", "rmdir", "touch", "cat", "find", "grep", "gzip", "gunzip", "tar", "whoami"};
-    for (int i = 0; i < NUM_COMMANDS; i++)
-        if (strcmp(token, bins[i]) == 0)
-            return true;
-    return false;
-}
\ No newline at end of file
+    struct winsize size;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_row >= 2 && size.ws_col > 0)
+        resize_term(size.ws_row, size.ws_col); // Not resizeterm(), which queues a KEY_RESIZE
+    wresize(output_win, LINES - 1, COLS);
+    wresize(status_win, 1, COLS);
+    mvwin(status_win, LINES - 1, 0);
+    werase(status_win);
+    wnoutrefresh(status_win);
+    resize_jobs(LINES - 1, COLS); // Background jobs draw into the output window too
+    clearok(curscr, TRUE);        // The terminal may have moved what it showed around
+
+    werase(output_win);
+    if (*prompt_line.scroll_offset >= 0)
+    {
+        // Same first line on top, on the row holding the column that was there before
+        if (view.index.width > 0)
+            view.top.row = view.top.row * view.index.width / COLS;
+        if (view.top.line < scroll_his.length && view.top.row >= wrap_line_rows(&scroll_his, view.top.line, COLS))
+            view.top.row = wrap_line_rows(&scroll_his, view.top.line, COLS) - 1;
+        Wrap_Position bottom = view_bottom();
+        if (wrap_before(bottom, view.top))
+            view.top = bottom;
+        redraw_output();
+        if (!wrap_before(view.top, bottom))
+            leave_view(prompt_line.scroll_offset);
+    }
+    else
+    {
+        // The newest rows fill the window from the top, and the prompt goes under them
+        Wrap_Position oldest = {scroll_his.length, 0};
+        int rows = -wrap_move(&scroll_his, &oldest, -(LINES - 1), COLS);
+        if (prompt_shown)
+        {
+            line = rows < LINES - 2 ? rows : LINES - 2;
+            editor_redraw(prompt_line.editor);
+        }
+        else
+        {
+            paint_tail(rows);
+            line = rows - 1;
+        }
+    }
+    wrefresh(output_win);
+}
+
+// The words after the name, as one string for the builtins that print them
+static void builtin_greet(const Word_List *words, Shell_State *state)
+{
+    char *name = join_words(words, 1);
+    execute_greet(name);
+    free(name);
+}
+
+static void builtin_echo(const Word_List *words, Shell_State *state)
+{
+    char *message = join_words(words, 1);
+    execute_echo(message);
+    free(message);
+}
+
+static void builtin_about(const Word_List *words, Shell_State *state) { execute_about(); }
+static void builtin_clear(const Word_List *words, Shell_State *state) { execute_clear(state->history_index, state->scroll_offset); }
+static void builtin_time(const Word_List *words, Shell_State *state) { execute_time(); }
+static void builtin_cd(const Word_List *words, Shell_State *state) { execute_cd(words->argv[1]); }
+static void builtin_pwd(const Word_List *words, Shell_State *state) { execute_pwd(); }
+static void builtin_jobs(const Word_List *words, Shell_State *state) { execute_jobs(); }
+static void builtin_fg(const Word_List *words, Shell_State *state) { execute_fg(words->argv[1]); }
+static void builtin_bg(const Word_List *words, Shell_State *state) { execute_bg(words->argv[1]); }
+static void builtin_stats(const Word_List *words, Shell_State *state) { execute_stats(words->argv + 1); }
+static void builtin_parallel(const Word_List *words, Shell_State *state) { execute_parallel(words->argv + 1); }
+static void builtin_cached(const Word_List *words, Shell_State *state) { execute_cached(words->argv + 1); }
+
+// Builtins share the command index with $PATH, so dispatch is a single hash lookup
+void register_builtins(void)
+{
+    add_builtin("about", builtin_about);
+    add_builtin("greet", builtin_greet);
+    add_builtin("clear", builtin_clear);
+    add_builtin("echo", builtin_echo);
+    add_builtin("time", builtin_time);
+    add_builtin("cd", builtin_cd);
+    add_builtin("pwd", builtin_pwd);
+    add_builtin("jobs", builtin_jobs);
+    add_builtin("fg", builtin_fg);
+    add_builtin("bg", builtin_bg);
+    add_builtin("stats", builtin_stats);
+    add_builtin("parallel", builtin_parallel);
+    add_builtin("cached", builtin_cached);
+    add_fast_path("cat", fast_cat);
+    add_fast_path("ls", fast_ls);
+    add_fast_path("grep", fast_grep);
+}
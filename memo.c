@@ -0,0 +1,369 @@
+#define _GNU_SOURCE // dirfd
+
+#include <dirent.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "command_index.h"
+#include "jobs.h"
+#include "memo.h"
+#include "output.h"
+#include "stats.h"
+
+// `cached CMD ...`: the output of a command that only reads is kept on disk, keyed on what
+// it was asked and the state of the files it reads, and replayed instead of running the
+// command again while none of that changes. Each entry is a file named by a hash of its
+// key. Its mtime says when it was last used, and the least recently used entries are
+// removed once the total passes the budget.
+
+static struct
+{
+    char dir[4096];        // Entry directory, "" until the first cached command
+    long long bytes;       // Total size of the entries, -1 until the directory is scanned
+    size_t entries;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long uncached; // Ran without the cache: background, redirected or not cacheable
+    unsigned long evicted;
+} memo = {.bytes = -1};
+
+static void *xrealloc(void *p, size_t size)
+{
+    p = realloc(p, size);
+    if (p == NULL)
+    {
+        perror("Error allocating the result cache");
+        endwin();
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+static void key_add(Line_Buffer *key, const char *data, size_t len)
+{
+    if (key->length + len > key->size)
+    {
+        key->size = key->size ? key->size * 2 : 1024;
+        if (key->size < key->length + len)
+            key->size = key->length + len;
+        key->data = xrealloc(key->data, key->size);
+    }
+    memcpy(key->data + key->length, data, len);
+    key->length += len;
+}
+
+static bool write_all(int fd, const void *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        data = (const char *)data + n;
+        len -= n;
+    }
+    return true;
+}
+
+static long long memo_budget(void)
+{
+    const char *env = getenv(MEMO_BUDGET_ENV);
+    if (env && strtoul(env, NULL, 10) > 0)
+        return strtoull(env, NULL, 10) * 1024 * 1024;
+    return DEFAULT_MEMO_BUDGET;
+}
+
+// Find or make the entry directory, $XDG_CACHE_HOME/my-shell or ~/.cache/my-shell
+static bool open_memo_dir(void)
+{
+    if (memo.dir[0])
+        return true;
+
+    char path[sizeof(memo.dir)];
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    int n = -1;
+    if (xdg && xdg[0] == '/')
+        n = snprintf(path, sizeof(path), "%s", xdg);
+    else if (home)
+        n = snprintf(path, sizeof(path), "%s/.cache", home);
+    if (n > 0 && (size_t)n < sizeof(path))
+    {
+        mkdir(path, 0700); // Usually there already
+        n = snprintf(path + n, sizeof(path) - n, "/%s", MEMO_DIR) + n;
+    }
+    if (n < 0 || (size_t)n >= sizeof(path) || (mkdir(path, 0700) == -1 && errno != EEXIST))
+        return false;
+    strcpy(memo.dir, path);
+    return true;
+}
+
+static int compare_used(const void *a, const void *b)
+{
+    const Memo_Entry *x = a, *y = b;
+    if (x->used.tv_sec != y->used.tv_sec)
+        return x->used.tv_sec < y->used.tv_sec ? -1 : 1;
+    return (x->used.tv_nsec > y->used.tv_nsec) - (x->used.tv_nsec < y->used.tv_nsec);
+}
+
+// Add up the entries on disk and remove the least recently used until they fit in `budget`.
+// Other shells share the directory, so the total is only trusted until the next scan.
+static void evict_entries(long long budget)
+{
+    DIR *d = opendir(memo.dir);
+    if (d == NULL)
+        return;
+
+    Memo_Entry *entries = NULL;
+    size_t count = 0, size = 0;
+    long long total = 0;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL)
+    {
+        struct stat st;
+        if (strlen(e->d_name) != MEMO_NAME_LENGTH || fstatat(dirfd(d), e->d_name, &st, 0) == -1 || !S_ISREG(st.st_mode))
+            continue; // Also skips entries still being written, which have longer names
+        if (count == size)
+        {
+            size = size ? size * 2 : 64;
+            entries = xrealloc(entries, size * sizeof(Memo_Entry));
+        }
+        entries[count] = (Memo_Entry){.used = st.st_mtim, .size = st.st_size};
+        strcpy(entries[count].name, e->d_name);
+        count++;
+        total += st.st_size;
+    }
+
+    if (total > budget)
+    {
+        qsort(entries, count, sizeof(Memo_Entry), compare_used);
+        for (size_t i = 0; i < count && total > budget; i++)
+            if (unlinkat(dirfd(d), entries[i].name, 0) == 0)
+            {
+                total -= entries[i].size;
+                count--;
+                memo.evicted++;
+            }
+    }
+    closedir(d);
+    free(entries);
+    memo.bytes = total;
+    memo.entries = count;
+}
+
+// Add the identity and state of `path` to the key. Returns true when it changed too
+// recently to be trusted: file times only move every few milliseconds, so a change in the
+// same tick as the last one would leave them as they are.
+static bool add_file_state(Line_Buffer *key, const char *path, const struct timespec *now)
+{
+    struct stat st;
+    if (path == NULL || stat(path, &st) == -1)
+        return false;
+
+    char state[160];
+    int n = snprintf(state, sizeof(state), "%llu:%llu:%lld:%lld.%09ld:%lld.%09ld",
+                     (unsigned long long)st.st_dev, (unsigned long long)st.st_ino, (long long)st.st_size,
+                     (long long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec, (long long)st.st_ctim.tv_sec, st.st_ctim.tv_nsec);
+    key_add(key, path, strlen(path) + 1);
+    key_add(key, state, n + 1);
+
+    long long changed = st.st_ctim.tv_sec * 1000000000LL + st.st_ctim.tv_nsec; // ctime moves with mtime
+    return now->tv_sec * 1000000000LL + now->tv_nsec - changed < MEMO_RACY_NS;
+}
+
+// Environment variables that commonly change what a command prints, part of every key
+static const char *const key_env[] = {"TERM", "COLUMNS", "LS_COLORS", "NO_COLOR", "CLICOLOR", "LANG",
+                                      "LC_ALL", "LC_CTYPE", "LC_COLLATE", "LC_MESSAGES", "LC_TIME", "LC_NUMERIC"};
+
+// Everything the output depends on as far as the shell can tell: the words, the working
+// directory, whether the command writes to a pty and how wide it is, the environment
+// variables in key_env, and the inode, size and times of the executable, the working directory, each
+// argument that names a file and a file redirected into stdin. A directory stands for its
+// own entries only, not for the files below it. Returns true if any of them is too fresh
+// for the output to be kept.
+static bool build_key(Line_Buffer *key, const Stage *stage, const char *cwd)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    char count[24];
+    key_add(key, count, snprintf(count, sizeof(count), "%zu", stage->words.count) + 1);
+    key_add(key, cwd, strlen(cwd) + 1);
+    for (size_t i = 0; i < stage->words.count; i++)
+        key_add(key, stage->words.argv[i], strlen(stage->words.argv[i]) + 1);
+
+    // Commands run on a pty as wide as the screen when interactive and on a pipe otherwise,
+    // and many of them color, wrap or columnate their output by that
+    char mode[24];
+    key_add(key, mode, snprintf(mode, sizeof(mode), "%s:%d", output->interactive ? "pty" : "pipe",
+                                output->interactive ? COLS : 0) + 1);
+    for (size_t i = 0; i < sizeof(key_env) / sizeof(key_env[0]); i++)
+    {
+        const char *value = getenv(key_env[i]);
+        key_add(key, key_env[i], strlen(key_env[i])); // NAME=value, or just NAME when unset
+        if (value)
+        {
+            key_add(key, "=", 1);
+            key_add(key, value, strlen(value));
+        }
+        key_add(key, "", 1);
+    }
+
+    bool racy = add_file_state(key, resolve_executable(stage->words.argv[0]), &now);
+    racy |= add_file_state(key, ".", &now);
+    for (size_t i = 1; i < stage->words.count; i++)
+        if (stage->words.argv[i][0] != '-')
+            racy |= add_file_state(key, stage->words.argv[i], &now);
+    for (size_t i = 0; i < stage->redirections.count; i++)
+        if (stage->redirections.list[i].fd == STDIN_FILENO)
+            racy |= add_file_state(key, stage->redirections.list[i].path, &now);
+    return racy;
+}
+
+// FNV-1a, only used to name the entry. The whole key is kept in it and compared.
+static uint64_t hash_key(const Line_Buffer *key)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < key->length; i++)
+        hash = (hash ^ (unsigned char)key->data[i]) * 1099511628211ULL;
+    return hash;
+}
+
+// Show the output stored at `path` if its key is `key`, straight from the mapped file into
+// scrollback, and mark it used. Returns false on a miss.
+static bool replay_entry(const char *path, const Line_Buffer *key)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return false;
+
+    struct stat st;
+    Memo_Header header;
+    bool hit = fstat(fd, &st) == 0 && pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+               memcmp(header.magic, MEMO_MAGIC, sizeof(header.magic)) == 0 && header.key_length == key->length &&
+               sizeof(header) + header.key_length + header.output_length == (uint64_t)st.st_size;
+    char *map = hit ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    hit = map != MAP_FAILED && memcmp(map + sizeof(header), key->data, key->length) == 0;
+    if (hit)
+    {
+        futimens(fd, NULL); // The mtime is the LRU clock
+        Line_Buffer stored = {.data = map + sizeof(header) + header.key_length, .length = header.output_length};
+        show_captured_output(&stored, true);
+        last_status = header.status;
+    }
+    if (map != MAP_FAILED)
+        munmap(map, st.st_size);
+    close(fd);
+    return hit;
+}
+
+// Write an entry under a temporary name and rename it into place, so a reader never sees
+// half of one
+static void store_entry(const char *path, const Line_Buffer *key, const Line_Buffer *out, int status, long long budget)
+{
+    long long size = sizeof(Memo_Header) + key->length + out->length;
+    if (size > budget)
+        return;
+
+    char temp[strlen(path) + 32];
+    snprintf(temp, sizeof(temp), "%s.%d.tmp", path, (int)getpid());
+    int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1)
+        return;
+    Memo_Header header = {.key_length = key->length, .status = status, .output_length = out->length};
+    memcpy(header.magic, MEMO_MAGIC, sizeof(header.magic));
+    bool written = write_all(fd, &header, sizeof(header)) && write_all(fd, key->data, key->length) &&
+                   write_all(fd, out->data, out->length);
+    written &= close(fd) == 0;
+
+    struct stat old;
+    bool replaced = stat(path, &old) == 0;
+    if (!written || rename(temp, path) == -1)
+    {
+        unlink(temp);
+        return;
+    }
+    memo.bytes += size - (replaced ? old.st_size : 0);
+    memo.entries += !replaced;
+    if (memo.bytes > budget)
+        evict_entries(budget);
+}
+
+// Run one command through the cache: replay its output if an entry matches, otherwise run
+// it, showing the output as usual, and keep what it wrote. Pipelines, background commands
+// and ones whose output is redirected just run.
+void run_cached(Stage stages[], int count, const char *command, bool background)
+{
+    Stage *stage = &stages[0];
+    bool redirected = count > 1;
+    for (size_t i = 0; i < stage->redirections.count; i++)
+        redirected |= stage->redirections.list[i].fd != STDIN_FILENO;
+    char cwd[4096];
+    if (background || redirected || !open_memo_dir() || getcwd(cwd, sizeof(cwd)) == NULL)
+    {
+        memo.uncached++;
+        execute_bin(stages, count, command, background, NULL);
+        return;
+    }
+
+    long long budget = memo_budget();
+    if (memo.bytes < 0)
+        evict_entries(budget);
+    long long start = monotonic_ns();
+    Line_Buffer key = {0};
+    bool racy = build_key(&key, stage, cwd);
+    char path[sizeof(memo.dir) + 32];
+    snprintf(path, sizeof(path), "%s/%0*llx", memo.dir, MEMO_NAME_LENGTH, (unsigned long long)hash_key(&key));
+
+    if (replay_entry(path, &key))
+    {
+        memo.hits++;
+        record_command(command, start, monotonic_ns(), NULL);
+    }
+    else
+    {
+        memo.misses++;
+        Output_Record record = {.limit = budget, .complete = true};
+        execute_bin(stage, 1, command, false, &record);
+
+        // Runs that could not start, or were interrupted, stopped or killed, are not kept
+        if (record.complete && !racy && last_status < 126)
+            store_entry(path, &key, &record.output, last_status, budget);
+        if (!output->interactive)
+            show_captured_output(&record.output, true);
+        free(record.output.data);
+    }
+    free(key.data);
+}
+
+// cached             hits, misses and how much the cache holds
+// cached -c          remove every entry
+// cached CMD ...     run CMD through the cache, see run_cached
+void execute_cached(char **args)
+{
+    if (args[0] && strcmp(args[0], "-c") == 0 && args[1] == NULL)
+    {
+        if (open_memo_dir())
+            evict_entries(0);
+        return;
+    }
+    if (args[0])
+    {
+        print_error("usage: cached [-c | command [args...]]");
+        last_status = 2;
+        return;
+    }
+
+    long long budget = memo_budget();
+    if (open_memo_dir() && memo.bytes < 0)
+        evict_entries(budget);
+    unsigned long lookups = memo.hits + memo.misses;
+    print_line("cache:    %s", memo.dir[0] ? memo.dir : "unavailable");
+    print_line("hits:     %lu (%.0f%%)", memo.hits, lookups ? 100.0 * memo.hits / lookups : 0.0);
+    print_line("misses:   %lu", memo.misses);
+    print_line("uncached: %lu", memo.uncached);
+    print_line("evicted:  %lu", memo.evicted);
+    print_line("stored:   %zu entries, %.1f of %.0f MB", memo.entries, (memo.bytes > 0 ? memo.bytes : 0) / 1048576.0,
+               budget / 1048576.0);
+}
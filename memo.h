@@ -0,0 +1,36 @@
+#ifndef MEMO_H
+#define MEMO_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "commands.h"
+
+#define MEMO_BUDGET_ENV "MY_SHELL_CACHE_MB"      // Overrides the disk budget, in megabytes
+#define DEFAULT_MEMO_BUDGET (256LL * 1024 * 1024) // Bytes of cached output kept on disk
+#define MEMO_DIR "my-shell"                      // Created in $XDG_CACHE_HOME or ~/.cache
+#define MEMO_MAGIC "MYSHMEM1"                    // First bytes of every entry, with its version
+#define MEMO_NAME_LENGTH 16                      // Hex digits of the key hash naming an entry
+#define MEMO_RACY_NS (20 * 1000 * 1000)          // Output of files changed this recently is not kept
+
+// Start of an entry file, followed by the key and then the output as the command wrote it
+typedef struct
+{
+    char magic[8];
+    uint32_t key_length;
+    int32_t status;         // Exit status to replay
+    uint64_t output_length;
+} Memo_Header;
+
+// One entry found when scanning the directory for eviction
+typedef struct
+{
+    struct timespec used; // mtime, bumped on every hit
+    off_t size;
+    char name[MEMO_NAME_LENGTH + 1];
+} Memo_Entry;
+
+// Function prototypes
+void run_cached(Stage stages[], int count, const char *command, bool background);
+void execute_cached(char **args);
+
+#endif // MEMO_H
@@ -0,0 +1,301 @@
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include "commands.h"
+#include "output.h"
+#include "ansi.h"
+#include "redirect.h"
+
+// Keep the line in scrollback and paint it below the last one, wrapped over as many rows
+// as it needs
+static void curses_write_line(const char *text, size_t len)
+{
+    add_to_scroll_history_n(&scroll_his, text, len);
+    show_new_lines(1);
+}
+
+static void curses_flush(void)
+{
+    wrefresh(output_win);
+}
+
+static void curses_clear(void)
+{
+    line = -1; // Reset the line to the top
+    clear_scroll_history(&scroll_his);
+    werase(output_win);   // Clear the window
+    wrefresh(output_win); // Refresh to clear the screen
+}
+
+const Output_Backend curses_output = {curses_write_line, curses_flush, curses_clear, true, -1};
+
+// Color pair for a run's colors, set up the first time it is drawn. Pair 0 (the
+// terminal's own colors) when the terminal has none or the pairs have run out.
+static short color_pair(uint8_t fg, uint8_t bg)
+{
+    static short pairs[17][17]; // By run color, 0 when not set up yet
+    static short next_pair = 1;
+    if (!has_colors() || (fg == 0 && bg == 0))
+        return 0;
+    if (pairs[fg][bg] == 0 && next_pair < COLOR_PAIRS)
+    {
+        init_pair(next_pair, fg - 1, bg - 1); // Run color 0 becomes -1, the default color
+        pairs[fg][bg] = next_pair++;
+    }
+    return pairs[fg][bg];
+}
+
+static attr_t run_attributes(const Attr_Run *run, short *pair)
+{
+    attr_t attrs = A_NORMAL;
+    if (run->flags & ATTR_BOLD)
+        attrs |= A_BOLD;
+    if (run->flags & ATTR_DIM)
+        attrs |= A_DIM;
+    if (run->flags & ATTR_ITALIC)
+        attrs |= A_ITALIC;
+    if (run->flags & ATTR_UNDERLINE)
+        attrs |= A_UNDERLINE;
+    if (run->flags & ATTR_BLINK)
+        attrs |= A_BLINK;
+    if (run->flags & ATTR_REVERSE)
+        attrs |= A_REVERSE;
+
+    // Without 16 colors the bright ones are drawn as bold normal ones
+    uint8_t fg = run->fg, bg = run->bg;
+    if (COLORS < 16 && fg > 8)
+    {
+        fg -= 8;
+        attrs |= A_BOLD;
+    }
+    if (COLORS < 16 && bg > 8)
+        bg -= 8;
+    *pair = color_pair(fg, bg);
+    return attrs;
+}
+
+// Draw the row of scrollback line `index` that starts at byte `column` on window row `row`,
+// each attribute run in its colors. Control bytes are drawn as spaces, so every byte is one
+// cell and the row is exactly what the wrap index expects.
+void draw_scroll_row(int row, size_t index, size_t column)
+{
+    const char *text = get_scroll_line(&scroll_his, index);
+    size_t length = get_scroll_line_length(&scroll_his, index);
+    size_t count;
+    const Attr_Run *runs = get_scroll_runs(&scroll_his, index, &count);
+    size_t cols = COLS;
+    if (column > length)
+        column = length;
+    size_t end = length - column < cols ? length : column + cols;
+
+    // The run in effect at `column` is the last one starting at or before it
+    size_t k = 0, high = count;
+    while (k < high)
+    {
+        size_t mid = (k + high) / 2;
+        if (runs[mid].column <= column)
+            k = mid + 1;
+        else
+            high = mid;
+    }
+    short pair = 0;
+    attr_t attrs = k > 0 ? run_attributes(&runs[k - 1], &pair) : A_NORMAL;
+
+    wmove(output_win, row, 0);
+    wclrtoeol(output_win);
+    char cells[cols];
+    for (size_t at = column; at < end;)
+    {
+        size_t stop = k < count && runs[k].column < end ? runs[k].column : end;
+        if (stop > at)
+        {
+            size_t n = stop - at;
+            for (size_t i = 0; i < n; i++)
+            {
+                unsigned char c = text[at + i];
+                cells[i] = c < 32 || c == 127 ? ' ' : c;
+            }
+            wattr_set(output_win, attrs, pair, NULL);
+
+            // Filling the last column with a plain add would scroll the window at the bottom
+            if (stop - column == cols)
+            {
+                if (n > 1)
+                    waddnstr(output_win, cells, n - 1);
+                mvwinsch(output_win, row, cols - 1, (unsigned char)cells[n - 1] | attrs | COLOR_PAIR(pair));
+            }
+            else
+                waddnstr(output_win, cells, n);
+            at = stop;
+        }
+        if (k < count && runs[k].column <= at)
+            attrs = run_attributes(&runs[k++], &pair);
+    }
+    wattr_set(output_win, A_NORMAL, 0, NULL);
+}
+
+// Headless output goes into one large stdio buffer and reaches stdout in big writes
+static void stdout_write_line(const char *text, size_t len)
+{
+    fwrite(text, 1, len, stdout);
+    putchar('\n');
+}
+
+static void stdout_flush(void)
+{
+    fflush(stdout);
+}
+
+static void stdout_clear(void)
+{
+    // Nothing to clear without a screen
+}
+
+const Output_Backend stdout_output = {stdout_write_line, stdout_flush, stdout_clear, false, STDOUT_FILENO};
+
+// Headless diagnostics go to stderr, after the output printed before them
+static void stderr_write_line(const char *text, size_t len)
+{
+    fflush(stdout);
+    fwrite(text, 1, len, stderr);
+    fputc('\n', stderr);
+}
+
+static void stderr_flush(void)
+{
+    fflush(stderr);
+}
+
+static const Output_Backend stderr_output = {stderr_write_line, stderr_flush, stdout_clear, false, STDERR_FILENO};
+
+// A builtin's output redirected to a file, gathered into one buffer and written in big
+// writes like stdout
+static char file_buffer[OUTPUT_BUFFER_SIZE];
+static size_t file_used;
+static Output_Backend file_output; // Defined below, once its functions are
+
+static void file_flush(void)
+{
+    for (size_t done = 0; done < file_used;)
+    {
+        ssize_t n = write(file_output.fd, file_buffer + done, file_used - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break; // Nowhere to report it, like a full disk under `echo >`
+        done += n;
+    }
+    file_used = 0;
+}
+
+static void file_append(const char *text, size_t len)
+{
+    while (len > 0)
+    {
+        if (file_used == sizeof(file_buffer))
+            file_flush();
+        size_t n = sizeof(file_buffer) - file_used < len ? sizeof(file_buffer) - file_used : len;
+        memcpy(file_buffer + file_used, text, n);
+        file_used += n;
+        text += n;
+        len -= n;
+    }
+}
+
+static void file_write_line(const char *text, size_t len)
+{
+    file_append(text, len);
+    file_append("\n", 1);
+}
+
+static Output_Backend file_output = {file_write_line, file_flush, stdout_clear, false, -1};
+
+const Output_Backend *output = &curses_output;
+
+// Where builtins report errors: the screen, or stderr when running a script. `2>` sends
+// them to a file instead and `2>&1` wherever the output goes.
+static const Output_Backend *errors = &curses_output;
+static int error_fd = -1;          // File of a `2>`, -1 when stderr is not redirected
+static bool errors_follow_output; // `2>&1`
+
+// Switch to stdout for script mode. Must run before anything is printed.
+void use_stdout_output(void)
+{
+    setvbuf(stdout, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+    output = &stdout_output;
+    errors = &stderr_output;
+}
+
+// Send builtin output to `out` and errors to `err` until restore_output(), as redirected_fd()
+// gives them: -1 leaves one where it is, and an `err` that is `out` or REDIRECT_TO_STDOUT
+// follows the output. The caller keeps `output` to restore.
+void redirect_output(int out, int err)
+{
+    output->flush(); // Anything already printed comes first
+    if (out != -1)
+    {
+        file_output.fd = out;
+        file_used = 0;
+        output = &file_output;
+    }
+    errors_follow_output = err == REDIRECT_TO_STDOUT || (err != -1 && err == out);
+    error_fd = errors_follow_output ? -1 : err;
+}
+
+void restore_output(const Output_Backend *previous)
+{
+    if (output == &file_output)
+        file_flush();
+    output = previous;
+    error_fd = -1;
+    errors_follow_output = false;
+}
+
+// Format into `buff`, cut to a line like the scrollback buffers it replaces. Returns the
+// length, negative on a format error.
+static int format_line(char *buff, size_t size, const char *format, va_list ap)
+{
+    int len = vsnprintf(buff, size, format, ap);
+    return len >= 0 && (size_t)len >= size ? (int)size - 1 : len;
+}
+
+// Format one line and hand it to the current backend
+void print_line(const char *format, ...)
+{
+    char buff[LINE_LENGTH];
+    va_list ap;
+    va_start(ap, format);
+    int len = format_line(buff, sizeof(buff), format, ap);
+    va_end(ap);
+    if (len >= 0)
+        output->write_line(buff, len);
+}
+
+// Format one diagnostic and send it where the builtin's stderr goes
+void print_error(const char *format, ...)
+{
+    char buff[LINE_LENGTH + 1]; // Room for the newline a file gets
+    va_list ap;
+    va_start(ap, format);
+    int len = format_line(buff, LINE_LENGTH, format, ap);
+    va_end(ap);
+    if (len < 0)
+        return;
+    if (errors_follow_output)
+        output->write_line(buff, len);
+    else if (error_fd == -1)
+        errors->write_line(buff, len);
+    else
+    {
+        buff[len++] = '\n';
+        for (int done = 0; done < len;)
+        {
+            ssize_t n = write(error_fd, buff + done, len - done);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break; // Nowhere left to report it
+            done += n;
+        }
+    }
+}
@@ -0,0 +1,32 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define OUTPUT_BUFFER_SIZE (256 * 1024) // stdout buffer in headless mode
+
+// Where builtins and the shell itself print: the curses window, or stdout when running
+// a script. Child processes are not routed through here.
+typedef struct
+{
+    void (*write_line)(const char *text, size_t len); // One line of output, without a newline
+    void (*flush)(void);                               // Make everything written so far visible
+    void (*clear_screen)(void);                        // Wipe the screen, for `clear`
+    bool interactive; // Children get a pipe back to the shell and the terminal is handed over
+    int fd;           // Descriptor the lines end up in, -1 for the screen
+} Output_Backend;
+
+extern const Output_Backend *output;
+extern const Output_Backend curses_output;
+extern const Output_Backend stdout_output;
+
+// Function prototypes
+void use_stdout_output(void);
+void redirect_output(int out, int err);
+void restore_output(const Output_Backend *previous);
+void print_line(const char *format, ...) __attribute__((format(printf, 1, 2)));
+void print_error(const char *format, ...) __attribute__((format(printf, 1, 2)));
+void draw_scroll_row(int row, size_t index, size_t column);
+
+#endif // OUTPUT_H
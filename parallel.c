@@ -0,0 +1,239 @@
+#define _GNU_SOURCE // pipe2, environ
+
+#include <stdio.h>
+#include "commands.h"
+#include "command_index.h"
+#include "output.h"
+#include "parallel.h"
+#include "stats.h"
+
+static void *xrealloc(void *p, size_t size)
+{
+    p = realloc(p, size);
+    if (p == NULL)
+    {
+        perror("Error allocating a parallel run");
+        endwin();
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+// `word` with every {} in it replaced by `arg`
+static char *fill_placeholders(const char *word, const char *arg)
+{
+    size_t mark_len = strlen(PARALLEL_PLACEHOLDER), arg_len = strlen(arg), len = 0;
+    for (const char *p = word, *mark; (mark = strstr(p, PARALLEL_PLACEHOLDER)) != NULL; p = mark + mark_len)
+        len += (mark - p) + arg_len;
+    const char *rest = word;
+    for (const char *mark; (mark = strstr(rest, PARALLEL_PLACEHOLDER)) != NULL; rest = mark + mark_len)
+        ;
+    len += strlen(rest);
+
+    char *filled = xrealloc(NULL, len + 1);
+    char *out = filled;
+    for (const char *p = word, *mark; (mark = strstr(p, PARALLEL_PLACEHOLDER)) != NULL; p = mark + mark_len)
+    {
+        memcpy(out, p, mark - p);
+        out += mark - p;
+        memcpy(out, arg, arg_len);
+        out += arg_len;
+    }
+    strcpy(out, rest);
+    return filled;
+}
+
+// The argv of one run: the template's words with the argument in place of every {}, or
+// added as the last word when there is none. The words were expanded when the command
+// line was read, so neither they nor the argument are expanded again.
+static void build_args(char **template, size_t count, const char *arg, Word_List *args)
+{
+    bool placed = false;
+    for (size_t i = 0; i < count; i++)
+        placed |= strstr(template[i], PARALLEL_PLACEHOLDER) != NULL;
+    args->count = count + !placed;
+    args->size = args->count + 1;
+    args->argv = xrealloc(NULL, args->size * sizeof(char *));
+    for (size_t i = 0; i < count; i++)
+        args->argv[i] = fill_placeholders(template[i], arg);
+    if (!placed)
+        args->argv[count] = fill_placeholders(arg, "");
+    args->argv[args->count] = NULL;
+}
+
+// Start one run with stdin on /dev/null and its stdout and stderr collected in `capture`.
+// `command` is the run's words joined, as `jobs` shows it.
+static Job *start_task(char **args, const char *command, Line_Buffer *capture)
+{
+    long long started = monotonic_ns();
+    const char *path = resolve_executable(args[0]);
+    int outfd[2];
+    if (path == NULL || pipe2(outfd, O_CLOEXEC) == -1)
+        return NULL;
+
+    // The shell blocks SIGCHLD and ignores SIGTTOU, children start with neither
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t signals;
+    sigemptyset(&signals);
+    posix_spawnattr_setsigmask(&attr, &signals);
+    sigaddset(&signals, SIGTTOU);
+    posix_spawnattr_setsigdefault(&attr, &signals);
+    short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+    if (output->interactive)
+        flags |= POSIX_SPAWN_SETPGROUP; // Each run in its own group, like any other job
+    posix_spawnattr_setflags(&attr, flags);
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_adddup2(&actions, outfd[1], STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, outfd[1], STDERR_FILENO);
+
+    pid_t pid;
+    int err = posix_spawn(&pid, path, &actions, &attr, args, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    close(outfd[1]);
+    if (err != 0)
+    {
+        close(outfd[0]);
+        return NULL;
+    }
+
+    Job *job = add_job(command, &pid, 1, pid, outfd[0], false);
+    job->capture = capture;
+    job->started = started;
+    return job;
+}
+
+// Next task for worker `w`: the front of its own deque, or else the back of the fullest one
+static long take_task(Parallel_Worker *workers, size_t count, size_t w)
+{
+    if (workers[w].head < workers[w].tail)
+        return workers[w].head++;
+
+    Parallel_Worker *victim = NULL;
+    for (size_t v = 0; v < count; v++)
+        if (workers[v].tail - workers[v].head > 0 &&
+            (victim == NULL || workers[v].tail - workers[v].head > victim->tail - victim->head))
+            victim = &workers[v];
+    return victim ? (long)--victim->tail : -1;
+}
+
+// parallel [-j N] command [args...] ::: arg...
+// Run the command once per argument, N at a time (one per CPU by default). Each run's
+// output is held back and shown in one piece, in argument order.
+void execute_parallel(char **words)
+{
+    size_t word_count = 0;
+    while (words[word_count])
+        word_count++;
+
+    long width = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t first = 0;
+    if (word_count > 1 && strcmp(words[0], "-j") == 0)
+    {
+        width = atol(words[1]);
+        first = 2;
+    }
+    else if (word_count > 0 && strncmp(words[0], "-j", 2) == 0 && words[0][2])
+    {
+        width = atol(words[0] + 2);
+        first = 1;
+    }
+
+    size_t mark = first;
+    while (mark < word_count && strcmp(words[mark], PARALLEL_MARK) != 0)
+        mark++;
+    if (width < 1 || mark == first || mark + 1 >= word_count)
+    {
+        print_error("usage: parallel [-j N] command [args...] " PARALLEL_MARK " arg...");
+        last_status = 2;
+        return;
+    }
+
+    char **template = words + first;
+    size_t template_count = mark - first;
+    char **inputs = words + mark + 1;
+    size_t count = word_count - mark - 1;
+
+    size_t worker_count = (size_t)width < count ? (size_t)width : count;
+    Parallel_Worker *workers = calloc(worker_count, sizeof(Parallel_Worker)); // -j can be any size
+    Parallel_Task *tasks = calloc(count, sizeof(Parallel_Task));
+    if (workers == NULL || tasks == NULL)
+    {
+        free(workers);
+        free(tasks);
+        print_error("parallel: out of memory");
+        last_status = 1;
+        return;
+    }
+    for (size_t w = 0; w < worker_count; w++)
+        workers[w] = (Parallel_Worker){.head = w * count / worker_count, .tail = (w + 1) * count / worker_count, .task = -1};
+
+    size_t shown = 0; // Runs before this one have been shown
+    size_t failed = 0;
+    while (shown < count)
+    {
+        // Give every idle worker a task
+        for (size_t w = 0; w < worker_count; w++)
+        {
+            if (workers[w].task != -1)
+                continue;
+            long t = take_task(workers, worker_count, w);
+            if (t == -1)
+                continue;
+
+            Word_List args;
+            build_args(template, template_count, inputs[t], &args);
+            char *command = join_words(&args, 0);
+            workers[w].job = start_task(args.argv, command, &tasks[t].output);
+            if (workers[w].job)
+                workers[w].task = t;
+            else
+            {
+                size_t size = strlen(command) + 32;
+                tasks[t].output.data = xrealloc(NULL, size);
+                tasks[t].output.length = snprintf(tasks[t].output.data, size, "parallel: cannot run `%s`\n", command);
+                tasks[t].output.size = size;
+                tasks[t].status = 127;
+                tasks[t].done = true;
+            }
+            free(command);
+            free_words(&args);
+        }
+
+        // Show whatever is finished and next in line
+        while (shown < count && tasks[shown].done)
+        {
+            show_captured_output(&tasks[shown].output, false);
+            free(tasks[shown].output.data);
+            if (tasks[shown].status != 0)
+                failed++;
+            shown++;
+        }
+        if (shown == count)
+            break;
+
+        bool running = false;
+        for (size_t w = 0; w < worker_count; w++)
+            running |= workers[w].task != -1;
+        if (running)
+            poll_jobs();
+        for (size_t w = 0; w < worker_count; w++)
+            if (workers[w].task != -1 && workers[w].job->state == JOB_DONE)
+            {
+                tasks[workers[w].task].status = workers[w].job->status;
+                tasks[workers[w].task].done = true;
+                remove_job(workers[w].job);
+                workers[w].task = -1;
+            }
+    }
+
+    Line_Buffer none = {0};
+    show_captured_output(&none, true); // Paint the last runs now
+    free(workers);
+    free(tasks);
+    last_status = failed < MAX_FAILED_STATUS ? failed : MAX_FAILED_STATUS;
+}
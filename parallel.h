@@ -0,0 +1,35 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include "jobs.h"
+
+#define PARALLEL_MARK ":::"       // Separates the command from its arguments
+#define PARALLEL_PLACEHOLDER "{}" // Replaced by the argument, which is appended when absent
+#define MAX_FAILED_STATUS 101    // `parallel` exits with the number of failed runs, up to this
+
+// A worker runs one command at a time. It starts with a contiguous run of the tasks and
+// takes them from the front; once that runs out it steals from the back of the worker
+// with the most left. Each deque only ever shrinks, so it is just a range of task numbers.
+typedef struct
+{
+    size_t head; // Next task the worker takes itself
+    size_t tail; // One past the last task left, where thieves take from
+    long task;   // Task being run, -1 when idle
+    Job *job;
+} Parallel_Worker;
+
+// One run of the command, kept until every earlier run has been shown
+typedef struct
+{
+    Line_Buffer output; // Everything it wrote to stdout and stderr
+    int status;
+    bool done;
+} Parallel_Task;
+
+// Function prototypes
+void execute_parallel(char **args);
+
+#endif // PARALLEL_H
@@ -0,0 +1,369 @@
+#define _GNU_SOURCE // pipe2, environ
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include "command_index.h"
+#include "jobs.h"
+#include "prompt.h"
+
+// Prompt segments: the branch and state of the git repository, the exit status and time of
+// the last command, and the load average. `git status` can take seconds in a big repository
+// or on a network filesystem, so it runs on a worker thread, and so does everything else
+// that reads files. The prompt shows what was last found for the directory, or a
+// placeholder, and is drawn again in place when the worker answers.
+
+static struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    Prompt_Request *pending; // Next request, not started yet
+    Prompt_Request *running; // Request being worked on
+    pid_t child;             // git run for `running`, 0 when none
+    Prompt_Result *done;     // Answers not picked up yet, newest first
+    int notify[2];           // A byte is written for each answer, the event loop waits on it
+    bool started;
+} worker = {.lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER, .notify = {-1, -1}};
+
+// The rest is only used by the shell's thread
+static Git_Cache_Entry git_cache[PROMPT_CACHE_SIZE];
+static unsigned long git_clock = 0;
+static bool have_git = false;   // git was in $PATH at the last request
+static double load = -1;        // Negative until the worker has read it
+static long long duration = 0;  // Wall time of the last command line
+
+static void *xmalloc(size_t size)
+{
+    void *p = malloc(size);
+    if (p == NULL)
+    {
+        perror("Error allocating the prompt");
+        endwin();
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+static char *xstrdup(const char *s)
+{
+    size_t len = strlen(s) + 1;
+    return memcpy(xmalloc(len), s, len);
+}
+
+// git runs with the environment as it was at the request, `export` may change it meanwhile
+static char **copy_environment(void)
+{
+    size_t count = 0;
+    while (environ[count])
+        count++;
+    char **env = xmalloc((count + 1) * sizeof(char *));
+    for (size_t i = 0; i < count; i++)
+        env[i] = xstrdup(environ[i]);
+    env[count] = NULL;
+    return env;
+}
+
+static void free_request(Prompt_Request *request)
+{
+    if (request->env)
+        for (char **e = request->env; *e; e++)
+            free(*e);
+    free(request->env);
+    free(request->git);
+    free(request->dir);
+    free(request);
+}
+
+// Take what is wanted from one line of `git status --porcelain=v2 --branch`. Returns false
+// once nothing more is needed.
+static bool parse_git_line(const char *line, Git_State *git, char *oid)
+{
+    if (strncmp(line, "# branch.oid ", 13) == 0)
+        snprintf(oid, 8, "%s", line + 13);
+    else if (strncmp(line, "# branch.head ", 14) == 0)
+    {
+        const char *head = line + 14;
+        snprintf(git->branch, sizeof(git->branch), "%s", strcmp(head, "(detached)") == 0 ? oid : head);
+        git->repo = true;
+    }
+    else if (line[0] != '#')
+    {
+        git->dirty = true; // The first changed file is enough
+        return false;
+    }
+    return true;
+}
+
+// Run `git status` in the request's directory and read the branch and whether anything
+// changed from the start of its output. Returns false when the answer is not known, because
+// git could not be run or a newer directory cancelled it.
+static bool read_git_state(Prompt_Request *request, Git_State *git)
+{
+    int out[2];
+    if (pipe2(out, O_CLOEXEC) == -1)
+        return false;
+
+    // The shell blocks SIGCHLD and ignores SIGTTOU, git starts with neither
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t signals;
+    sigemptyset(&signals);
+    posix_spawnattr_setsigmask(&attr, &signals);
+    sigaddset(&signals, SIGTTOU);
+    posix_spawnattr_setsigdefault(&attr, &signals);
+    posix_spawnattr_setpgroup(&attr, 0); // Its own group, so cancelling also stops what it starts
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETPGROUP);
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_adddup2(&actions, out[1], STDOUT_FILENO);
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+
+    // --no-optional-locks keeps it from refreshing the index under a command the user runs
+    char *args[] = {"git", "-C", request->dir, "--no-optional-locks", "status", "--porcelain=v2", "--branch", NULL};
+    pid_t pid;
+    int err = posix_spawn(&pid, request->git, &actions, &attr, args, request->env);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    close(out[1]);
+    if (err != 0)
+    {
+        close(out[0]);
+        return false;
+    }
+
+    // Only this thread reaps it, so the pid stays valid for the shell to kill until then
+    pthread_mutex_lock(&worker.lock);
+    worker.child = pid;
+    if (request->cancelled)
+        kill(-pid, SIGTERM);
+    pthread_mutex_unlock(&worker.lock);
+
+    char buffer[GIT_OUTPUT_MAX];
+    char oid[8] = "";
+    size_t length = 0, parsed = 0;
+    bool more = true;
+    while (more && length < sizeof(buffer))
+    {
+        ssize_t n = read(out[0], buffer + length, sizeof(buffer) - length);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        length += n;
+
+        char *end;
+        while (more && (end = memchr(buffer + parsed, '\n', length - parsed)) != NULL)
+        {
+            *end = '\0';
+            more = parse_git_line(buffer + parsed, git, oid);
+            parsed = end + 1 - buffer;
+        }
+    }
+
+    pthread_mutex_lock(&worker.lock);
+    worker.child = 0;
+    bool known = !request->cancelled;
+    pthread_mutex_unlock(&worker.lock);
+    if (more)
+        known &= length < sizeof(buffer); // Header lines that long are not git's
+    else
+        kill(-pid, SIGTERM); // The rest of the list is not needed
+    close(out[0]);
+    while (waitpid(pid, NULL, 0) == -1 && errno == EINTR)
+        ;
+    return known;
+}
+
+// Answer requests one at a time, only ever the newest
+static void *prompt_worker(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&worker.lock);
+    while (1)
+    {
+        while (worker.pending == NULL)
+            pthread_cond_wait(&worker.wake, &worker.lock);
+        Prompt_Request *request = worker.pending;
+        worker.pending = NULL;
+        worker.running = request;
+        pthread_mutex_unlock(&worker.lock);
+
+        Prompt_Result *result = calloc(1, sizeof(Prompt_Result));
+        if (result)
+        {
+            if (getloadavg(&result->load, 1) != 1)
+                result->load = -1;
+            result->git_known = request->git && read_git_state(request, &result->git);
+        }
+
+        pthread_mutex_lock(&worker.lock);
+        worker.running = NULL;
+        if (result)
+        {
+            result->git_known &= !request->cancelled;
+            result->dir = request->dir;
+            request->dir = NULL;
+            result->next = worker.done;
+            worker.done = result;
+            write(worker.notify[1], "", 1); // When the pipe is full a wakeup is waiting already
+        }
+        free_request(request);
+    }
+    return NULL;
+}
+
+static Git_Cache_Entry *find_git_state(const char *dir)
+{
+    for (int i = 0; i < PROMPT_CACHE_SIZE; i++)
+        if (git_cache[i].dir && strcmp(git_cache[i].dir, dir) == 0)
+            return &git_cache[i];
+    return NULL;
+}
+
+static void cache_git_state(const char *dir, const Git_State *git)
+{
+    Git_Cache_Entry *entry = find_git_state(dir);
+    if (entry == NULL)
+    {
+        entry = &git_cache[0];
+        for (int i = 1; i < PROMPT_CACHE_SIZE && entry->dir; i++)
+            if (git_cache[i].dir == NULL || git_cache[i].used < entry->used)
+                entry = &git_cache[i];
+        free(entry->dir);
+        entry->dir = xstrdup(dir);
+    }
+    entry->git = *git;
+    entry->used = ++git_clock;
+}
+
+// The worker answered: keep what it found and show it
+static void take_results(void *arg)
+{
+    (void)arg;
+    char bytes[64];
+    while (read(worker.notify[0], bytes, sizeof(bytes)) > 0)
+        ;
+
+    pthread_mutex_lock(&worker.lock);
+    Prompt_Result *newest = worker.done;
+    worker.done = NULL;
+    pthread_mutex_unlock(&worker.lock);
+
+    // Oldest first, so the newest answer is the one kept
+    Prompt_Result *oldest = NULL;
+    while (newest)
+    {
+        Prompt_Result *next = newest->next;
+        newest->next = oldest;
+        oldest = newest;
+        newest = next;
+    }
+    while (oldest)
+    {
+        Prompt_Result *next = oldest->next;
+        if (oldest->load >= 0)
+            load = oldest->load;
+        if (oldest->git_known)
+            cache_git_state(oldest->dir, &oldest->git);
+        free(oldest->dir);
+        free(oldest);
+        oldest = next;
+    }
+    refresh_prompt();
+}
+
+// Start the worker. Called after init_jobs(), so its thread blocks SIGCHLD too and the
+// signal still reaches the event loop.
+void init_prompt_segments(void)
+{
+    if (pipe2(worker.notify, O_CLOEXEC | O_NONBLOCK) == -1)
+        return; // The prompt goes without the worker's segments
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, prompt_worker, NULL) != 0)
+    {
+        close(worker.notify[0]);
+        close(worker.notify[1]);
+        return;
+    }
+    pthread_detach(thread);
+    worker.started = true;
+    add_watch(worker.notify[0], take_results, NULL);
+}
+
+// Ask for the segments of a prompt in `dir`. A request still waiting is replaced, and one
+// being worked on for another directory is cancelled, since a `cd` made it useless.
+void request_prompt_segments(const char *dir)
+{
+    if (!worker.started)
+        return;
+
+    Prompt_Request *request = xmalloc(sizeof(Prompt_Request));
+    const char *git = resolve_executable("git");
+    have_git = git != NULL;
+    *request = (Prompt_Request){.dir = xstrdup(dir), .git = git ? xstrdup(git) : NULL, .env = git ? copy_environment() : NULL};
+
+    pthread_mutex_lock(&worker.lock);
+    if (worker.pending)
+        free_request(worker.pending);
+    worker.pending = request;
+    if (worker.running && strcmp(worker.running->dir, dir) != 0)
+    {
+        worker.running->cancelled = true;
+        if (worker.child > 0)
+            kill(-worker.child, SIGTERM);
+    }
+    pthread_cond_signal(&worker.wake);
+    pthread_mutex_unlock(&worker.lock);
+}
+
+static void add_segment(char *out, size_t size, size_t *len, const char *format, ...)
+{
+    if (*len + 1 >= size)
+        return;
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(out + *len, size - *len, format, args);
+    va_end(args);
+    if (n > 0)
+        *len = (size_t)n < size - *len ? *len + n : size - 1;
+}
+
+// Write the segments for a prompt in `dir` to `out`, each with a space in front: what is
+// known now, or a placeholder for what the worker has not found yet
+size_t format_prompt_segments(char *out, size_t size, const char *dir)
+{
+    size_t len = 0;
+    out[0] = '\0';
+
+    Git_Cache_Entry *entry = dir[0] ? find_git_state(dir) : NULL;
+    if (entry)
+    {
+        entry->used = ++git_clock;
+        if (entry->git.repo)
+            add_segment(out, size, &len, " (%s%s)", entry->git.branch, entry->git.dirty ? "*" : "");
+    }
+    else if (dir[0] && have_git)
+        add_segment(out, size, &len, " (...)");
+
+    bool slow = duration >= PROMPT_SLOW_NS;
+    if (last_status != 0 && slow)
+        add_segment(out, size, &len, " [%d %.1fs]", last_status, duration / 1e9);
+    else if (last_status != 0)
+        add_segment(out, size, &len, " [%d]", last_status);
+    else if (slow)
+        add_segment(out, size, &len, " [%.1fs]", duration / 1e9);
+
+    if (load >= 0)
+        add_segment(out, size, &len, " %.2f", load);
+    else if (worker.started)
+        add_segment(out, size, &len, " -.--");
+    return len;
+}
+
+// Wall time of the command line that just finished, shown when it was slow
+void set_command_duration(long long ns)
+{
+    duration = ns;
+}
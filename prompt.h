@@ -0,0 +1,53 @@
+#ifndef PROMPT_H
+#define PROMPT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define PROMPT_CACHE_SIZE 16                    // Directories whose git state is remembered
+#define GIT_BRANCH_MAX 64                       // Longest branch name shown, longer ones are cut
+#define GIT_OUTPUT_MAX 4096                     // Bytes of `git status` read before giving up on it
+#define PROMPT_SLOW_NS (2LL * 1000 * 1000 * 1000) // Commands that took this long show their time
+
+// What the prompt shows about the repository a directory is in
+typedef struct
+{
+    bool repo;                       // Inside a work tree
+    bool dirty;                      // Anything changed, staged or untracked
+    char branch[GIT_BRANCH_MAX + 1]; // Branch, or the start of the commit when detached
+} Git_State;
+
+// One request for the worker, replaced by the next one if it has not started yet
+typedef struct
+{
+    char *dir;        // Directory the prompt is for
+    char *git;        // Path of git, NULL when it is not in $PATH
+    char **env;       // Copy of the environment to run git with
+    bool cancelled;   // Set by the shell when a newer directory supersedes it
+} Prompt_Request;
+
+// What the worker found, picked up by the event loop
+typedef struct Prompt_Result
+{
+    char *dir;
+    Git_State git;
+    bool git_known; // False when git could not be run or the request was cancelled
+    double load;    // One minute load average, negative if it could not be read
+    struct Prompt_Result *next; // Next older answer not picked up yet
+} Prompt_Result;
+
+// The last git state found for one directory
+typedef struct
+{
+    char *dir;          // NULL for an unused slot
+    Git_State git;
+    unsigned long used; // When the prompt last showed it, the least recent is reused
+} Git_Cache_Entry;
+
+// Function prototypes
+void init_prompt_segments(void);
+void request_prompt_segments(const char *dir);
+size_t format_prompt_segments(char *out, size_t size, const char *dir);
+void set_command_duration(long long ns);
+
+#endif // PROMPT_H
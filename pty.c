@@ -0,0 +1,52 @@
+#define _GNU_SOURCE // posix_openpt, ptsname_r
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include "pty.h"
+
+// Allocate a pseudo-terminal for a command's output. Programs writing to the slave see
+// a terminal, so stdio line-buffers instead of holding output back in 4 KB blocks. Both
+// ends are close-on-exec, children only get the copies dup2'd onto their stdio.
+bool open_pty(int *master, int *slave, int rows, int cols)
+{
+    int m = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (m == -1)
+        return false;
+
+    char name[64];
+    if (grantpt(m) == -1 || unlockpt(m) == -1 || ptsname_r(m, name, sizeof(name)) != 0)
+    {
+        close(m);
+        return false;
+    }
+
+    int s = open(name, O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (s == -1)
+    {
+        close(m);
+        return false;
+    }
+
+    // Keep "\n" as it is, the shell splits output on it rather than on "\r\n"
+    struct termios attrs;
+    if (tcgetattr(s, &attrs) == 0)
+    {
+        attrs.c_oflag &= ~OPOST;
+        tcsetattr(s, TCSANOW, &attrs);
+    }
+    set_pty_size(m, rows, cols);
+
+    *master = m;
+    *slave = s;
+    return true;
+}
+
+// Tell programs on the pty how big the area they are drawing into is
+void set_pty_size(int master, int rows, int cols)
+{
+    struct winsize size = {.ws_row = rows, .ws_col = cols};
+    ioctl(master, TIOCSWINSZ, &size);
+}
@@ -0,0 +1,10 @@
+#ifndef PTY_H
+#define PTY_H
+
+#include <stdbool.h>
+
+// Function prototypes
+bool open_pty(int *master, int *slave, int rows, int cols);
+void set_pty_size(int master, int rows, int cols);
+
+#endif // PTY_H
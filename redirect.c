@@ -0,0 +1,178 @@
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include "expand.h"
+#include "jobs.h"
+#include "output.h"
+#include "redirect.h"
+
+static bool starts_word(const char *command, const char *p)
+{
+    return p == command || isspace((unsigned char)p[-1]);
+}
+
+static bool add_redirection(Redirections *redirections, Redirection r)
+{
+    if (redirections->count == MAX_REDIRECTIONS)
+    {
+        print_error("Syntax error: more than %d redirections.", MAX_REDIRECTIONS);
+        last_status = 2;
+        return false;
+    }
+    redirections->list[redirections->count++] = r;
+    return true;
+}
+
+// Expand the file name of a redirection like any other word, which must come to exactly one
+static bool add_path(Redirections *redirections, Redirection *r, const char *name, size_t len)
+{
+    if (len >= sizeof(redirections->pool))
+    {
+        print_error("Syntax error: redirection file names are too long.");
+        last_status = 2;
+        return false;
+    }
+    char text[len + 1];
+    memcpy(text, name, len);
+    text[len] = '\0';
+    Word_List words;
+    if (!expand_words(text, &words))
+        return false;
+    if (words.count != 1)
+    {
+        print_error("%s: ambiguous redirect", text);
+        last_status = 1;
+        free_words(&words);
+        return false;
+    }
+
+    size_t path_len = strlen(words.argv[0]);
+    if (redirections->pool_used + path_len + 1 > sizeof(redirections->pool))
+    {
+        print_error("Syntax error: redirection file names are too long.");
+        last_status = 2;
+        free_words(&words);
+        return false;
+    }
+    r->path = redirections->pool + redirections->pool_used;
+    memcpy(redirections->pool + redirections->pool_used, words.argv[0], path_len + 1);
+    redirections->pool_used += path_len + 1;
+    free_words(&words);
+    return true;
+}
+
+// Take every redirection out of `command`, blanking it with spaces so the words left are
+// the command and its arguments. Quoted `<` and `>` are left alone. Prints a message and
+// returns false on a syntax error.
+bool parse_redirections(char *command, Redirections *redirections)
+{
+    redirections->count = 0;
+    redirections->pool_used = 0;
+    for (char *p = command; *p; p++)
+    {
+        p += strcspn(p, "\\'\"<>2"); // Straight to the next byte that can matter
+        if (*p == '\0')
+            break;
+        if (*p == '\\' || *p == '\'' || *p == '"')
+        {
+            p = skip_quoted(p);
+            continue;
+        }
+
+        char *op = p;
+        bool to_stderr = p[0] == '2' && p[1] == '>' && starts_word(command, p);
+        if (to_stderr && p[2] == '&' && p[3] == '1' && (p[4] == '\0' || isspace((unsigned char)p[4])))
+        {
+            if (!add_redirection(redirections, (Redirection){.fd = STDERR_FILENO}))
+                return false;
+            memset(op, ' ', 4);
+            p += 3;
+            continue;
+        }
+
+        Redirection r = {.fd = to_stderr ? STDERR_FILENO : STDOUT_FILENO};
+        if (to_stderr)
+            p++;
+        if (*p == '<' && !to_stderr)
+        {
+            r = (Redirection){.fd = STDIN_FILENO, .flags = O_RDONLY};
+            p++;
+        }
+        else if (*p == '>' && p[1] == '>')
+        {
+            r.flags = O_WRONLY | O_CREAT | O_APPEND;
+            p += 2;
+        }
+        else if (*p == '>')
+        {
+            r.flags = O_WRONLY | O_CREAT | O_TRUNC;
+            p++;
+        }
+        else
+            continue;
+
+        p += strspn(p, " \t");
+        char *end = find_unquoted(p, " \t<>");
+        size_t len = end ? (size_t)(end - p) : strlen(p);
+        if (len == 0)
+        {
+            print_error("Syntax error: missing file after `%.*s`.", (int)strcspn(op, " \t"), op);
+            last_status = 2;
+            return false;
+        }
+        if (!add_path(redirections, &r, p, len) || !add_redirection(redirections, r))
+            return false;
+        memset(op, ' ', p + len - op);
+        p += len - 1; // The loop steps past the last blanked byte
+    }
+    return true;
+}
+
+// Open every file named, close-on-exec. `fds` gets -1 for entries that open nothing.
+// Prints a message like `in: No such file or directory` and returns false on failure.
+bool open_redirections(const Redirections *redirections, int fds[MAX_REDIRECTIONS])
+{
+    for (size_t i = 0; i < redirections->count; i++)
+        fds[i] = -1;
+    for (size_t i = 0; i < redirections->count; i++)
+    {
+        const Redirection *r = &redirections->list[i];
+        fds[i] = r->path ? open(r->path, r->flags | O_CLOEXEC, REDIRECT_MODE) : -1;
+        if (r->path && fds[i] == -1)
+        {
+            print_error("%s: %s", r->path, strerror(errno));
+            last_status = 1;
+            close_redirections(redirections, fds);
+            return false;
+        }
+    }
+    return true;
+}
+
+void close_redirections(const Redirections *redirections, int fds[MAX_REDIRECTIONS])
+{
+    for (size_t i = 0; i < redirections->count; i++)
+    {
+        if (fds[i] != -1)
+            close(fds[i]);
+        fds[i] = -1;
+    }
+}
+
+// Where `fd` ends up once every redirection is applied in order, -1 if it is left alone and
+// REDIRECT_TO_STDOUT if `2>&1` points it at a stdout that is
+int redirected_fd(const Redirections *redirections, const int fds[MAX_REDIRECTIONS], int fd)
+{
+    int target[3] = {-1, -1, -1};
+    for (size_t i = 0; i < redirections->count; i++)
+    {
+        const Redirection *r = &redirections->list[i];
+        if (r->path)
+            target[r->fd] = fds[i];
+        else
+            target[r->fd] = target[STDOUT_FILENO] == -1 ? REDIRECT_TO_STDOUT : target[STDOUT_FILENO];
+    }
+    return target[fd];
+}
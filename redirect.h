@@ -0,0 +1,34 @@
+#ifndef REDIRECT_H
+#define REDIRECT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define MAX_REDIRECTIONS 8    // Redirections one command may carry
+#define REDIRECT_POOL 512     // Bytes for the file names of one command's redirections
+#define REDIRECT_MODE 0666    // Mode new files are created with, before the umask
+#define REDIRECT_TO_STDOUT -2 // redirected_fd() of a `2>&1` that copies the shell's own stdout
+
+// One `<`, `>`, `>>`, `2>`, `2>>` or `2>&1`, applied in the order they were written
+typedef struct
+{
+    int fd;           // Descriptor of the command being redirected
+    int flags;        // open() flags for the file
+    const char *path; // File to open, NULL to copy stdout onto `fd` (2>&1)
+} Redirection;
+
+typedef struct
+{
+    Redirection list[MAX_REDIRECTIONS];
+    size_t count;
+    char pool[REDIRECT_POOL]; // File names, NUL terminated
+    size_t pool_used;
+} Redirections;
+
+// Function prototypes
+bool parse_redirections(char *command, Redirections *redirections);
+bool open_redirections(const Redirections *redirections, int fds[MAX_REDIRECTIONS]);
+void close_redirections(const Redirections *redirections, int fds[MAX_REDIRECTIONS]);
+int redirected_fd(const Redirections *redirections, const int fds[MAX_REDIRECTIONS], int fd);
+
+#endif // REDIRECT_H
@@ -0,0 +1,417 @@
+#define _GNU_SOURCE // mkostemp
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <ncurses.h>
+#include <zlib.h>
+#include <sys/mman.h>
+#include "scrollback.h"
+
+// Read the memory budget and split it between the hot lines and the block cache
+void init_scroll_history(Scroll_History *history)
+{
+    *history = (Scroll_History){.fd = -1};
+
+    size_t budget = DEFAULT_SCROLLBACK_BUDGET;
+    const char *env = getenv(SCROLLBACK_BUDGET_ENV);
+    if (env && strtoul(env, NULL, 10) > 0)
+        budget = strtoul(env, NULL, 10) * 1024 * 1024;
+
+    // A quarter goes to decompressed blocks, which only fill up while scrolling far back
+    history->cache_slots = budget / 4 / SPILL_BLOCK_BYTES;
+    if (history->cache_slots < 2)
+        history->cache_slots = 2; // The line being read must survive loading the next one
+    history->hot_budget = budget - history->cache_slots * SPILL_BLOCK_BYTES;
+    if (history->hot_budget < 2 * SPILL_BLOCK_BYTES)
+        history->hot_budget = 2 * SPILL_BLOCK_BYTES;
+
+    history->cache = calloc(history->cache_slots, sizeof(Block_Cache_Slot));
+    if (history->cache == NULL)
+    {
+        perror("Error allocating scrollback");
+        endwin();
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < history->cache_slots; i++)
+        history->cache[i].block = -1;
+}
+
+// Grow `*buffer` to hold at least `need` bytes, doubling so repeated growth stays cheap
+static bool reserve_buffer(void **buffer, size_t *size, size_t need)
+{
+    if (*size >= need)
+        return true;
+    size_t grown = *size ? *size * 2 : need;
+    if (grown < need)
+        grown = need;
+    void *p = realloc(*buffer, grown);
+    if (p == NULL)
+        return false;
+    *buffer = p;
+    *size = grown;
+    return true;
+}
+
+// Bytes a hot line takes in the arena: its text, the NUL and its runs
+static size_t entry_size(const Scroll_Line *l)
+{
+    return l->length + 1 + l->runs * sizeof(Attr_Run);
+}
+
+// Copy the live lines into a fresh arena of `size` bytes, oldest line first
+static void relocate_scroll_arena(Scroll_History *history, size_t size)
+{
+    char *arena = malloc(size);
+    if (arena == NULL)
+    {
+        perror("Error allocating scrollback");
+        endwin();
+        exit(EXIT_FAILURE);
+    }
+
+    size_t offset = 0;
+    for (size_t i = 0; i < history->hot_count; i++)
+    {
+        Scroll_Line *l = &history->lines[(history->head + i) % history->slots];
+        memcpy(arena + offset, history->arena + l->offset, entry_size(l));
+        l->offset = offset;
+        offset += entry_size(l);
+    }
+
+    free(history->arena);
+    history->arena = arena;
+    history->arena_size = size;
+}
+
+// Find room for `need` bytes after the newest line, wrapping or growing the arena
+static size_t reserve_scroll_space(Scroll_History *history, size_t need)
+{
+    if (history->hot_count == 0)
+    {
+        if (history->arena_size < need)
+            relocate_scroll_arena(history, need > ARENA_MIN_SIZE ? need : ARENA_MIN_SIZE);
+        return 0;
+    }
+
+    // Shrink back down if the arena is mostly empty after long lines were evicted
+    if (history->arena_size > ARENA_MIN_SIZE && (history->arena_used + need) * 4 < history->arena_size)
+        relocate_scroll_arena(history, (history->arena_used + need) * 2);
+
+    Scroll_Line *oldest = &history->lines[history->head];
+    Scroll_Line *newest = &history->lines[(history->head + history->hot_count - 1) % history->slots];
+    size_t start = oldest->offset;
+    size_t end = newest->offset + entry_size(newest);
+
+    if (end > start) // Live text is one contiguous run
+    {
+        if (history->arena_size - end >= need)
+            return end;
+        if (start >= need)
+            return 0; // Wrap around to the front of the arena
+    }
+    else if (start - end >= need) // Live text wraps, free space sits in the middle
+        return end;
+
+    // No contiguous gap is big enough, so grow and pack the lines at the front. Past the
+    // budget the arena stops growing and the lines are only packed.
+    size_t size = history->arena_size * 2;
+    if (size > history->hot_budget)
+        size = history->hot_budget;
+    if (size < history->arena_used + need)
+        size = history->arena_used + need;
+    relocate_scroll_arena(history, size);
+    return history->arena_used;
+}
+
+// Make room for more hot lines, unrolling the ring so the oldest sits in slot 0
+static void grow_ring(Scroll_History *history)
+{
+    size_t slots = history->slots ? history->slots * 2 : MIN_HOT_LINES;
+    Scroll_Line *lines = malloc(slots * sizeof(Scroll_Line));
+    if (lines == NULL)
+    {
+        perror("Error allocating scrollback");
+        endwin();
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < history->hot_count; i++)
+        lines[i] = history->lines[(history->head + i) % history->slots];
+
+    free(history->lines);
+    history->lines = lines;
+    history->slots = slots;
+    history->head = 0;
+}
+
+// Forget every cold line and empty the segment file
+static void drop_cold_tier(Scroll_History *history)
+{
+    if (history->map)
+        munmap(history->map, history->map_size);
+    history->map = NULL;
+    history->map_size = 0;
+    if (history->fd != -1 && ftruncate(history->fd, 0) == -1)
+        perror("Error truncating scrollback");
+    history->file_size = 0;
+    history->block_count = 0;
+    history->cold_lines = 0;
+    for (size_t i = 0; i < history->cache_slots; i++)
+        history->cache[i].block = -1;
+}
+
+// The segment file is unlinked as soon as it exists, so it goes away with the shell
+static int open_segment_file(void)
+{
+    const char *dir = getenv("TMPDIR");
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/my-shell-scrollback-XXXXXX", dir ? dir : "/tmp");
+    int fd = mkostemp(path, O_CLOEXEC);
+    if (fd != -1)
+        unlink(path);
+    return fd;
+}
+
+// Compress the first `raw` bytes of the spill buffer and append them to the segment file
+static bool write_block(Scroll_History *history, size_t raw, size_t first_line)
+{
+    if (history->fd == -1)
+        history->fd = open_segment_file();
+    if (history->fd == -1)
+        return false;
+
+    uLongf packed = compressBound(raw);
+    if (!reserve_buffer((void **)&history->packed_buffer, &history->packed_size, packed) ||
+        compress2((Bytef *)history->packed_buffer, &packed, (Bytef *)history->spill_buffer, raw, Z_BEST_SPEED) != Z_OK)
+        return false;
+    if (!reserve_buffer((void **)&history->blocks, &history->block_size, (history->block_count + 1) * sizeof(Scroll_Block)))
+        return false;
+
+    for (size_t done = 0; done < packed;)
+    {
+        ssize_t n = pwrite(history->fd, history->packed_buffer + done, packed - done, history->file_size + done);
+        if (n <= 0)
+            return false;
+        done += n;
+    }
+
+    history->blocks[history->block_count++] = (Scroll_Block){history->file_size, packed, raw, first_line};
+    history->file_size += packed;
+    return true;
+}
+
+// Move the oldest hot lines, about one block's worth, into the segment file
+static void spill_block(Scroll_History *history)
+{
+    size_t raw = 0;
+    size_t count = 0;
+    while (count < history->hot_count)
+    {
+        Scroll_Line *l = &history->lines[(history->head + count) % history->slots];
+        size_t size = 2 * sizeof(uint32_t) + entry_size(l);
+        if (count > 0 && raw + size > SPILL_BLOCK_BYTES)
+            break;
+        if (!reserve_buffer((void **)&history->spill_buffer, &history->spill_size, raw + size))
+            break;
+        uint32_t header[2] = {l->length, l->runs};
+        memcpy(history->spill_buffer + raw, header, sizeof(header));
+        memcpy(history->spill_buffer + raw + sizeof(header), history->arena + l->offset, entry_size(l));
+        raw += size;
+        count++;
+    }
+    if (count == 0)
+        count = 1; // Out of memory for staging, the line is dropped below
+
+    for (size_t i = 0; i < count; i++)
+        history->arena_used -= entry_size(&history->lines[(history->head + i) % history->slots]);
+    history->head = (history->head + count) % history->slots;
+    history->hot_count -= count;
+
+    if (raw == 0 || !write_block(history, raw, history->cold_lines))
+    {
+        // The lines are lost, and everything older goes with them so the scrollback
+        // stays one run of consecutive lines
+        history->length -= history->cold_lines + count;
+        drop_cold_tier(history);
+        return;
+    }
+    history->cold_lines += count;
+}
+
+void add_to_scroll_history(Scroll_History *history, const char *data)
+{
+    add_to_scroll_history_n(history, data, strlen(data));
+}
+
+// Add a line that is not NUL terminated, such as a slice of a read buffer
+void add_to_scroll_history_n(Scroll_History *history, const char *data, size_t len)
+{
+    add_to_scroll_history_runs(history, data, len, NULL, 0);
+}
+
+// Add a line with the attribute runs the ANSI parser found in it
+void add_to_scroll_history_runs(Scroll_History *history, const char *data, size_t len, const Attr_Run *runs, size_t run_count)
+{
+    if (len > UINT32_MAX)
+        len = UINT32_MAX;
+    Scroll_Line entry = {0, len, run_count};
+    size_t size = entry_size(&entry);
+
+    // Spill the oldest lines once this one would take the hot tier over its budget
+    while (history->hot_count > 0 &&
+           history->arena_used + (history->hot_count + 1) * sizeof(Scroll_Line) + size > history->hot_budget)
+        spill_block(history);
+
+    if (history->hot_count == history->slots)
+        grow_ring(history);
+
+    entry.offset = reserve_scroll_space(history, size);
+    memcpy(history->arena + entry.offset, data, len);
+    history->arena[entry.offset + len] = '\0';
+    if (run_count)
+        memcpy(history->arena + entry.offset + len + 1, runs, run_count * sizeof(Attr_Run));
+
+    history->lines[(history->head + history->hot_count) % history->slots] = entry;
+    history->hot_count++;
+    history->length++;
+    history->arena_used += size;
+}
+
+// Cold block holding line `index`, by binary search on the first lines
+static size_t find_block(const Scroll_History *history, size_t index)
+{
+    size_t lo = 0, hi = history->block_count;
+    while (hi - lo > 1)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (history->blocks[mid].first_line <= index)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// Decompress block `b` into the cache, reusing the least recently read slot
+static Block_Cache_Slot *load_block(Scroll_History *history, size_t b)
+{
+    Block_Cache_Slot *slot = NULL;
+    for (size_t i = 0; i < history->cache_slots; i++)
+    {
+        Block_Cache_Slot *s = &history->cache[i];
+        if (s->block == (long)b)
+        {
+            s->used = ++history->cache_clock;
+            return s;
+        }
+        if (slot == NULL || s->used < slot->used)
+            slot = s;
+    }
+
+    Scroll_Block *block = &history->blocks[b];
+    if ((size_t)block->offset + block->packed > history->map_size)
+    {
+        // The file grew since it was mapped
+        if (history->map)
+            munmap(history->map, history->map_size);
+        history->map = mmap(NULL, history->file_size, PROT_READ, MAP_SHARED, history->fd, 0);
+        history->map_size = history->file_size;
+        if (history->map == MAP_FAILED)
+        {
+            history->map = NULL;
+            history->map_size = 0;
+            return NULL;
+        }
+        madvise(history->map, history->map_size, MADV_RANDOM); // Blocks are read one at a time, no readahead
+    }
+
+    size_t lines = (b + 1 < history->block_count ? history->blocks[b + 1].first_line : history->cold_lines) - block->first_line;
+    slot->block = -1;
+    uLongf raw = block->raw;
+    if (!reserve_buffer((void **)&slot->data, &slot->data_size, block->raw) ||
+        !reserve_buffer((void **)&slot->starts, &slot->starts_size, 2 * lines * sizeof(size_t)) ||
+        uncompress((Bytef *)slot->data, &raw, (Bytef *)history->map + block->offset, block->packed) != Z_OK ||
+        raw != block->raw)
+        return NULL;
+
+    // The compressed pages are not read again until the block is evicted, so they do not
+    // need to stay resident. The kernel maps whole folios around a fault, not just the
+    // block's pages, so the whole mapping is dropped.
+    madvise(history->map, history->map_size, MADV_DONTNEED);
+
+    size_t p = 0;
+    for (size_t k = 0; k < lines; k++)
+    {
+        uint32_t header[2];
+        memcpy(header, slot->data + p, sizeof(header));
+        slot->starts[2 * k] = p + sizeof(header);
+        slot->starts[2 * k + 1] = p + sizeof(header) + header[0] + 1;
+        p += sizeof(header) + header[0] + 1 + header[1] * sizeof(Attr_Run);
+    }
+    slot->block = b;
+    slot->used = ++history->cache_clock;
+    return slot;
+}
+
+// Get a line by its position in the scrollback, 0 being the oldest. The text stays valid
+// until another cold block is read, which is never the block of the last line asked for.
+const char *get_scroll_line(Scroll_History *history, size_t index)
+{
+    if (index >= history->cold_lines)
+        return history->arena + history->lines[(history->head + index - history->cold_lines) % history->slots].offset;
+
+    size_t b = find_block(history, index);
+    Block_Cache_Slot *slot = load_block(history, b);
+    if (slot == NULL)
+        return ""; // Unreadable block, show the lines as empty
+    return slot->data + slot->starts[2 * (index - history->blocks[b].first_line)];
+}
+
+size_t get_scroll_line_length(Scroll_History *history, size_t index)
+{
+    if (index >= history->cold_lines)
+        return history->lines[(history->head + index - history->cold_lines) % history->slots].length;
+
+    size_t b = find_block(history, index);
+    Block_Cache_Slot *slot = load_block(history, b);
+    if (slot == NULL)
+        return 0;
+    size_t k = index - history->blocks[b].first_line;
+    return slot->starts[2 * k + 1] - slot->starts[2 * k] - 1;
+}
+
+// The attribute runs of a line, `*count` of them, valid as long as its text
+const Attr_Run *get_scroll_runs(Scroll_History *history, size_t index, size_t *count)
+{
+    if (index >= history->cold_lines)
+    {
+        const Scroll_Line *l = &history->lines[(history->head + index - history->cold_lines) % history->slots];
+        *count = l->runs;
+        return (const Attr_Run *)(history->arena + l->offset + l->length + 1);
+    }
+
+    size_t b = find_block(history, index);
+    Block_Cache_Slot *slot = load_block(history, b);
+    *count = 0;
+    if (slot == NULL)
+        return NULL;
+    size_t k = index - history->blocks[b].first_line;
+    uint32_t header[2];
+    memcpy(header, slot->data + slot->starts[2 * k] - sizeof(header), sizeof(header));
+    *count = header[1];
+    return (const Attr_Run *)(slot->data + slot->starts[2 * k + 1]);
+}
+
+void clear_scroll_history(Scroll_History *history)
+{
+    free(history->arena);
+    history->arena = NULL;
+    history->arena_size = 0;
+    history->arena_used = 0;
+    history->head = 0;
+    history->hot_count = 0;
+    drop_cold_tier(history);
+    history->length = 0;
+}
@@ -0,0 +1,90 @@
+#ifndef SCROLLBACK_H
+#define SCROLLBACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "ansi.h"
+
+#define ARENA_MIN_SIZE 4096                      // Smallest scrollback arena allocation
+#define MIN_HOT_LINES 1024                       // Starting number of hot line slots
+#define SPILL_BLOCK_BYTES (64 * 1024)            // Line text compressed together into one cold block
+#define SCROLLBACK_BUDGET_ENV "MY_SHELL_SCROLLBACK_MB" // Overrides the memory budget, in megabytes
+#define DEFAULT_SCROLLBACK_BUDGET (8 * 1024 * 1024)    // Bytes of scrollback kept in memory
+
+// Location of a single line inside the scrollback arena. The text is followed by a NUL
+// and then by its attribute runs.
+typedef struct
+{
+    size_t offset;   // Byte offset of the line's text in the arena
+    uint32_t length; // Length of the line, not counting the terminating NUL
+    uint32_t runs;   // Number of attribute runs after the NUL
+} Scroll_Line;
+
+// A run of old lines compressed together in the segment file. Each line is stored as its
+// length and run count (two uint32_t), the text, a NUL and the runs.
+typedef struct
+{
+    off_t offset;      // Where the compressed bytes start in the file
+    uint32_t packed;   // Compressed size
+    uint32_t raw;      // Size once decompressed
+    size_t first_line; // Scrollback index of the block's first line
+} Scroll_Block;
+
+// A cold block decompressed back into memory
+typedef struct
+{
+    long block;          // Index of the block held, -1 for an empty slot
+    unsigned long used;  // When the slot was last read, the least recent one is reused
+    char *data;
+    size_t data_size;
+    size_t *starts;      // Offsets of every line's text and runs in `data`, two per line
+    size_t starts_size;
+} Block_Cache_Slot;
+
+// Every line printed, oldest first. The newest lines stay hot in a ring over one arena;
+// once they outgrow the memory budget the oldest ones are compressed into blocks in an
+// unlinked temp file, and blocks are decompressed into a small cache when read again.
+typedef struct
+{
+    size_t length; // Lines held in total, cold and hot
+
+    // Hot tier
+    Scroll_Line *lines; // Line slots, oldest hot line at `head`
+    size_t slots;       // Number of slots in `lines`
+    size_t head;        // Slot of the oldest hot line
+    size_t hot_count;   // Number of hot lines
+    char *arena;        // Contiguous storage for the line text
+    size_t arena_size;  // Capacity of the arena in bytes
+    size_t arena_used;  // Bytes taken by live lines
+    size_t hot_budget;  // Bytes the hot tier may use before lines are spilled
+
+    // Cold tier
+    size_t cold_lines;    // Lines spilled to the file, they come before the hot ones
+    int fd;               // Segment file, -1 until the first spill
+    off_t file_size;
+    char *map;            // Read-only mapping of the file, remapped as it grows
+    size_t map_size;
+    Scroll_Block *blocks; // Block index, ordered by first line
+    size_t block_count;
+    size_t block_size;    // Bytes allocated for `blocks`
+    char *spill_buffer;   // Staging and compression buffers for one block
+    size_t spill_size;
+    char *packed_buffer;
+    size_t packed_size;
+    Block_Cache_Slot *cache;
+    size_t cache_slots;
+    unsigned long cache_clock;
+} Scroll_History;
+
+// Function prototypes
+void init_scroll_history(Scroll_History *history);
+void add_to_scroll_history(Scroll_History *history, const char *data);
+void add_to_scroll_history_n(Scroll_History *history, const char *data, size_t len);
+void add_to_scroll_history_runs(Scroll_History *history, const char *data, size_t len, const Attr_Run *runs, size_t run_count);
+const char *get_scroll_line(Scroll_History *history, size_t index);
+size_t get_scroll_line_length(Scroll_History *history, size_t index);
+const Attr_Run *get_scroll_runs(Scroll_History *history, size_t index, size_t *count);
+void clear_scroll_history(Scroll_History *history);
+
+#endif // SCROLLBACK_H
@@ -0,0 +1,205 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "output.h"
+#include "stats.h"
+
+static Command_Stats *commands = NULL; // One entry per command name, in first-run order
+static size_t command_count = 0;
+static size_t command_size = 0;
+
+static FILE *trace = NULL;      // Chrome trace being written, NULL when tracing is off
+static long long trace_start;   // Trace timestamps count from here
+
+long long monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static long long timeval_us(struct timeval tv)
+{
+    return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+static Command_Stats *find_stats(const char *name, size_t len)
+{
+    for (size_t i = 0; i < command_count; i++)
+        if (strncmp(commands[i].name, name, len) == 0 && commands[i].name[len] == '\0')
+            return &commands[i];
+
+    if (command_count == command_size)
+    {
+        size_t size = command_size ? command_size * 2 : 16;
+        Command_Stats *grown = realloc(commands, size * sizeof(Command_Stats));
+        if (grown == NULL)
+            return NULL;
+        commands = grown;
+        command_size = size;
+    }
+    Command_Stats *stats = &commands[command_count++];
+    *stats = (Command_Stats){.name = strndup(name, len)};
+    return stats;
+}
+
+// Write `text` as the inside of a JSON string
+static void write_json_string(FILE *f, const char *text)
+{
+    for (; *text; text++)
+    {
+        unsigned char c = *text;
+        if (c == '"' || c == '\\')
+            fprintf(f, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(f, "\\u%04x", c);
+        else
+            fputc(c, f);
+    }
+}
+
+// One complete ("X") event per command. The array is never closed: the trace format
+// allows that, so a trace cut short by a crash still loads.
+static void trace_command(const char *command, long long start_ns, long long end_ns, const struct rusage *usage)
+{
+    fprintf(trace, "{\"name\":\"");
+    write_json_string(trace, command);
+    fprintf(trace, "\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":1",
+            usage ? "external" : "builtin", (start_ns - trace_start) / 1e3, (end_ns - start_ns) / 1e3, (int)getpid());
+    if (usage)
+        fprintf(trace, ",\"args\":{\"user_us\":%lld,\"sys_us\":%lld,\"max_rss_kb\":%ld,\"nvcsw\":%ld,\"nivcsw\":%ld}",
+                timeval_us(usage->ru_utime), timeval_us(usage->ru_stime), usage->ru_maxrss, usage->ru_nvcsw, usage->ru_nivcsw);
+    fprintf(trace, "},\n");
+}
+
+// Add one run of `command` to the stats of its first word. `usage` holds the children's
+// resource use for external commands and is NULL for builtins.
+void record_command(const char *command, long long start_ns, long long end_ns, const struct rusage *usage)
+{
+    const char *name = command + strspn(command, " \t");
+    Command_Stats *stats = find_stats(name, strcspn(name, " \t|&"));
+    if (stats == NULL)
+        return;
+
+    long long wall_ns = end_ns - start_ns;
+    stats->count++;
+    stats->wall_ns += wall_ns;
+    int bucket = 0;
+    for (long long us = wall_ns / 1000; us > 1 && bucket < STATS_BUCKETS - 1; us >>= 1)
+        bucket++;
+    stats->buckets[bucket]++;
+
+    if (usage)
+    {
+        stats->user_us += timeval_us(usage->ru_utime);
+        stats->sys_us += timeval_us(usage->ru_stime);
+        if (usage->ru_maxrss > stats->max_rss_kb)
+            stats->max_rss_kb = usage->ru_maxrss;
+        stats->nvcsw += usage->ru_nvcsw;
+        stats->nivcsw += usage->ru_nivcsw;
+    }
+
+    if (trace)
+        trace_command(command, start_ns, end_ns, usage);
+}
+
+// Start writing a Chrome trace (chrome://tracing, Perfetto) of every command to `path`
+bool open_trace(const char *path)
+{
+    close_trace();
+    trace = fopen(path, "we"); // Close on exec, commands spawned later must not inherit it
+    if (trace == NULL)
+        return false;
+    trace_start = monotonic_ns();
+    fprintf(trace, "[\n");
+    return true;
+}
+
+void close_trace(void)
+{
+    if (trace)
+        fclose(trace);
+    trace = NULL;
+}
+
+// Format a duration in the largest unit that keeps it readable
+static void format_duration(char *buff, size_t size, double us)
+{
+    if (us < 1000)
+        snprintf(buff, size, "%.0fus", us);
+    else if (us < 1000000)
+        snprintf(buff, size, "%.1fms", us / 1000);
+    else
+        snprintf(buff, size, "%.2fs", us / 1000000);
+}
+
+static void print_histogram(const Command_Stats *stats)
+{
+    int first = 0, last = STATS_BUCKETS - 1;
+    while (first < last && stats->buckets[first] == 0)
+        first++;
+    while (last > first && stats->buckets[last] == 0)
+        last--;
+
+    unsigned long peak = 0;
+    for (int b = first; b <= last; b++)
+        if (stats->buckets[b] > peak)
+            peak = stats->buckets[b];
+
+    for (int b = first; b <= last; b++)
+    {
+        char low[16], high[16];
+        format_duration(low, sizeof(low), b == 0 ? 0 : (double)(1LL << b));
+        format_duration(high, sizeof(high), (double)(2LL << b));
+        char bar[STATS_BAR_WIDTH + 1];
+        int width = peak ? (int)((stats->buckets[b] * STATS_BAR_WIDTH + peak - 1) / peak) : 0;
+        memset(bar, '#', width);
+        bar[width] = '\0';
+        print_line("    %7s - %-7s %-*s %lu", low, high, STATS_BAR_WIDTH, bar, stats->buckets[b]);
+    }
+}
+
+// stats           per-command counts, times and wall time histograms
+// stats reset     forget everything recorded so far
+// stats trace F   write a Chrome trace of every command to F
+// stats trace off stop tracing
+void execute_stats(char **args)
+{
+    char *sub = args[0];
+    if (sub && strcmp(sub, "reset") == 0)
+    {
+        for (size_t i = 0; i < command_count; i++)
+            free(commands[i].name);
+        command_count = 0;
+        return;
+    }
+    if (sub && strcmp(sub, "trace") == 0)
+    {
+        char *path = args[1];
+        if (path == NULL || strcmp(path, "off") == 0)
+            close_trace();
+        else if (!open_trace(path))
+            print_error("stats: cannot open `%s`", path);
+        return;
+    }
+    if (sub)
+    {
+        print_error("usage: stats [reset | trace FILE | trace off]");
+        return;
+    }
+
+    print_line("%-16s %6s %9s %9s %9s %9s %8s %8s", "command", "runs", "total", "mean", "user", "sys", "maxrss", "ctxsw");
+    for (size_t i = 0; i < command_count; i++)
+    {
+        Command_Stats *s = &commands[i];
+        char total[16], mean[16], user[16], sys[16];
+        format_duration(total, sizeof(total), s->wall_ns / 1e3);
+        format_duration(mean, sizeof(mean), s->wall_ns / 1e3 / s->count);
+        format_duration(user, sizeof(user), s->user_us);
+        format_duration(sys, sizeof(sys), s->sys_us);
+        print_line("%-16s %6lu %9s %9s %9s %9s %6ldKB %8lld", s->name, s->count, total, mean, user, sys, s->max_rss_kb, s->nvcsw + s->nivcsw);
+        print_histogram(s);
+    }
+}
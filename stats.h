@@ -0,0 +1,30 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdbool.h>
+#include <sys/resource.h>
+
+#define STATS_BUCKETS 32    // Wall time histogram buckets, bucket i counts runs of [2^i, 2^(i+1)) us
+#define STATS_BAR_WIDTH 40  // Widest histogram bar printed by `stats`
+#define TRACE_ENV "MY_SHELL_TRACE" // Names a trace file to open at startup
+
+// Everything recorded for one command name
+typedef struct
+{
+    char *name;
+    unsigned long count;
+    long long wall_ns;          // Total wall time
+    long long user_us, sys_us;  // Total CPU time of the children, externals only
+    long max_rss_kb;            // Largest max RSS of any run
+    long long nvcsw, nivcsw;    // Voluntary and involuntary context switches
+    unsigned long buckets[STATS_BUCKETS];
+} Command_Stats;
+
+// Function prototypes
+long long monotonic_ns(void);
+void record_command(const char *command, long long start_ns, long long end_ns, const struct rusage *usage);
+bool open_trace(const char *path);
+void close_trace(void);
+void execute_stats(char **args);
+
+#endif // STATS_H
@@ -0,0 +1,120 @@
+#include <stdint.h>
+#include <string.h>
+#include "substring.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+// Every kernel below filters candidate positions on the needle's first and last bytes,
+// then confirms the bytes in between with memcmp. Comparing two bytes that sit far apart
+// throws away almost every false start, even for needles made of common letters.
+
+const char *find_substring_scalar(const char *haystack, size_t length, const char *needle, size_t needle_len)
+{
+    if (needle_len == 0)
+        return haystack;
+    if (needle_len > length)
+        return NULL;
+
+    char first = needle[0];
+    char last = needle[needle_len - 1];
+    for (size_t i = 0; i + needle_len <= length; i++)
+    {
+        if (haystack[i] == first && haystack[i + needle_len - 1] == last &&
+            (needle_len < 2 || memcmp(haystack + i + 1, needle + 1, needle_len - 2) == 0))
+            return haystack + i;
+    }
+    return NULL;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// 16 positions per step: one load at the position, one at the position plus the needle length
+__attribute__((target("sse2"))) const char *find_substring_sse2(const char *haystack, size_t length, const char *needle, size_t needle_len)
+{
+    if (needle_len < 2 || needle_len > length)
+        return find_substring_scalar(haystack, length, needle, needle_len);
+
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[needle_len - 1]);
+    size_t i = 0;
+    for (; i + needle_len - 1 + 16 <= length; i += 16)
+    {
+        __m128i block_first = _mm_loadu_si128((const __m128i *)(haystack + i));
+        __m128i block_last = _mm_loadu_si128((const __m128i *)(haystack + i + needle_len - 1));
+        uint32_t mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(block_first, first), _mm_cmpeq_epi8(block_last, last)));
+        while (mask)
+        {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(haystack + i + bit + 1, needle + 1, needle_len - 2) == 0)
+                return haystack + i + bit;
+            mask &= mask - 1;
+        }
+    }
+    return find_substring_scalar(haystack + i, length - i, needle, needle_len);
+}
+
+// Same filter as the SSE2 kernel, 32 positions per step
+__attribute__((target("avx2"))) const char *find_substring_avx2(const char *haystack, size_t length, const char *needle, size_t needle_len)
+{
+    if (needle_len < 2 || needle_len > length)
+        return find_substring_scalar(haystack, length, needle, needle_len);
+
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[needle_len - 1]);
+    size_t i = 0;
+    for (; i + needle_len - 1 + 32 <= length; i += 32)
+    {
+        __m256i block_first = _mm256_loadu_si256((const __m256i *)(haystack + i));
+        __m256i block_last = _mm256_loadu_si256((const __m256i *)(haystack + i + needle_len - 1));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(block_first, first), _mm256_cmpeq_epi8(block_last, last)));
+        while (mask)
+        {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(haystack + i + bit + 1, needle + 1, needle_len - 2) == 0)
+                return haystack + i + bit;
+            mask &= mask - 1;
+        }
+    }
+    return find_substring_sse2(haystack + i, length - i, needle, needle_len);
+}
+
+#endif
+
+static Substring_Fn kernel;
+static const char *kernel_name;
+
+// Pick the widest kernel this CPU can run, once
+static void choose_kernel(void)
+{
+    kernel = find_substring_scalar;
+    kernel_name = "scalar";
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        kernel = find_substring_avx2;
+        kernel_name = "avx2";
+    }
+    else if (__builtin_cpu_supports("sse2"))
+    {
+        kernel = find_substring_sse2;
+        kernel_name = "sse2";
+    }
+#endif
+}
+
+const char *find_substring(const char *haystack, size_t length, const char *needle, size_t needle_len)
+{
+    if (kernel == NULL)
+        choose_kernel();
+    return kernel(haystack, length, needle, needle_len);
+}
+
+const char *substring_kernel_name(void)
+{
+    if (kernel == NULL)
+        choose_kernel();
+    return kernel_name;
+}
@@ -0,0 +1,18 @@
+#ifndef SUBSTRING_H
+#define SUBSTRING_H
+
+#include <stddef.h>
+
+// Finds the first occurrence of a needle in a haystack, like memmem
+typedef const char *(*Substring_Fn)(const char *haystack, size_t length, const char *needle, size_t needle_len);
+
+// Function prototypes
+const char *find_substring(const char *haystack, size_t length, const char *needle, size_t needle_len);
+const char *substring_kernel_name(void);
+const char *find_substring_scalar(const char *haystack, size_t length, const char *needle, size_t needle_len);
+#if defined(__x86_64__) || defined(__i386__)
+const char *find_substring_sse2(const char *haystack, size_t length, const char *needle, size_t needle_len);
+const char *find_substring_avx2(const char *haystack, size_t length, const char *needle, size_t needle_len);
+#endif
+
+#endif // SUBSTRING_H
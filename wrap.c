@@ -0,0 +1,98 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <ncurses.h>
+#include "wrap.h"
+
+// Rows a scrollback line takes at `width` columns, one byte per cell. An empty line still
+// takes a row.
+size_t wrap_line_rows(Scroll_History *history, size_t line, int width)
+{
+    size_t length = get_scroll_line_length(history, line);
+    return length ? (length + width - 1) / width : 1;
+}
+
+// Whether row `a` comes before row `b`
+bool wrap_before(Wrap_Position a, Wrap_Position b)
+{
+    return a.line < b.line || (a.line == b.line && a.row < b.row);
+}
+
+// Move `pos` `n` rows down, or up when negative, stopping at the oldest row and at the end
+// of the scrollback. Whole lines are stepped over at once, so the cost is one length lookup
+// per line passed however long the lines are. Returns the rows moved, negative going up.
+long wrap_move(Scroll_History *history, Wrap_Position *pos, long n, int width)
+{
+    long moved = 0;
+    while (moved < n && pos->line < history->length)
+    {
+        long left = wrap_line_rows(history, pos->line, width) - pos->row; // Rows to the next line
+        if (left > n - moved)
+        {
+            pos->row += n - moved;
+            return n;
+        }
+        pos->line++;
+        pos->row = 0;
+        moved += left;
+    }
+    while (moved > n && (pos->line > 0 || pos->row > 0))
+    {
+        if (pos->row == 0)
+        {
+            pos->line--;
+            pos->row = wrap_line_rows(history, pos->line, width); // Just past its last row
+        }
+        long step = (long)pos->row < moved - n ? (long)pos->row : moved - n;
+        pos->row -= step;
+        moved -= step;
+    }
+    return moved;
+}
+
+// Rows from `from` down to `to`, counting no further than `limit`
+long wrap_distance(Scroll_History *history, Wrap_Position from, Wrap_Position to, long limit, int width)
+{
+    long rows = 0;
+    while (rows < limit && wrap_before(from, to))
+    {
+        if (from.line == to.line)
+        {
+            rows += to.row - from.row;
+            break;
+        }
+        rows += wrap_line_rows(history, from.line, width) - from.row;
+        from.line++;
+        from.row = 0;
+    }
+    return rows < limit ? rows : limit;
+}
+
+// Work out the `count` rows from `top` down. Past the end of the scrollback they are the
+// prompt's rows, numbered from 0.
+void build_wrap_index(Wrap_Index *index, Scroll_History *history, Wrap_Position top, int count, int width)
+{
+    if (count > index->size)
+    {
+        Wrap_Position *rows = realloc(index->rows, count * sizeof(Wrap_Position));
+        if (rows == NULL)
+        {
+            perror("Error allocating the wrap index");
+            endwin();
+            exit(EXIT_FAILURE);
+        }
+        index->rows = rows;
+        index->size = count;
+    }
+
+    Wrap_Position pos = top;
+    for (int r = 0; r < count; r++)
+    {
+        index->rows[r] = pos;
+        if (pos.line < history->length)
+            wrap_move(history, &pos, 1, width);
+        else
+            pos.row++;
+    }
+    index->count = count;
+    index->width = width;
+}
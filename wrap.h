@@ -0,0 +1,34 @@
+#ifndef WRAP_H
+#define WRAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "scrollback.h"
+
+// One screen row of scrollback: the part of line `line` from byte `row * width` on. A
+// `line` equal to the scrollback length stands for the prompt's rows below the newest line.
+typedef struct
+{
+    size_t line;
+    size_t row;
+} Wrap_Position;
+
+// Where each row of the window comes from, worked out from the top row for one width.
+// Only the rows on screen are ever wrapped, so building it costs the same however long the
+// scrollback is, and a resize only has to build it again.
+typedef struct
+{
+    Wrap_Position *rows;
+    int count; // Window rows held
+    int size;  // Rows allocated
+    int width; // Columns the lines were wrapped at
+} Wrap_Index;
+
+// Function prototypes
+size_t wrap_line_rows(Scroll_History *history, size_t line, int width);
+bool wrap_before(Wrap_Position a, Wrap_Position b);
+long wrap_move(Scroll_History *history, Wrap_Position *pos, long n, int width);
+long wrap_distance(Scroll_History *history, Wrap_Position from, Wrap_Position to, long limit, int width);
+void build_wrap_index(Wrap_Index *index, Scroll_History *history, Wrap_Position top, int count, int width);
+
+#endif // WRAP_H